@@ -6,24 +6,56 @@
  *************************************************************************************************/
 #include "Common.h"
 
-#include <array>
+#include <cmath>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <curl/curl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <time.h>
 
-#define PIPE_END 2
-#define CHILD 0
-#define PARENT 1
 #define BACKLOG 5
 #define ALWAYS_TRUE 1
 #define COMMAND 1
 #define EXIT 2
-#define JOB_TO_DO "curl -w %{time_connect} -o /dev/null -s "
+#define RESET_DONE 3 ///< Worker -> Agent, the worker dropped every job after an OP_RESET.
+#define MAX_PROBE_TRANSFERS 256 ///< Maximum concurrent transfers a probe engine keeps in flight.
+#define PROBE_TIMEOUT_MS 30000   ///< Upper bound of a single probe, connect included.
+#define TXN_BODY_MAX_LEN (1 << 20) ///< Bytes of a response body a transaction step extracts values from, at most.
+#define MAX_EPOLL_EVENTS 64      ///< Events fetched from epoll per wakeup.
+#define WHEEL_TICK_MS 10         ///< Resolution of the job scheduler.
+#define WHEEL_LEVELS 4           ///< Levels of the hierarchical timer wheel.
+#define WHEEL_SLOT_BITS 6        ///< Each wheel level has 2^WHEEL_SLOT_BITS slots.
+#define BATCH_DELAY_MS 5         ///< Default time a result may wait for others to share its frame.
+#define BATCH_MAX_BYTES (32 << 10) ///< A batch this large is sent without waiting for the delay.
+#define RESULT_BACKLOG_BYTES (8 << 20) ///< Results kept for Core while it is away, the oldest are dropped beyond.
+#define WORKER_RING_LEN 4096       ///< Results a worker queues for the Agent thread before it waits.
+#define WORKER_BATCH_LEN 256       ///< Results the Agent thread takes from a worker at once.
+#define REBALANCE_MOVES 64         ///< Jobs moved between workers per housekeeping round at most.
+#define LOAD_REPORT_MS 5000        ///< Interval between two load reports to Core.
+#define GOLDEN_RATIO_32 2654435769u ///< 2^32 / golden ratio, job id times it spreads the phases of the jobs.
+#define ADAPT_WARMUP_RUNS 5        ///< Results an adaptive job learns its latency from before it looks for anomalies.
+#define ADAPT_STABLE_RUNS 3        ///< Healthy runs in a row after which an adaptive job doubles its period.
+#define ADAPT_CONFIRM_RUNS 5       ///< Runs at the shortest period after a failure or a latency anomaly.
+#define ADAPT_ANOMALY_DEVS 4       ///< A total time this many mean deviations above the average is an anomaly,
+#define ADAPT_ANOMALY_RATIO 0.5    ///< provided it is also this part of the average above it.
 
 using namespace std;
 
@@ -31,13 +63,9 @@ namespace
 {
     // #region Global Variables
 
-    int32_t port[MAX_AGENT] = {8100, 8200, 8300};
-    char ip[MAX_AGENT][32] = {"127.0.0.1", "127.0.0.1", "127.0.0.1"};
-    int32_t socket_fd[MAX_AGENT_WORKER][PIPE_END];
-    struct pollfd poll_fd[MAX_AGENT_WORKER + 1]; // One for connection with core.
-
-    int32_t g_worker = MAX_AGENT_WORKER;
-    bool is_stop = false;
+    int32_t g_workers = 0; // One per CPU the agent may run on unless given.
+    int32_t g_batch_delay_ms = BATCH_DELAY_MS;
+    string g_ca_file; // Extra CA bundle probes trust instead of the system one, if given.
 
     // #endregion
 
@@ -58,7 +86,46 @@ namespace
 
     void PrintUsage()
     {
-        printf("Usage: ./agent <Id>");
+        printf("Usage: ./agent [-l <host>:<port>] [-b <batch-delay-ms>] [-w <workers>] [-c <ca-file>] [-m <metrics-host>:<port>] <Id>");
+    }
+
+    uint64_t NowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    /**
+     * @brief Get the CPUs the process may run on, the worker threads are pinned to them.
+     */
+    vector<int32_t> AllowedCpus()
+    {
+        vector<int32_t> cpus;
+        cpu_set_t set;
+
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int32_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if (CPU_ISSET(cpu, &set))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        else
+        {
+            cerr << "sched_getaffinity: " << strerror(errno) << std::endl;
+        }
+
+        if (cpus.empty())
+        {
+            cpus.push_back(0);
+        }
+
+        return cpus;
     }
 
     // #endregion
@@ -66,6 +133,162 @@ namespace
 
 namespace AgentImplementation
 {
+    /**
+     * @class Reactor
+     *
+     * @brief Edge-triggered epoll event loop dispatching readiness to a handler per file descriptor.
+     *
+     * Handlers are edge-triggered, so each of them must drain its fd until EAGAIN before returning.
+     */
+    class Reactor
+    {
+    public:
+        typedef function<void(uint32_t)> Handler;
+
+        /**
+         * @brief Construct a new Reactor object.
+         */
+        Reactor()
+        {
+            if ((_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            {
+                cerr << "epoll_create1: " << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        /**
+         * @brief Destroy the Reactor object.
+         */
+        ~Reactor()
+        {
+            close(_epoll_fd);
+        }
+
+        Reactor(const Reactor &) = delete;
+        Reactor &operator=(const Reactor &) = delete;
+
+        /**
+         * @brief Register a file descriptor.
+         *
+         * @param fd File descriptor to watch.
+         * @param events Epoll event mask, like EPOLLIN.
+         * @param handler Callback receiving the ready events.
+         * @param edge Edge-triggered when true, level-triggered otherwise.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Add(int32_t fd, uint32_t events, Handler handler, bool edge = true)
+        {
+            struct epoll_event ev;
+            ev.events = events | (edge ? EPOLLET : 0);
+            ev.data.fd = fd;
+
+            if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            {
+                cerr << "epoll_ctl: " << strerror(errno) << std::endl;
+                return -1;
+            }
+
+            _handlers[fd] = make_shared<Handler>(handler);
+
+            return 0;
+        }
+
+        /**
+         * @brief Change the events watched on an already registered file descriptor.
+         *
+         * @param fd File descriptor to update.
+         * @param events Epoll event mask, like EPOLLIN.
+         * @param edge Edge-triggered when true, level-triggered otherwise.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Modify(int32_t fd, uint32_t events, bool edge = true)
+        {
+            struct epoll_event ev;
+            ev.events = events | (edge ? EPOLLET : 0);
+            ev.data.fd = fd;
+
+            if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+            {
+                cerr << "epoll_ctl: " << strerror(errno) << std::endl;
+                return -1;
+            }
+
+            return 0;
+        }
+
+        /**
+         * @brief Stop watching a file descriptor, the caller still owns and closes it.
+         *
+         * @param fd File descriptor to forget.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Remove(int32_t fd)
+        {
+            _handlers.erase(fd);
+            if (epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr) < 0)
+            {
+                cerr << "epoll_ctl: " << strerror(errno) << std::endl;
+                return -1;
+            }
+
+            return 0;
+        }
+
+        /**
+         * @brief Wait for events and dispatch every one of them.
+         *
+         * @param timeout_ms Maximum time to wait, -1 waits forever.
+         * @param metrics Block accounting the time spent dispatching, or null.
+         *
+         * @return int32_t Number of dispatched events, -1 on failure.
+         */
+        int32_t RunOnce(int32_t timeout_ms, MetricBlock *metrics = nullptr)
+        {
+            struct epoll_event events[MAX_EPOLL_EVENTS];
+
+            int32_t count = epoll_wait(_epoll_fd, events, MAX_EPOLL_EVENTS, timeout_ms);
+            if (count < 0)
+            {
+                if (errno != EINTR)
+                {
+                    cerr << "epoll_wait: " << strerror(errno) << std::endl;
+                    return -1;
+                }
+                return 0;
+            }
+
+            uint64_t start_us = (metrics != nullptr && count > 0) ? MonotonicUs() : 0;
+            for (int32_t index = 0; index < count; index++)
+            {
+                auto itr = _handlers.find(events[index].data.fd);
+                if (itr == _handlers.end())
+                {
+                    continue; // Removed by an earlier handler of this batch.
+                }
+
+                // Hold a reference, the handler is allowed to remove itself.
+                shared_ptr<Handler> handler = itr->second;
+                (*handler)(events[index].events);
+            }
+
+            if (start_us != 0)
+            {
+                metrics->Add(METRIC_LOOP_US, MonotonicUs() - start_us);
+                metrics->Add(METRIC_LOOP_COUNT, 1);
+            }
+
+            return count;
+        }
+
+    private:
+        int32_t _epoll_fd;
+        unordered_map<int32_t, shared_ptr<Handler>> _handlers;
+    };
+
     /**
      * @class Agent
      *
@@ -78,8 +301,10 @@ namespace AgentImplementation
          * @brief Construct a new Agent object.
          *
          * @param id A unique agent identifier.
+         * @param host Address to listen on.
+         * @param port Port to listen on.
          */
-        Agent(int32_t id) : _agent_id(id)
+        Agent(int32_t id, const string &host, int32_t port) : _agent_id(id), _host(host), _port(port)
         {
             int32_t optval_on = 1;
 
@@ -107,17 +332,24 @@ namespace AgentImplementation
          */
         int32_t Bind()
         {
-            struct sockaddr_in serv_addr;
+            struct addrinfo hints;
+            struct addrinfo *addr = nullptr;
 
-            serv_addr.sin_family = AF_INET;
-            serv_addr.sin_port = htons(port[_agent_id - 1]);
-            if (inet_pton(AF_INET, ip[_agent_id - 1], &serv_addr.sin_addr) <= 0)
+            bzero(&hints, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+
+            int32_t ret = getaddrinfo(_host.c_str(), to_string(_port).c_str(), &hints, &addr);
+            if (ret != 0)
             {
-                cerr << "Invalid address:" << ip[_agent_id - 1] << std::endl;
+                cerr << "Invalid address:" << _host << ": " << gai_strerror(ret) << std::endl;
                 exit(EXIT_FAILURE);
             }
 
-            if ((::bind(_sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr))) != 0)
+            ret = ::bind(_sock_fd, addr->ai_addr, addr->ai_addrlen);
+            freeaddrinfo(addr);
+            if (ret != 0)
             {
                 cerr << "bind: " << strerror(errno) << std::endl;
                 exit(EXIT_FAILURE);
@@ -144,35 +376,31 @@ namespace AgentImplementation
             }
             else
             {
-                cout << "Agent " << _agent_id << " is listening." << endl;
+                cout << "Agent " << _agent_id << " is listening on " << _host << ":" << _port << "." << endl;
             }
 
+            fcntl(_sock_fd, F_SETFL, O_NONBLOCK); // Core connections are accepted from the agent reactor.
+
             return 0;
         }
 
         /**
-         * @brief To accept the connection request from the Core.
+         * @brief To accept a pending connection request from the Core.
          *
-         * @return int32_t Status code.
+         * @return int32_t The non-blocking connection fd, -1 if no connection is pending.
          */
         int32_t Accept()
         {
             struct sockaddr_in cli_addr;
-            uint32_t cli_addr_length = sizeof(cli_addr);
+            socklen_t cli_addr_length = sizeof(cli_addr);
 
-            _conn_fd = ::accept(_sock_fd, (struct sockaddr *)&cli_addr, &cli_addr_length);
-            if (_conn_fd < 0)
+            int32_t conn_fd = ::accept4(_sock_fd, (struct sockaddr *)&cli_addr, &cli_addr_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (conn_fd < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
             {
                 cerr << "accept: " << strerror(errno) << std::endl;
-                exit(EXIT_FAILURE);
             }
 
-            /* Add core connection fd for polling */
-            poll_fd[g_worker].fd = _conn_fd;
-            poll_fd[g_worker].events = POLLIN;
-            fcntl(_conn_fd, F_SETFL, O_NONBLOCK);
-
-            return 0;
+            return conn_fd;
         }
 
         /**
@@ -185,333 +413,2012 @@ namespace AgentImplementation
             return _sock_fd;
         }
 
-        /**
-         * @brief Get the new fd got created after successful connection with core.
-         *
-         * @return int32_t A connection fd.
-         */
-        int32_t GetConnectionFd()
-        {
-            return _conn_fd;
-        }
-
     private:
         int32_t _agent_id;
+        string _host;
+        int32_t _port;
         int32_t _sock_fd = 0;
-        int32_t _conn_fd = 0;
     };
 
     /**
-     * @class Worker
+     * @brief Timings and status collected for one finished probe, durations are in microseconds.
+     */
+    struct ProbeResult
+    {
+        int32_t code;       ///< Transfer status, CURLE_OK on success, or TXN_ERROR_* for a transaction.
+        long http_code;     ///< Last HTTP status code received, 0 if none.
+        curl_off_t dns;     ///< Name resolution.
+        curl_off_t connect; ///< TCP handshake.
+        curl_off_t tls;     ///< TLS handshake, 0 without TLS.
+        curl_off_t ttfb;    ///< Request sent until the first response byte.
+        curl_off_t total;   ///< Whole transfer.
+        curl_off_t bytes;   ///< Body bytes downloaded.
+        vector<StepTiming> steps; ///< Steps run by a transaction, the fields above being their sums.
+    };
+
+    /**
+     * @brief Fit a libcurl duration into a result field.
+     */
+    static uint32_t ClampUs(curl_off_t value)
+    {
+        return (value < 0) ? 0 : (value > UINT32_MAX ? UINT32_MAX : (uint32_t)value);
+    }
+
+    /**
+     * @class ProbeEngine
+     *
+     * @brief In-process probe executor built on top of the libcurl multi interface.
      *
-     * @brief Concrete implementation worker that performs the task delegated by Agent.
+     * Probes are submitted as requests and driven concurrently from the reactor of the owning worker: libcurl
+     * sockets and its timeout are registered with the reactor, timings are read straight from libcurl once a
+     * transfer completes.
+     *
+     * A cold probe reuses nothing, the same as running the curl command line for each measurement. Warm probes
+     * share a cache of connections, TLS sessions and DNS answers with every other warm probe of the engine.
+     *
+     * A transaction runs its steps one after the other on the same easy handle, so that they keep one connection and
+     * the cookies of the session. A cold one keeps its connection in a cache of its own, closed when it ends. Values
+     * extracted from the body of a step are substituted in the steps after it. The transaction stops at the first step
+     * that fails.
      */
-    class Worker
+    class ProbeEngine
     {
     public:
+        typedef function<void(const Request &, const ProbeResult &)> Callback;
+
         /**
-         * @brief Construct a new Worker object.
+         * @brief Construct a new Probe Engine object.
          *
-         * @param num Number of worker as Agent want to create.
+         * @param reactor Event loop driving the transfers.
+         * @param on_done Callback invoked once per finished probe.
          */
-        Worker(int32_t num) : _worker_num(num)
+        ProbeEngine(Reactor &reactor, Callback on_done) : _reactor(reactor), _on_done(on_done)
         {
-            if (socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fd[_worker_num]) < 0)
+            if ((_multi = curl_multi_init()) == nullptr)
             {
-                perror("opening stream socket pair");
+                cerr << "curl_multi_init failed." << endl;
                 exit(EXIT_FAILURE);
             }
 
-            poll_fd[_worker_num].fd = socket_fd[_worker_num][PARENT];
-            poll_fd[_worker_num].events = POLLIN;
-            fcntl(socket_fd[_worker_num][PARENT], F_SETFL, O_NONBLOCK);
-        }
+            if ((_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+            {
+                cerr << "timerfd_create: " << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
 
-        /**
-         * @brief Destroy the Worker object.
-         */
-        ~Worker() = default;
+            if ((_share = curl_share_init()) == nullptr)
+            {
+                cerr << "curl_share_init failed." << endl;
+                exit(EXIT_FAILURE);
+            }
+
+            // The engine is single threaded, so the share needs no lock callbacks.
+            curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+            curl_multi_setopt(_multi, CURLMOPT_MAXCONNECTS, (long)MAX_PROBE_TRANSFERS);
+            curl_multi_setopt(_multi, CURLMOPT_SOCKETFUNCTION, OnSocket);
+            curl_multi_setopt(_multi, CURLMOPT_SOCKETDATA, this);
+            curl_multi_setopt(_multi, CURLMOPT_TIMERFUNCTION, OnTimer);
+            curl_multi_setopt(_multi, CURLMOPT_TIMERDATA, this);
+
+            _reactor.Add(_timer_fd, EPOLLIN, [this](uint32_t) {
+                uint64_t expirations;
+                while (read(_timer_fd, &expirations, sizeof(expirations)) > 0)
+                {
+                }
+                SocketAction(CURL_SOCKET_TIMEOUT, 0);
+            });
+        }
 
         /**
-         * @brief Execute the CLI type command on system
-         *
-         * @param cmd A CLI command to be executed.
-         *
-         * @return string The result it has got after executing the job request.
+         * @brief Destroy the Probe Engine object, aborting the transfers still in flight.
          */
-        string RunJob(const char *cmd)
+        ~ProbeEngine()
         {
-            array<char, 128> buffer;
-            string result;
-
-            unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd, "r"), pclose);
-            if (!pipe)
+            for (Transfer *transfer : _active)
             {
-                throw runtime_error("popen() failed!");
+                curl_multi_remove_handle(_multi, transfer->easy);
+                curl_easy_cleanup(transfer->easy);
+                delete transfer;
             }
 
-            while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr)
+            for (CURL *easy : _idle)
             {
-                result += buffer.data();
+                curl_easy_cleanup(easy);
             }
 
-            return result;
+            curl_multi_cleanup(_multi);
+            curl_share_cleanup(_share);
+            _reactor.Remove(_timer_fd);
+            close(_timer_fd);
         }
 
+        ProbeEngine(const ProbeEngine &) = delete;
+        ProbeEngine &operator=(const ProbeEngine &) = delete;
+
         /**
-         * @brief Run the job assigned by Agent to this worker.
+         * @brief Queue a probe for execution, it starts as soon as a transfer slot is free.
          *
-         * @param req A job request from Core server.
+         * @param req A job request holding the URL under test.
          */
-        void ServeRequest(Request &req)
+        void Submit(const Request &req)
         {
-            int32_t ret;
-            int32_t run_count = 0;
-            string cmd;
-            Response resp;
+            _pending.push_back(req);
+            StartPending();
+        }
 
-            switch (req.op)
-            {
-            case 1:
+        /**
+         * @brief Get the number of probes not yet completed.
+         *
+         * @return size_t Count of in-flight and queued probes.
+         */
+        size_t GetPendingCount()
+        {
+            return _active.size() + _pending.size();
+        }
+
+    private:
+        /**
+         * @brief Book keeping of a single transfer handed to libcurl.
+         */
+        struct Transfer
+        {
+            CURL *easy = nullptr;
+            Request req;
+            size_t step = 0;                     // Step of a transaction running now.
+            ProbeResult total = ProbeResult();   // Sums over the steps done.
+            curl_slist *headers = nullptr;       // Request headers of the step, libcurl does not copy them.
+            string body;                         // Response body of a step extracting values.
+            unordered_map<string, string> values; // Extracted by the steps done.
+            CURLSH *share = nullptr;             // Connection cache of a cold transaction, the easy handle goes first.
+
+            ~Transfer()
             {
-                cmd = JOB_TO_DO;
-                cmd = cmd.append(req.url);
-                while (!is_stop)
+                curl_slist_free_all(headers);
+                if (share != nullptr)
                 {
-                    cout << "Executing job: " << cmd << endl;
-                    string output = RunJob(cmd.c_str());
-                    cout << "Output: " << output << endl;
-                    resp.option = COMMAND;
-                    resp.status = stod(output);
-                    resp.runs = ++run_count;
-                    strcpy(resp.url, req.url);
-
-                    ret = write(socket_fd[req.worker - 1][CHILD], &resp, sizeof(resp));
-                    if (ret < 0)
-                    {
-                        perror("write");
-                    }
-
-                    sleep(req.freq);
+                    curl_share_cleanup(share); // Closes the connection, however many steps ran.
                 }
             }
-            break;
-            case 2:
+        };
+
+        /**
+         * @brief libcurl socket callback, mirrors the sockets libcurl wants watched into the reactor.
+         */
+        static int OnSocket(CURL *, curl_socket_t sock, int what, void *userp, void *socketp)
+        {
+            ProbeEngine *engine = (ProbeEngine *)userp;
+
+            if (what == CURL_POLL_REMOVE)
             {
-                /*
-                 * TODO: This block is not in use but can be used to control Agents from Core.
-                 * kill all worker/process and exit.
-                 */
-                printf("Quit");
-                resp.option = EXIT;
-                ret = write(socket_fd[req.worker - 1][CHILD], &resp, sizeof(resp));
-                if (ret < 0)
+                if (socketp != nullptr)
                 {
-                    perror("write");
+                    engine->_reactor.Remove(sock);
+                    curl_multi_assign(engine->_multi, sock, nullptr);
                 }
+                return 0;
             }
-            break;
-            default:
-                printf("Please enter the correct option..!!");
+
+            uint32_t events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+
+            // libcurl does not promise to drain a socket, so its sockets are level-triggered.
+            if (socketp == nullptr)
+            {
+                engine->_reactor.Add(sock, events, [engine, sock](uint32_t ready) {
+                    int32_t flags = ((ready & EPOLLIN) ? CURL_CSELECT_IN : 0) | ((ready & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+                                    ((ready & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+                    engine->SocketAction(sock, flags);
+                }, false);
+                curl_multi_assign(engine->_multi, sock, engine);
+            }
+            else
+            {
+                engine->_reactor.Modify(sock, events, false);
             }
+
+            return 0;
         }
 
         /**
-         * @brief Initialize the worker request handler.
+         * @brief libcurl timer callback, arms the engine timer fd.
          */
-        void InitReqHandler()
+        static int OnTimer(CURLM *, long timeout_ms, void *userp)
         {
-            int32_t result = 0;
-            int32_t ret = 0;
-            Request req_worker;
+            ProbeEngine *engine = (ProbeEngine *)userp;
+            struct itimerspec its;
+            bzero(&its, sizeof(its));
 
-            result = fork();
-            if (result == -1)
+            if (timeout_ms == 0)
             {
-                cerr << "fork failed." << endl;
+                its.it_value.tv_nsec = 1; // Zero would disarm, fire as soon as possible instead.
             }
-            else if (result == CHILD)
+            else if (timeout_ms > 0)
             {
-                cout << "Worker Number: " << _worker_num + 1 << " ID: " << getpid() << endl;
-                while (ALWAYS_TRUE)
-                {
-                    ret = read(socket_fd[_worker_num][CHILD], (Request *)&req_worker, sizeof(req_worker));
-                    if (ret < 0)
-                    {
-                        perror("read");
-                    }
-                    cout << "--------------------------worker id = %d--------------------------" << getpid() << endl;
+                its.it_value.tv_sec = timeout_ms / 1000;
+                its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+            }
 
-                    ServeRequest(req_worker);
-                }
+            timerfd_settime(engine->_timer_fd, 0, &its, nullptr);
+
+            return 0;
+        }
+
+        /**
+         * @brief Let libcurl progress a socket or its timeout and collect finished transfers.
+         *
+         * @param sock Ready socket or CURL_SOCKET_TIMEOUT.
+         * @param flags CURL_CSELECT_* readiness flags.
+         */
+        void SocketAction(curl_socket_t sock, int32_t flags)
+        {
+            int32_t running = 0;
+
+            CURLMcode mc = curl_multi_socket_action(_multi, sock, flags, &running);
+            if (mc != CURLM_OK)
+            {
+                cerr << "curl_multi_socket_action: " << curl_multi_strerror(mc) << endl;
             }
+
+            Harvest();
         }
 
-    private:
-        int32_t _worker_num;
-    };
+        /**
+         * @brief Discard the response body, only the timings matter.
+         */
+        static size_t DiscardBody(char *, size_t size, size_t nmemb, void *)
+        {
+            return size * nmemb;
+        }
 
-    /**
-     * @brief Keep polling for the Worker's activity.
-     *
-     * @return int32_t Status code.
-     */
-    static int32_t WorkerPoll()
-    {
-        for (int32_t index = 0; index < g_worker; index++)
+        /**
+         * @brief Keep the response body of a transaction step, for the values to extract.
+         */
+        static size_t KeepBody(char *data, size_t size, size_t nmemb, void *userp)
+        {
+            string &body = ((Transfer *)userp)->body;
+            body.append(data, min(size * nmemb, TXN_BODY_MAX_LEN - min<size_t>(body.size(), TXN_BODY_MAX_LEN)));
+            return size * nmemb;
+        }
+
+        /**
+         * @brief Replace every ${name} of a text by the value extracted under that name.
+         */
+        static string Substitute(const string &text, unordered_map<string, string> &values)
         {
-            if (poll_fd[index].revents != 0)
+            string out;
+            size_t pos = 0;
+
+            for (size_t open; (open = text.find("${", pos)) != string::npos;)
             {
-                if (poll_fd[index].revents & POLLHUP)
-                {
-                    if (close(poll_fd[index].fd) == -1)
-                    {
-                        cerr << "close: " << strerror(errno) << endl;
-                    }
-                }
-                else if ((poll_fd[index].revents & POLLIN))
-                {
-                    return (index + 1);
-                }
-                else if (!(poll_fd[index].revents & POLLNVAL))
+                size_t close = text.find('}', open);
+                if (close == string::npos)
                 {
-                    if (close(poll_fd[index].fd) == -1)
-                    {
-                        cerr << "close: " << strerror(errno) << endl;
-                    }
+                    break;
                 }
+                out.append(text, pos, open - pos);
+                out += values[text.substr(open + 2, close - open - 2)];
+                pos = close + 1;
             }
-        }
 
-        return 0;
-    }
+            return out.append(text, pos, string::npos);
+        }
 
-    /**
-     * @brief Keep polling for the Core server activity.
-     *
-     * @return int32_t Status code.
-     */
-    static int32_t CorePoll()
-    {
-        if (poll_fd[g_worker].revents != 0)
+        /**
+         * @brief Set the request of the current step of a transaction on its easy handle. Options not set here keep the
+         *        value of the step before, so that the connection and cookies carry over.
+         */
+        static void SetupStep(Transfer *transfer)
         {
-            if (poll_fd[g_worker].revents & POLLHUP)
+            const TxnStep &step = transfer->req.steps[transfer->step];
+            CURL *easy = transfer->easy;
+
+            curl_easy_setopt(easy, CURLOPT_URL, Substitute(step.url, transfer->values).c_str());
+            if (step.method == "POST")
             {
-                if (close(poll_fd[g_worker].fd) == -1)
-                {
-                    cerr << "close: " << strerror(errno) << endl;
-                }
+                string body = Substitute(step.body, transfer->values);
+                curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)body.size());
+                curl_easy_setopt(easy, CURLOPT_COPYPOSTFIELDS, body.c_str());
             }
-            else if ((poll_fd[g_worker].revents & POLLIN))
+            else
             {
-                return 1;
+                curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
             }
-            else if (!(poll_fd[g_worker].revents & POLLNVAL))
+
+            curl_slist_free_all(transfer->headers);
+            transfer->headers = nullptr;
+            for (const string &header : step.headers)
             {
-                if (close(poll_fd[g_worker].fd) == -1)
-                {
-                    cerr << "close: " << strerror(errno) << endl;
-                }
+                transfer->headers = curl_slist_append(transfer->headers, Substitute(header, transfer->values).c_str());
             }
+            curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headers);
+
+            transfer->body.clear();
+            curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, step.extracts.empty() ? DiscardBody : KeepBody);
+            curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer);
         }
 
-        return 0;
-    }
+        /**
+         * @brief Account a finished step of a transaction, and start the next one unless the transaction is over.
+         *
+         * @param transfer Transaction, its easy handle already removed from the multi handle.
+         * @param result Timings and status of the step, replaced by those of the whole transaction once it is over.
+         *
+         * @return bool True when the next step was started.
+         */
+        bool NextStep(Transfer *transfer, ProbeResult &result)
+        {
+            const TxnStep &step = transfer->req.steps[transfer->step];
+            ProbeResult &total = transfer->total;
+
+            if (result.code == CURLE_OK && step.expect != 0 && result.http_code != step.expect)
+            {
+                result.code = TXN_ERROR_EXPECT;
+            }
+            for (size_t index = 0; result.code == CURLE_OK && index < step.extracts.size(); index++)
+            {
+                const TxnExtract &extract = step.extracts[index];
+                size_t begin = transfer->body.find(extract.left);
+                size_t end = (begin == string::npos || extract.right.empty()) ? string::npos
+                                                                              : transfer->body.find(extract.right, begin + extract.left.size());
+                if (begin == string::npos || (end == string::npos && !extract.right.empty()))
+                {
+                    result.code = TXN_ERROR_EXTRACT;
+                    break;
+                }
+                begin += extract.left.size();
+                transfer->values[extract.name] = transfer->body.substr(begin, end == string::npos ? string::npos : end - begin);
+            }
+
+            total.code = result.code;
+            total.http_code = result.http_code;
+            total.dns += result.dns;
+            total.connect += result.connect;
+            total.tls += result.tls;
+            total.ttfb += result.ttfb;
+            total.total += result.total;
+            total.bytes += result.bytes;
+            total.steps.push_back(StepTiming{(uint16_t)result.http_code, (uint16_t)result.code, ClampUs(result.dns), ClampUs(result.connect),
+                                             ClampUs(result.tls), ClampUs(result.ttfb), ClampUs(result.total), (uint64_t)max<curl_off_t>(result.bytes, 0)});
+
+            if (!IsFailedProbe(result.http_code, result.code) && ++transfer->step < transfer->req.steps.size())
+            {
+                SetupStep(transfer);
+                CURLMcode mc = curl_multi_add_handle(_multi, transfer->easy);
+                if (mc == CURLM_OK)
+                {
+                    return true;
+                }
+                cerr << "curl_multi_add_handle: " << curl_multi_strerror(mc) << endl;
+                total.code = CURLE_FAILED_INIT;
+            }
+
+            result = std::move(total);
+            return false;
+        }
+
+        /**
+         * @brief Move queued probes to libcurl while transfer slots are available.
+         */
+        void StartPending()
+        {
+            while (!_pending.empty() && _active.size() < MAX_PROBE_TRANSFERS)
+            {
+                CURL *easy = nullptr;
+                if (!_idle.empty())
+                {
+                    easy = _idle.back();
+                    _idle.pop_back();
+                    curl_easy_reset(easy);
+                }
+                else if ((easy = curl_easy_init()) == nullptr)
+                {
+                    cerr << "curl_easy_init failed." << endl;
+                    return;
+                }
+
+                Transfer *transfer = new Transfer();
+                transfer->easy = easy;
+                transfer->req = std::move(_pending.front());
+                _pending.pop_front();
+
+                curl_easy_setopt(easy, CURLOPT_URL, transfer->req.url.c_str());
+                curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer);
+                curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, DiscardBody);
+                curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+                curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, (long)PROBE_TIMEOUT_MS);
+                if (!g_ca_file.empty())
+                {
+                    curl_easy_setopt(easy, CURLOPT_CAINFO, g_ca_file.c_str());
+                }
+
+                if (transfer->req.mode == PROBE_WARM)
+                {
+                    curl_easy_setopt(easy, CURLOPT_SHARE, _share);
+                    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+                }
+                else
+                {
+                    curl_easy_setopt(easy, CURLOPT_FRESH_CONNECT, 1L);
+                    curl_easy_setopt(easy, CURLOPT_FORBID_REUSE, 1L);
+                    curl_easy_setopt(easy, CURLOPT_DNS_CACHE_TIMEOUT, 0L);
+                    curl_easy_setopt(easy, CURLOPT_SSL_SESSIONID_CACHE, 0L);
+                }
+
+                // Cookies live in the easy handle, which is dropped once the transaction is over. A cold transaction
+                // reuses nothing but its own connection, which no other transfer can pick from its cache. Without that
+                // cache each step opens and closes a connection, like a cold probe.
+                if (!transfer->req.steps.empty())
+                {
+                    if (transfer->req.mode == PROBE_COLD && (transfer->share = curl_share_init()) != nullptr)
+                    {
+                        curl_share_setopt(transfer->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+                        curl_easy_setopt(easy, CURLOPT_SHARE, transfer->share);
+                        curl_easy_setopt(easy, CURLOPT_FRESH_CONNECT, 0L);
+                        curl_easy_setopt(easy, CURLOPT_FORBID_REUSE, 0L);
+                    }
+                    curl_easy_setopt(easy, CURLOPT_COOKIEFILE, "");
+                    SetupStep(transfer);
+                }
+
+                CURLMcode mc = curl_multi_add_handle(_multi, easy);
+                if (mc != CURLM_OK)
+                {
+                    cerr << "curl_multi_add_handle: " << curl_multi_strerror(mc) << endl;
+                    curl_easy_cleanup(easy);
+                    delete transfer;
+                    continue;
+                }
+
+                _active.push_back(transfer);
+            }
+        }
+
+        /**
+         * @brief Turn the cumulative timestamps of libcurl into per-phase durations.
+         *
+         * @param easy Finished transfer.
+         * @param result Receives the timings.
+         */
+        static void ReadTimings(CURL *easy, ProbeResult &result)
+        {
+            curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+
+            result.http_code = 0;
+            result.bytes = 0;
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &result.http_code);
+            curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &result.bytes);
+            curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+            curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connect);
+            curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+            curl_easy_getinfo(easy, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+            curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+            curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total);
+
+            // A phase that was never reached reports 0, it must not turn into a negative duration.
+            result.dns = namelookup;
+            result.connect = (connect > namelookup) ? connect - namelookup : 0;
+            result.tls = (appconnect > connect) ? appconnect - connect : 0;
+            result.ttfb = (starttransfer > pretransfer) ? starttransfer - pretransfer : 0;
+            result.total = total;
+        }
+
+        /**
+         * @brief Collect finished transfers and report them through the callback.
+         *
+         * @return int32_t Number of probes completed.
+         */
+        int32_t Harvest()
+        {
+            int32_t done = 0;
+            int32_t queued = 0;
+            CURLMsg *msg;
+
+            while ((msg = curl_multi_info_read(_multi, &queued)) != nullptr)
+            {
+                if (msg->msg != CURLMSG_DONE)
+                {
+                    continue;
+                }
+
+                Transfer *transfer = nullptr;
+                ProbeResult result;
+                result.code = msg->data.result;
+
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+                ReadTimings(msg->easy_handle, result);
+                curl_multi_remove_handle(_multi, msg->easy_handle);
+                if (!transfer->req.steps.empty() && NextStep(transfer, result))
+                {
+                    continue;
+                }
+
+                for (size_t index = 0; index < _active.size(); index++)
+                {
+                    if (_active[index] == transfer)
+                    {
+                        _active[index] = _active.back();
+                        _active.pop_back();
+                        break;
+                    }
+                }
+
+                if (transfer->req.steps.empty())
+                {
+                    _idle.push_back(transfer->easy);
+                }
+                else
+                {
+                    curl_easy_cleanup(transfer->easy);
+                }
+                _on_done(transfer->req, result);
+                delete transfer;
+                done++;
+            }
+
+            StartPending();
+
+            return done;
+        }
+
+        Reactor &_reactor;
+        CURLM *_multi;
+        CURLSH *_share; // DNS, TLS session and connection cache of the warm probes.
+        int32_t _timer_fd;
+        Callback _on_done;
+        vector<Transfer *> _active; // Transfers owned by libcurl right now.
+        vector<CURL *> _idle;       // Easy handles kept for re-use.
+        deque<Request> _pending;    // Probes waiting for a free transfer slot.
+    };
+
+    /**
+     * @class ResultBatcher
+     *
+     * @brief Coalesces results into MSG_RESULT_BATCH frames written to the connection with Core.
+     *
+     * A batch is sent once it reaches BATCH_MAX_BYTES or once its first result has waited for the batch delay.
+     * Header and records are queued as separate chunks, so the connection sends them with a single writev().
+     * While paused, batches are kept in a bounded backlog instead, and sent first on resume.
+     */
+    class ResultBatcher
+    {
+    public:
+        /**
+         * @brief Construct a new Result Batcher object.
+         *
+         * @param reactor Event loop serving the delay timer.
+         * @param conn Connection the batches are written to.
+         * @param delay_ms Longest time a result waits for others, 0 sends each one at once.
+         */
+        ResultBatcher(Reactor &reactor, Connection &conn, int32_t delay_ms) : _reactor(reactor), _conn(conn), _delay_ms(delay_ms)
+        {
+            if ((_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+            {
+                cerr << "timerfd_create: " << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+
+            _reactor.Add(_timer_fd, EPOLLIN, [this](uint32_t) {
+                uint64_t expirations;
+                while (read(_timer_fd, &expirations, sizeof(expirations)) > 0)
+                {
+                }
+                Flush();
+            });
+        }
+
+        /**
+         * @brief Destroy the Result Batcher object.
+         */
+        ~ResultBatcher()
+        {
+            _reactor.Remove(_timer_fd);
+            close(_timer_fd);
+        }
+
+        ResultBatcher(const ResultBatcher &) = delete;
+        ResultBatcher &operator=(const ResultBatcher &) = delete;
+
+        /**
+         * @brief Add one result to the current batch.
+         *
+         * @param resp Result to be sent.
+         */
+        void Add(const Response &resp)
+        {
+            EncodeResult(resp, _records);
+            Added(1);
+        }
+
+        /**
+         * @brief Send the current batch, if any, right away.
+         */
+        void Flush()
+        {
+            if (_count == 0)
+            {
+                return;
+            }
+
+            string header;
+            size_t start = BeginFrame(header, MSG_RESULT_BATCH);
+            PutVarint(header, _count);
+
+            // The length field covers the records too, they are queued right behind the header.
+            uint32_t len = header.size() - start - FRAME_HEADER_LEN + _records.size();
+            header[start] = (char)(len >> 24);
+            header[start + 1] = (char)(len >> 16);
+            header[start + 2] = (char)(len >> 8);
+            header[start + 3] = (char)len;
+
+            if (!_paused && _conn.GetFd() >= 0)
+            {
+                _conn.Queue(std::move(header));
+                _conn.Queue(std::move(_records));
+                _conn.Flush();
+            }
+            else
+            {
+                Keep(std::move(header.append(_records)), _count);
+            }
+
+            _records.clear();
+            _count = 0;
+            _armed = false;
+        }
+
+        /**
+         * @brief Keep batches in the backlog until Resume(), while the connection cannot take them.
+         */
+        void Pause()
+        {
+            _paused = true;
+        }
+
+        /**
+         * @brief Send the backlog, then batches as usual.
+         */
+        void Resume()
+        {
+            _paused = false;
+            if (_dropped > 0)
+            {
+                cerr << "Backlog was full, " << _dropped << " results were dropped." << endl;
+                _dropped = 0;
+            }
+
+            while (!_backlog.empty())
+            {
+                _conn.Queue(std::move(_backlog.front().first));
+                _backlog.pop_front();
+            }
+            _backlog_bytes = 0;
+            Flush();
+            _conn.Flush();
+        }
+
+        /**
+         * @brief Get the bytes of the batches kept while paused.
+         */
+        size_t GetBacklogBytes()
+        {
+            return _backlog_bytes + _records.size();
+        }
+
+        /**
+         * @brief Forget every result not sent yet, they belong to a session that is over.
+         */
+        void Discard()
+        {
+            _backlog.clear();
+            _backlog_bytes = 0;
+            _dropped = 0;
+            _records.clear();
+            _count = 0;
+        }
+
+    private:
+        /**
+         * @brief Append a batch frame to the backlog, dropping the oldest ones beyond RESULT_BACKLOG_BYTES.
+         */
+        void Keep(string &&frame, uint64_t count)
+        {
+            _backlog_bytes += frame.size();
+            _backlog.push_back(make_pair(std::move(frame), count));
+
+            while (_backlog_bytes > RESULT_BACKLOG_BYTES && _backlog.size() > 1)
+            {
+                _backlog_bytes -= _backlog.front().first.size();
+                _dropped += _backlog.front().second;
+                _backlog.pop_front();
+            }
+        }
+
+        /**
+         * @brief Send the batch when it is full, otherwise make sure the delay timer runs.
+         */
+        void Added(uint64_t count)
+        {
+            _count += count;
+
+            if (_records.size() >= BATCH_MAX_BYTES || _delay_ms <= 0)
+            {
+                Flush();
+                return;
+            }
+
+            if (!_armed)
+            {
+                struct itimerspec its;
+                bzero(&its, sizeof(its));
+                its.it_value.tv_sec = _delay_ms / 1000;
+                its.it_value.tv_nsec = (_delay_ms % 1000) * 1000000;
+
+                timerfd_settime(_timer_fd, 0, &its, nullptr);
+                _armed = true;
+            }
+        }
+
+        Reactor &_reactor;
+        Connection &_conn;
+        int32_t _delay_ms;
+        int32_t _timer_fd;
+        bool _armed = false; // Delay timer runs for the current batch.
+        uint64_t _count = 0;
+        string _records;
+        bool _paused = false;
+        deque<pair<string, uint64_t>> _backlog; // Batch frames and their result count, oldest first.
+        size_t _backlog_bytes = 0;
+        uint64_t _dropped = 0; // Results dropped from the backlog since the last resume.
+    };
+
+    /**
+     * @brief Intrusive list node a timer wheel links its timers with.
+     */
+    struct TimerNode
+    {
+        TimerNode *prev = nullptr;
+        TimerNode *next = nullptr;
+        uint64_t expires = 0; ///< Expiry in wheel ticks.
+    };
+
+    /**
+     * @class TimerWheel
+     *
+     * @brief Hierarchical timing wheel with O(1) schedule, cancel and per-tick expiry.
+     *
+     * Level 0 holds timers due within the next 2^WHEEL_SLOT_BITS ticks, every next level covers
+     * 2^WHEEL_SLOT_BITS times the span of the previous one. When the lower level wraps around, the matching
+     * slot of the upper level is cascaded down, so a timer is moved at most WHEEL_LEVELS - 1 times.
+     */
+    class TimerWheel
+    {
+    public:
+        /**
+         * @brief Construct a new Timer Wheel object.
+         *
+         * @param now_ms Current monotonic time.
+         * @param tick_ms Duration of one tick.
+         */
+        TimerWheel(uint64_t now_ms, uint32_t tick_ms) : _tick_ms(tick_ms), _current(now_ms / tick_ms)
+        {
+            for (int32_t level = 0; level < WHEEL_LEVELS; level++)
+            {
+                for (int32_t slot = 0; slot < SLOTS; slot++)
+                {
+                    _slots[level][slot].prev = &_slots[level][slot];
+                    _slots[level][slot].next = &_slots[level][slot];
+                }
+            }
+        }
+
+        TimerWheel(const TimerWheel &) = delete;
+        TimerWheel &operator=(const TimerWheel &) = delete;
+
+        /**
+         * @brief Schedule a timer, a timer in the past expires on the next tick.
+         *
+         * @param node Timer to schedule, must not be scheduled already.
+         * @param expires_ms Monotonic expiry time.
+         */
+        void Schedule(TimerNode *node, uint64_t expires_ms)
+        {
+            node->expires = expires_ms / _tick_ms;
+            Insert(node);
+            _count++;
+        }
+
+        /**
+         * @brief Remove a timer from the wheel, no-op if it is not scheduled.
+         *
+         * @param node Timer to cancel.
+         */
+        void Cancel(TimerNode *node)
+        {
+            if (node->next != nullptr)
+            {
+                Unlink(node);
+                _count--;
+            }
+        }
+
+        /**
+         * @brief Expire every timer due up to the given time.
+         *
+         * @param now_ms Current monotonic time.
+         * @param on_expire Called with each expired timer, which may be scheduled again from there.
+         *
+         * @return size_t Number of expired timers.
+         */
+        template <typename Callback>
+        size_t Advance(uint64_t now_ms, Callback on_expire)
+        {
+            uint64_t target = now_ms / _tick_ms;
+            size_t expired = 0;
+
+            while (_current <= target)
+            {
+                int32_t index = _current & MASK;
+
+                // Level 0 wrapped around, bring the next slot of each upper level down.
+                for (int32_t level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+                {
+                    int32_t upper = (_current >> (level * WHEEL_SLOT_BITS)) & MASK;
+                    Cascade(level, upper);
+                    if (upper != 0)
+                    {
+                        break;
+                    }
+                }
+
+                _current++;
+
+                TimerNode due;
+                Splice(&_slots[0][index], &due);
+                while (due.next != &due)
+                {
+                    TimerNode *node = due.next;
+                    Unlink(node);
+                    _count--;
+                    expired++;
+                    on_expire(node);
+                }
+            }
+
+            return expired;
+        }
+
+        /**
+         * @brief Get the number of scheduled timers.
+         *
+         * @return size_t Timer count.
+         */
+        size_t GetCount()
+        {
+            return _count;
+        }
+
+    private:
+        static const int32_t SLOTS = 1 << WHEEL_SLOT_BITS;
+        static const int32_t MASK = SLOTS - 1;
+
+        /**
+         * @brief Link a timer into the slot matching its distance from the current tick.
+         */
+        void Insert(TimerNode *node)
+        {
+            uint64_t expires = node->expires;
+            TimerNode *head;
+
+            if (expires < _current)
+            {
+                expires = _current;
+            }
+
+            uint64_t delta = expires - _current;
+            int32_t level = 0;
+            while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * WHEEL_SLOT_BITS)))
+            {
+                level++;
+            }
+
+            uint64_t span = 1ULL << (WHEEL_LEVELS * WHEEL_SLOT_BITS);
+            if (delta >= span)
+            {
+                expires = _current + span - 1; // Parked at the far end, cascaded again later.
+            }
+
+            head = &_slots[level][(expires >> (level * WHEEL_SLOT_BITS)) & MASK];
+            node->prev = head->prev;
+            node->next = head;
+            head->prev->next = node;
+            head->prev = node;
+        }
+
+        /**
+         * @brief Re-insert every timer of an upper level slot into the lower levels.
+         */
+        void Cascade(int32_t level, int32_t slot)
+        {
+            TimerNode moved;
+            Splice(&_slots[level][slot], &moved);
+            while (moved.next != &moved)
+            {
+                TimerNode *node = moved.next;
+                Unlink(node);
+                Insert(node);
+            }
+        }
+
+        /**
+         * @brief Move the whole list of a slot to an empty list head.
+         */
+        static void Splice(TimerNode *from, TimerNode *to)
+        {
+            if (from->next == from)
+            {
+                to->prev = to->next = to;
+                return;
+            }
+
+            to->next = from->next;
+            to->prev = from->prev;
+            to->next->prev = to;
+            to->prev->next = to;
+            from->prev = from->next = from;
+        }
+
+        static void Unlink(TimerNode *node)
+        {
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+            node->prev = node->next = nullptr;
+        }
+
+        uint32_t _tick_ms;
+        uint64_t _current; // Next tick to be processed.
+        size_t _count = 0;
+        TimerNode _slots[WHEEL_LEVELS][SLOTS];
+    };
+
+    /**
+     * @brief A periodic job owned by a worker, linked into the timer wheel while waiting for its next run.
+     */
+    struct ScheduledJob : TimerNode
+    {
+        Request req;
+        int32_t runs = 0;
+        uint64_t period_ms = 0; // Current period, moving between the bounds of an adaptive job.
+        uint64_t due_ms = 0;    // Planned time of the next run.
+        uint64_t fire_ms = 0;   // Time the next run starts, its jitter included.
+        bool in_flight = false; // A probe of this job is still running.
+        double mean_us = 0;     // Smoothed total time of an adaptive job,
+        double dev_us = 0;      // and its smoothed mean deviation.
+        int32_t samples = 0;    // Successful runs the average was learnt from.
+        int32_t streak = 0;     // Healthy runs in a row at the current period.
+        int32_t confirm = 0;    // Runs left at the shortest period.
+    };
+
+    /**
+     * @class JobScheduler
+     *
+     * @brief Keeps the periodic jobs of one worker on a timer wheel and hands due jobs to the probe engine.
+     *
+     * Runs are planned on a fixed rate, so slow probes do not make a job drift. A job still probing when its next run
+     * is due skips that run. Each job runs at its own phase of its period, so that jobs of the same period do not all
+     * probe in the same tick.
+     *
+     * The period of an adaptive job follows the health of its target: it doubles after a few healthy runs in a row up
+     * to its longest, and falls to its shortest after a failure or a latency anomaly, for a few runs that confirm and
+     * measure the incident.
+     */
+    class JobScheduler
+    {
+    public:
+        typedef function<void(Response &)> ResultCallback;
+
+        /**
+         * @brief Construct a new Job Scheduler object.
+         *
+         * @param reactor Event loop of the worker.
+         * @param metrics Block of the worker.
+         * @param on_result Callback receiving every result ready for Core.
+         */
+        JobScheduler(Reactor &reactor, MetricBlock &metrics, ResultCallback on_result)
+            : _reactor(reactor), _engine(reactor, [this](const Request &req, const ProbeResult &result) { OnProbeDone(req, result); }),
+              _wheel(NowMs(), WHEEL_TICK_MS), _on_result(on_result), _metrics(metrics), _random(random_device()())
+        {
+            if ((_tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+            {
+                cerr << "timerfd_create: " << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+
+            _reactor.Add(_tick_fd, EPOLLIN, [this](uint32_t) { OnTick(); });
+        }
+
+        /**
+         * @brief Destroy the Job Scheduler object.
+         */
+        ~JobScheduler()
+        {
+            _reactor.Remove(_tick_fd);
+            close(_tick_fd);
+        }
+
+        JobScheduler(const JobScheduler &) = delete;
+        JobScheduler &operator=(const JobScheduler &) = delete;
+
+        /**
+         * @brief Start a job, or replace the settings of a job already known by its id.
+         *
+         * The phase of a job is the fractional part of its id times the golden ratio, which spreads any set of ids evenly over
+         * the period. It only depends on the id, so a job moved to another worker, or updated, keeps its place. An adaptive
+         * job starts over from its first period.
+         *
+         * @param req Job request from Core.
+         */
+        void AddJob(const Request &req)
+        {
+            unique_ptr<ScheduledJob> &job = _jobs[req.job];
+            if (!job)
+            {
+                job.reset(new ScheduledJob());
+            }
+            else
+            {
+                _wheel.Cancel(job.get());
+            }
+
+            job->req = req;
+            job->period_ms = (uint64_t)(req.freq > 0 ? req.freq : 1) * 1000;
+            job->samples = job->streak = job->confirm = 0;
+            job->due_ms = NextDue(job.get(), NowMs());
+
+            Plan(job.get());
+            SetTicking();
+            _metrics.Set(METRIC_JOBS, _jobs.size());
+        }
+
+        /**
+         * @brief Stop a job, no-op if it is unknown. A probe in flight finishes, but its result is ignored.
+         *
+         * @param job Job identifier.
+         */
+        void RemoveJob(int32_t job)
+        {
+            auto itr = _jobs.find(job);
+            if (itr != _jobs.end())
+            {
+                _wheel.Cancel(itr->second.get());
+                _jobs.erase(itr);
+            }
+            _metrics.Set(METRIC_JOBS, _jobs.size());
+        }
+
+        /**
+         * @brief Drop every job. Probes in flight finish, but their results are ignored.
+         */
+        void Clear()
+        {
+            for (auto &entry : _jobs)
+            {
+                _wheel.Cancel(entry.second.get());
+            }
+            _jobs.clear();
+            _metrics.Set(METRIC_JOBS, 0);
+        }
+
+        /**
+         * @brief Get the number of jobs owned by this scheduler.
+         *
+         * @return size_t Job count.
+         */
+        size_t GetJobCount()
+        {
+            return _jobs.size();
+        }
+
+    private:
+        /**
+         * @brief Submit a due job to the engine and plan its next run.
+         */
+        void Fire(ScheduledJob *job)
+        {
+            uint64_t period_ms = GetPeriodMs(job);
+            uint64_t now_ms = NowMs();
+
+            if (!job->in_flight)
+            {
+                job->in_flight = true;
+                _engine.Submit(job->req);
+            }
+
+            // How late the run starts, the wheel tick included.
+            _metrics.Add(METRIC_LAG_US, now_ms > job->fire_ms ? (now_ms - job->fire_ms) * 1000 : 0);
+            _metrics.Add(METRIC_LAG_COUNT, 1);
+
+            job->due_ms += period_ms;
+            if (job->due_ms <= now_ms)
+            {
+                // Fell behind by more than a period, skip the missed runs.
+                job->due_ms += ((now_ms - job->due_ms) / period_ms + 1) * period_ms;
+            }
+
+            Plan(job);
+        }
+
+        /**
+         * @brief Schedule the next run of a job, late by a random part of its jitter.
+         */
+        void Plan(ScheduledJob *job)
+        {
+            uint64_t jitter_ms = GetPeriodMs(job) * min<uint8_t>(job->req.jitter, MAX_JITTER_PERCENT) / 100;
+
+            job->fire_ms = job->due_ms + (jitter_ms > 0 ? _random() % (jitter_ms + 1) : 0);
+            _wheel.Schedule(job, job->fire_ms);
+        }
+
+        static uint64_t GetPeriodMs(ScheduledJob *job)
+        {
+            return job->period_ms;
+        }
+
+        /**
+         * @brief Get the first time from now on a job is due at, at its phase of its current period.
+         */
+        static uint64_t NextDue(ScheduledJob *job, uint64_t now_ms)
+        {
+            uint64_t period_ms = GetPeriodMs(job);
+            uint64_t phase_ms = ((uint64_t)((uint32_t)job->req.job * GOLDEN_RATIO_32) * period_ms) >> 32;
+            uint64_t due_ms = now_ms - now_ms % period_ms + phase_ms;
+
+            return (due_ms < now_ms) ? due_ms + period_ms : due_ms;
+        }
+
+        /**
+         * @brief Move the period of an adaptive job after one of its results.
+         *
+         * Total times are smoothed the way TCP smooths round trip times, a total time far above the average is an anomaly.
+         *
+         * @param job Job the result belongs to.
+         * @param failed Whether the probe failed.
+         * @param total_us Total time of the probe.
+         */
+        void Adapt(ScheduledJob *job, bool failed, uint32_t total_us)
+        {
+            bool anomaly = false;
+            if (!failed)
+            {
+                double diff = total_us - job->mean_us;
+                anomaly = job->samples >= ADAPT_WARMUP_RUNS && diff > max(ADAPT_ANOMALY_DEVS * job->dev_us, ADAPT_ANOMALY_RATIO * job->mean_us);
+
+                if (job->samples++ == 0)
+                {
+                    job->mean_us = total_us;
+                    job->dev_us = total_us / 2.0;
+                }
+                else
+                {
+                    job->mean_us += diff / 8;
+                    job->dev_us += (fabs(diff) - job->dev_us) / 4;
+                }
+            }
+
+            uint64_t period_ms = job->period_ms;
+            if (failed || anomaly)
+            {
+                job->confirm = ADAPT_CONFIRM_RUNS;
+                job->streak = 0;
+                period_ms = (uint64_t)job->req.freq_min * 1000;
+            }
+            else if (job->confirm > 0)
+            {
+                job->confirm--;
+            }
+            else if (++job->streak >= ADAPT_STABLE_RUNS)
+            {
+                job->streak = 0;
+                period_ms = min<uint64_t>(period_ms * 2, (uint64_t)job->req.freq_max * 1000);
+            }
+
+            if (period_ms != job->period_ms)
+            {
+                job->period_ms = period_ms;
+                _wheel.Cancel(job);
+                job->due_ms = NextDue(job, NowMs());
+                Plan(job);
+            }
+        }
+
+        /**
+         * @brief Wheel tick, fires every job due by now.
+         */
+        void OnTick()
+        {
+            uint64_t expirations;
+            while (read(_tick_fd, &expirations, sizeof(expirations)) > 0)
+            {
+            }
+
+            _wheel.Advance(NowMs(), [this](TimerNode *node) { Fire(static_cast<ScheduledJob *>(node)); });
+        }
+
+        /**
+         * @brief Turn a finished probe into a result for Core.
+         */
+        void OnProbeDone(const Request &req, const ProbeResult &result)
+        {
+            auto itr = _jobs.find(req.job);
+            if (itr == _jobs.end())
+            {
+                return; // Job was removed while probing.
+            }
+
+            ScheduledJob *job = itr->second.get();
+            job->in_flight = false;
+
+            bool failed = IsFailedProbe(result.http_code, result.code);
+            _metrics.Add(METRIC_PROBES, 1);
+            _metrics.Add(METRIC_PROBES_FAILED, failed ? 1 : 0);
+            _metrics.Add(METRIC_PROBE_BYTES, result.bytes > 0 ? result.bytes : 0);
+
+            Response resp = Response();
+            resp.option = COMMAND;
+            resp.job = req.job;
+            resp.dns_us = ClampUs(result.dns);
+            resp.connect_us = ClampUs(result.connect);
+            resp.tls_us = ClampUs(result.tls);
+            resp.ttfb_us = ClampUs(result.ttfb);
+            resp.total_us = ClampUs(result.total);
+            resp.http_code = result.http_code;
+            resp.error = result.code;
+            resp.bytes = result.bytes;
+            resp.mode = req.mode;
+            resp.runs = ++job->runs;
+            resp.time_ms = WallClockMs();
+            resp.steps = result.steps;
+
+            if (job->req.freq_max > 0)
+            {
+                Adapt(job, failed, resp.total_us);
+            }
+
+            _on_result(resp);
+        }
+
+        /**
+         * @brief Arm the periodic wheel tick.
+         */
+        void SetTicking()
+        {
+            if (_ticking)
+            {
+                return;
+            }
+
+            struct itimerspec its;
+            its.it_interval.tv_sec = 0;
+            its.it_interval.tv_nsec = WHEEL_TICK_MS * 1000000;
+            its.it_value = its.it_interval;
+
+            timerfd_settime(_tick_fd, 0, &its, nullptr);
+            _ticking = true;
+        }
+
+        Reactor &_reactor;
+        ProbeEngine _engine;
+        TimerWheel _wheel;
+        ResultCallback _on_result;
+        int32_t _tick_fd;
+        bool _ticking = false;
+        unordered_map<int32_t, unique_ptr<ScheduledJob>> _jobs;
+        MetricBlock &_metrics;
+        minstd_rand _random; // Jitter of the runs.
+    };
+
+    /**
+     * @class Worker
+     *
+     * @brief Event loop thread pinned to a CPU, running the probes of its share of the jobs.
+     *
+     * Requests from the Agent thread wait in a queue the worker takes whole on wakeup, results go back through a
+     * lock-free ring the Agent thread drains. Nothing crosses a socket on the way.
+     */
+    class Worker
+    {
+    public:
+        /**
+         * @brief Construct a new Worker object.
+         *
+         * @param num Number of the worker, from 1.
+         * @param cpu CPU the worker runs on.
+         * @param metrics Block of the worker.
+         * @param notifier Wakes the Agent thread up once results are queued, if it sleeps.
+         */
+        Worker(int32_t num, int32_t cpu, MetricBlock *metrics, Notifier &notifier)
+            : _worker_num(num), _cpu(cpu), _metrics(metrics), _notifier(notifier), _results(WORKER_RING_LEN)
+        {
+            if ((_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            {
+                cerr << "eventfd: " << strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        Worker(const Worker &) = delete;
+        Worker &operator=(const Worker &) = delete;
+
+        /**
+         * @brief Start the thread of the worker and pin it to its CPU.
+         */
+        void Start()
+        {
+            thread worker(&Worker::Run, this);
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(_cpu, &set);
+            int32_t ret = pthread_setaffinity_np(worker.native_handle(), sizeof(set), &set);
+            if (ret != 0)
+            {
+                cerr << "pthread_setaffinity_np: " << strerror(ret) << std::endl;
+            }
+
+            worker.detach();
+        }
+
+        /**
+         * @brief Queue a request for the worker, from the Agent thread.
+         *
+         * @param req Request from Core, or from the pool moving a job.
+         */
+        void Send(const Request &req)
+        {
+            bool idle;
+            {
+                lock_guard<mutex> lock(_lock);
+                idle = _requests.empty(); // Otherwise the worker was woken up already and takes this one too.
+                _requests.push_back(req);
+            }
+
+            uint64_t one = 1;
+            if (idle && write(_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            {
+                cerr << "write: " << strerror(errno) << std::endl;
+            }
+        }
+
+        /**
+         * @brief Take queued results, from the Agent thread.
+         *
+         * @param out Receives the results.
+         * @param max Room in out.
+         *
+         * @return size_t Number of results taken.
+         */
+        size_t TakeResults(Response *out, size_t max)
+        {
+            return _results.TryPop(out, max);
+        }
+
+        /**
+         * @brief Check whether results are queued, from the Agent thread.
+         */
+        bool HasResults()
+        {
+            return !_results.IsEmpty();
+        }
+
+    private:
+        /**
+         * @brief Run the job requests from the Agent.
+         */
+        void ServeRequest(Request &req, JobScheduler &scheduler)
+        {
+            switch (req.op)
+            {
+            case OP_START:
+            {
+                scheduler.AddJob(req);
+            }
+            break;
+            case OP_STOP:
+            {
+                scheduler.RemoveJob(req.job);
+            }
+            break;
+            case OP_RESET:
+            {
+                if (scheduler.GetJobCount() > 0)
+                {
+                    cout << "Dropping " << scheduler.GetJobCount() << " jobs of the previous session." << endl;
+                }
+                scheduler.Clear();
+
+                Response resp = Response();
+                resp.option = RESET_DONE;
+                Push(resp);
+            }
+            break;
+            case OP_EXIT:
+            {
+                /*
+                 * TODO: This block is not in use but can be used to control Agents from Core.
+                 * kill all worker/process and exit.
+                 */
+                printf("Quit");
+                Response resp = Response();
+                resp.option = EXIT;
+                resp.job = req.job;
+                Push(resp);
+            }
+            break;
+            default:
+                printf("Please enter the correct option..!!");
+            }
+        }
+
+        /**
+         * @brief Thread of the worker: requests, the scheduler tick and all probe sockets are served from its reactor.
+         */
+        void Run()
+        {
+            cout << "Worker " << _worker_num << " runs on CPU " << _cpu << "." << endl;
+
+            Reactor reactor;
+            JobScheduler scheduler(reactor, *_metrics, [this](Response &resp) { Push(resp); });
+
+            reactor.Add(_wake_fd, EPOLLIN, [&](uint32_t) {
+                uint64_t count;
+                while (read(_wake_fd, &count, sizeof(count)) > 0)
+                {
+                }
+
+                vector<Request> requests;
+                {
+                    lock_guard<mutex> lock(_lock);
+                    requests.swap(_requests);
+                }
+                for (Request &req : requests)
+                {
+                    ServeRequest(req, scheduler);
+                }
+            });
+
+            while (ALWAYS_TRUE)
+            {
+                reactor.RunOnce(-1, _metrics);
+
+                // A busy Agent thread takes the results on its next loop iteration, it is only woken up when it sleeps.
+                if (_pushed)
+                {
+                    _notifier.Notify();
+                    _pushed = false;
+                }
+                _metrics->Set(METRIC_QUEUE_BYTES, _results.GetSize() * sizeof(Response));
+            }
+        }
+
+        /**
+         * @brief Queue a result for the Agent, waiting for room while the Agent catches up.
+         */
+        void Push(const Response &resp)
+        {
+            while (!_results.TryPush(resp))
+            {
+                _notifier.Notify();
+                this_thread::yield();
+            }
+            _pushed = true;
+        }
+
+        int32_t _worker_num;
+        int32_t _cpu;
+        MetricBlock *_metrics;
+        Notifier &_notifier;
+        int32_t _wake_fd;
+        mutex _lock; // Guards _requests.
+        vector<Request> _requests;
+        SpscRing<Response> _results;
+        bool _pushed = false; // Results were queued during this loop iteration.
+    };
 
     /**
-     * @brief Agent will keep on running in this function until its got termination.
+     * @class WorkerPool
      *
-     * This function act as a mediator between Worker processes and Core.
+     * @brief Worker threads of the Agent, one per CPU by default, and the jobs each of them runs.
      *
-     * @param agent An instance of Agent to be handled.
+     * A new job goes to the worker running the fewest jobs. Jobs stopped unevenly are evened out again by moving
+     * jobs from the busiest worker to the least busy one.
      */
-    static void AgentHandler(Agent &agent)
+    class WorkerPool
     {
-        int32_t ret = 0;
-        int32_t worker_index;
-        Response resp_core;
-        Request req_core;
+    public:
+        typedef function<void(Response &)> ResultCallback;
 
-        while (1)
+        /**
+         * @brief Construct a new Worker Pool object.
+         *
+         * @param reactor Event loop of the Agent.
+         * @param metrics Area holding a block per worker, from index 1 up to MAX_AGENT_WORKER.
+         * @param cpus CPUs the workers run on, one worker per CPU.
+         * @param on_result Callback receiving the results from workers, and the messages meant for Core.
+         */
+        WorkerPool(Reactor &reactor, MetricsArea &metrics, const vector<int32_t> &cpus, ResultCallback on_result)
+            : _reactor(reactor), _on_result(on_result)
+        {
+            for (size_t index = 0; index < cpus.size(); index++)
+            {
+                unique_ptr<Slot> slot(new Slot());
+                slot->worker.reset(new Worker(index + 1, cpus[index], metrics.Get(index + 1), _notifier));
+                _slots.push_back(std::move(slot));
+            }
+        }
+
+        WorkerPool(const WorkerPool &) = delete;
+        WorkerPool &operator=(const WorkerPool &) = delete;
+
+        /**
+         * @brief Start the worker threads.
+         */
+        void Start()
+        {
+            _reactor.Add(_notifier.GetFd(), EPOLLIN, [this](uint32_t) { _notifier.Drain(); });
+
+            for (unique_ptr<Slot> &slot : _slots)
+            {
+                slot->worker->Start();
+            }
+        }
+
+        /**
+         * @brief Hand a request from Core to the worker owning its job, placing new jobs.
+         *
+         * @param req Decoded request.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Place(const Request &req)
+        {
+            auto itr = _jobs.find(req.job);
+
+            if (itr != _jobs.end())
+            {
+                Slot *slot = itr->second.slot;
+                if (req.op == OP_STOP)
+                {
+                    slot->jobs.erase(req.job);
+                    _jobs.erase(itr);
+                }
+                else
+                {
+                    itr->second.req = req;
+                }
+
+                slot->worker->Send(req);
+                return 0;
+            }
+
+            if (req.op != OP_START)
+            {
+                return 0; // Nothing runs the job.
+            }
+
+            // A resetting worker is fine: it acknowledges the reset before it starts anything sent after it.
+            Slot *slot = GetLeast();
+            Placement &placement = _jobs[req.job];
+            placement.slot = slot;
+            placement.req = req;
+            slot->jobs.insert(req.job);
+            slot->worker->Send(req);
+
+            return 0;
+        }
+
+        /**
+         * @brief Drop every job. Results queued by a worker before it acknowledged are dropped too.
+         */
+        void Reset()
         {
-            // Polling all input stream, That is from Core and all Worker Process.
-            // - If it from Core, Forward this request to Workers.
-            // - If it from Worker, Forward the response back to Core.
-            ret = poll(poll_fd, g_worker + 1, POLL_TIMEOUT_MS);
-            if (ret < 0)
+            Request reset = Request();
+
+            reset.op = OP_RESET;
+            for (unique_ptr<Slot> &slot : _slots)
             {
-                cerr << "poll: " << strerror(errno) << std::endl;
+                slot->worker->Send(reset);
+                slot->jobs.clear();
+                slot->resetting = true;
             }
+            _jobs.clear();
+        }
 
-            // Check for any request from Core. If yes, Send the request to worker for processing.
-            if (CorePoll())
+        /**
+         * @brief Periodic housekeeping: even the jobs out over the workers.
+         */
+        void Maintain()
+        {
+            for (int32_t moves = 0; moves < REBALANCE_MOVES; moves++)
             {
-                ret = read(agent.GetConnectionFd(), (Request *)&req_core, sizeof(req_core));
-                if (ret < 0)
+                Slot *most = nullptr;
+                for (unique_ptr<Slot> &slot : _slots)
+                {
+                    if (most == nullptr || slot->jobs.size() > most->jobs.size())
+                    {
+                        most = slot.get();
+                    }
+                }
+                Slot *least = GetLeast();
+
+                if (most->jobs.size() <= least->jobs.size() + max<size_t>(1, most->jobs.size() / 8))
                 {
-                    cerr << "read: " << strerror(errno) << std::endl;
+                    break;
                 }
-                if (ret > 0)
+
+                Move(*most->jobs.begin(), least);
+            }
+        }
+
+        /**
+         * @brief Mark the Agent thread as about to sleep, the workers wake it up from now on.
+         *
+         * @return bool True when it may sleep, false when results are queued already.
+         */
+        bool Park()
+        {
+            return _notifier.Park([this]() {
+                for (unique_ptr<Slot> &slot : _slots)
                 {
-                    if (req_core.worker <= g_worker)
+                    if (slot->worker->HasResults())
                     {
-                        ret = write(socket_fd[req_core.worker - 1][PARENT], (Request *)&req_core, sizeof(req_core));
-                        if (ret < 0)
-                        {
-                            cerr << "write: " << strerror(errno) << std::endl;
-                        }
+                        return true;
                     }
-                    else
+                }
+                return false;
+            });
+        }
+
+        /**
+         * @brief Take the results of every worker, once the Agent thread is awake.
+         */
+        void Unpark()
+        {
+            _notifier.Unpark();
+            TakeResults();
+        }
+
+        /**
+         * @brief Get the number of jobs run by the workers.
+         */
+        size_t GetJobCount()
+        {
+            return _jobs.size();
+        }
+
+        /**
+         * @brief Get the number of worker threads.
+         */
+        int32_t GetWorkerCount()
+        {
+            return _slots.size();
+        }
+
+    private:
+        struct Slot
+        {
+            unique_ptr<Worker> worker;
+            unordered_set<int32_t> jobs; // Jobs placed on the worker.
+            bool resetting = false;      // Results of the worker belong to a previous session.
+        };
+
+        struct Placement
+        {
+            Slot *slot;
+            Request req; // Last request of the job, sent again when the job moves.
+        };
+
+        Slot *GetLeast()
+        {
+            Slot *least = nullptr;
+            for (unique_ptr<Slot> &slot : _slots)
+            {
+                if (least == nullptr || slot->jobs.size() < least->jobs.size())
+                {
+                    least = slot.get();
+                }
+            }
+
+            return least;
+        }
+
+        /**
+         * @brief Move a job to another worker, it keeps its phase over there.
+         */
+        void Move(int32_t job, Slot *to)
+        {
+            Placement &placement = _jobs[job];
+            Request stop = Request();
+
+            stop.op = OP_STOP;
+            stop.job = job;
+            placement.slot->worker->Send(stop);
+            placement.slot->jobs.erase(job);
+
+            placement.slot = to;
+            to->jobs.insert(job);
+            to->worker->Send(placement.req);
+        }
+
+        void TakeResults()
+        {
+            Response batch[WORKER_BATCH_LEN];
+            for (unique_ptr<Slot> &slot : _slots)
+            {
+                size_t taken;
+                while ((taken = slot->worker->TakeResults(batch, WORKER_BATCH_LEN)) > 0)
+                {
+                    for (size_t index = 0; index < taken; index++)
                     {
-                        strcpy(resp_core.message, "worker_not_present");
-                        ret = write(agent.GetConnectionFd(), &resp_core, sizeof(resp_core));
-                        if (ret < 0)
+                        if (batch[index].option == RESET_DONE)
+                        {
+                            slot->resetting = false;
+                        }
+                        else if (!slot->resetting)
                         {
-                            cerr << "write: " << strerror(errno) << std::endl;
+                            _on_result(batch[index]);
                         }
                     }
                 }
             }
+        }
+
+        Reactor &_reactor;
+        ResultCallback _on_result;
+        Notifier _notifier; // Workers wake the Agent thread up through it, only while it sleeps.
+        vector<unique_ptr<Slot>> _slots;
+        unordered_map<int32_t, Placement> _jobs;
+    };
+
+    /**
+     * @brief Agent will keep on running in this function until its got termination.
+     *
+     * This function act as a mediator between the Worker threads and Core. All sockets are drained on every
+     * wakeup, so nothing waits for the next loop iteration. Jobs keep running while Core is away: their
+     * results wait in a backlog and are delivered when Core reconnects with the same session.
+     *
+     * @param agent An instance of Agent to be handled.
+     * @param cpus CPUs the worker threads run on, one worker per CPU.
+     * @param endpoint Listening metrics endpoint, or null.
+     */
+    static void AgentHandler(Agent &agent, const vector<int32_t> &cpus, MetricsEndpoint *endpoint)
+    {
+        Reactor reactor;
+        MetricsArea metrics(MAX_AGENT_WORKER + 1); // Block 0 is the Agent's, the others the workers'.
+        MetricBlock *own = metrics.Get(0);
+        Connection core_conn;
+        ResultBatcher to_core_batch(reactor, core_conn, g_batch_delay_ms);
+        uint64_t session = 0; // Session the jobs belong to, 0 before the first Core.
+        bool welcomed = false; // Core has opened a session on the current connection.
+
+        core_conn.SetMetrics(own);
+
+        // Results from workers are forwarded to Core.
+        WorkerPool pool(reactor, metrics, cpus, [&](Response &resp_core) {
+            if (resp_core.option == COMMAND)
+            {
+                to_core_batch.Add(resp_core);
+                own->Add(METRIC_RESULTS, 1);
+                return;
+            }
+
+            if (core_conn.GetFd() >= 0)
+            {
+                string frame;
+                EncodeResponse(resp_core, frame);
+                to_core_batch.Flush(); // Keep results ahead of the message that follows them.
+                core_conn.Queue(frame);
+                core_conn.Flush();
+            }
+
+            if (resp_core.option == EXIT)
+            {
+                close(agent.GetSocketFd());
+                kill(0, SIGKILL);
+            }
+        });
+
+        // Nothing goes to Core before it has said which session it is.
+        to_core_batch.Pause();
+        pool.Start();
+
+        auto close_core = [&]() {
+            reactor.Remove(core_conn.GetFd());
+            close(core_conn.GetFd());
+            core_conn.Reset(-1);
+            to_core_batch.Pause();
+            welcomed = false;
+        };
+
+        // A known session resumes as it is, any other one replaces the jobs of the previous session.
+        auto on_hello = [&](const Hello &hello) {
+            Welcome welcome;
+            welcome.session = hello.session;
+            welcome.resumed = (session != 0 && hello.session == session) ? 1 : 0;
+
+            if (welcome.resumed)
+            {
+                cout << "Core resumed its session, " << pool.GetJobCount() << " jobs are still running." << endl;
+            }
             else
             {
-                // cout<<"Poll timeout..."<<endl;
+                cout << "New Core session";
+                if (pool.GetJobCount() > 0)
+                {
+                    cout << ", " << pool.GetJobCount() << " jobs of the previous one are dropped";
+                }
+                cout << "." << endl;
+
+                pool.Reset();
+                to_core_batch.Discard();
+                session = hello.session;
+            }
+
+            string frame;
+            welcome.jobs = pool.GetJobCount();
+            EncodeWelcome(welcome, frame);
+            core_conn.Queue(frame);
+            to_core_batch.Resume();
+            welcomed = true;
+        };
+
+        // Core places the jobs of a pool on its least loaded agents, after the load of the workers since the last report.
+        uint64_t report_ms = 0;
+        uint64_t last_report_ms = NowMs();
+        uint64_t last_busy_us = 0;
+        uint64_t last_probes = 0;
+        auto report_load = [&](uint64_t now_ms) {
+            uint64_t busy_us = 0;
+            uint64_t probes = 0;
+            for (int32_t index = 1; index <= pool.GetWorkerCount(); index++)
+            {
+                busy_us += metrics.Get(index)->Get(METRIC_LOOP_US);
+                probes += metrics.Get(index)->Get(METRIC_PROBES);
             }
 
-            // Check for any input from worker. Read from worker and send to Core.
-            if ((worker_index = WorkerPoll()))
+            uint64_t elapsed_ms = max<uint64_t>(now_ms - last_report_ms, 1);
+            Load load;
+            string frame;
+            load.jobs = pool.GetJobCount();
+            load.workers = pool.GetWorkerCount();
+            load.max_workers = pool.GetWorkerCount();
+            load.busy = (busy_us - last_busy_us) / elapsed_ms;
+            load.probe_mrate = (probes - last_probes) * 1000000 / elapsed_ms;
+
+            EncodeLoad(load, frame);
+            core_conn.Queue(frame);
+            core_conn.Flush();
+
+            last_report_ms = now_ms;
+            last_busy_us = busy_us;
+            last_probes = probes;
+        };
+
+        // Requests from Core are forwarded to the worker owning the job, new jobs go to the least loaded worker.
+        Reactor::Handler on_core = [&](uint32_t events) {
+            int32_t ret = core_conn.Fill();
+            Frame frame;
+            Request req_core;
+            Hello hello;
+
+            while (core_conn.NextFrame(frame))
             {
-                /* Reading from worker */
-                ret = read(socket_fd[worker_index - 1][PARENT], &resp_core, sizeof(resp_core));
-                if (ret < 0)
+                if (frame.type == MSG_HELLO && DecodeHello(frame.payload, frame.len, hello))
                 {
-                    cerr << "read: " << strerror(errno) << std::endl;
+                    on_hello(hello);
+                    continue;
                 }
 
-                if (resp_core.option == COMMAND)
+                if (frame.type != MSG_REQUEST || !DecodeRequest(frame.payload, frame.len, req_core))
                 {
-                    ret = write(agent.GetConnectionFd(), &resp_core, sizeof(resp_core));
-                    if (ret < 0)
-                    {
-                        cerr << "write: " << strerror(errno) << std::endl;
-                    }
+                    cerr << "Dropping malformed frame of type " << (int32_t)frame.type << " from Core." << endl;
+                    continue;
                 }
-                else if (resp_core.option == EXIT)
+
+                pool.Place(req_core);
+                own->Add(METRIC_REQUESTS, 1);
+            }
+
+            if (ret <= 0 || core_conn.IsBroken() || core_conn.Flush() < 0)
+            {
+                cerr << "Connection with Core is closed, results are kept until it reconnects." << endl;
+                close_core();
+            }
+        };
+
+        // Core may connect again at any time, a new connection replaces the previous one.
+        reactor.Add(agent.GetSocketFd(), EPOLLIN, [&](uint32_t events) {
+            int32_t conn_fd;
+
+            while ((conn_fd = agent.Accept()) >= 0)
+            {
+                if (core_conn.GetFd() >= 0)
                 {
-                    ret = write(agent.GetConnectionFd(), &resp_core, sizeof(resp_core));
-                    if (ret < 0)
-                    {
-                        cerr << "write: " << strerror(errno) << std::endl;
-                    }
-                    close(agent.GetSocketFd());
-                    kill(0, SIGKILL);
+                    cerr << "Core connected again, its previous connection is dropped." << endl;
+                    close_core();
                 }
+
+                cout << "Core connected." << endl;
+                core_conn.Reset(conn_fd);
+                report_ms = 0; // First report right after the session is open.
+                reactor.Add(conn_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, on_core);
             }
-            else
+        });
+
+        // Metrics are rendered from the blocks, the workers keep writing theirs meanwhile.
+        MetricsEndpoint::Render render = [&](string &out) {
+            vector<MetricSeries> workers;
+            vector<MetricSeries> all = {{own, "thread=\"agent\""}};
+            for (int32_t index = 1; index <= pool.GetWorkerCount(); index++)
             {
-                // cout<<"Poll Timeout..."<<endl;
+                workers.push_back({metrics.Get(index), "thread=\"worker-" + to_string(index) + "\""});
+                all.push_back(workers.back());
             }
 
-            sleep(1);
+            PutMetric(out, "swm_probes_total", "counter", "Probes completed.", METRIC_PROBES, workers);
+            PutMetric(out, "swm_probes_failed_total", "counter", "Probes that failed: transfer error or HTTP error status.",
+                      METRIC_PROBES_FAILED, workers);
+            PutMetric(out, "swm_probe_body_bytes_total", "counter", "Response body bytes downloaded by the probes.", METRIC_PROBE_BYTES,
+                      workers);
+            PutSummary(out, "swm_scheduler_lag_seconds", "Delay between the planned and the actual start of the runs.", METRIC_LAG_US,
+                       METRIC_LAG_COUNT, workers);
+            PutSummary(out, "swm_loop_iteration_seconds", "Time spent handling the events of one event loop wake up.", METRIC_LOOP_US,
+                       METRIC_LOOP_COUNT, all);
+            PutMetric(out, "swm_socket_received_bytes_total", "counter", "Bytes read from Core.", METRIC_BYTES_IN, {all[0]});
+            PutMetric(out, "swm_socket_sent_bytes_total", "counter", "Bytes written to Core.", METRIC_BYTES_OUT, {all[0]});
+            PutMetric(out, "swm_outbound_queue_bytes", "gauge",
+                      "Bytes waiting to be sent to Core, the backlog kept while Core is away included, or results queued by a worker.",
+                      METRIC_QUEUE_BYTES, all);
+            PutMetric(out, "swm_jobs", "gauge", "Jobs run.", METRIC_JOBS, all);
+            PutMetric(out, "swm_requests_forwarded_total", "counter", "Job requests forwarded from Core to the workers.", METRIC_REQUESTS,
+                      {all[0]});
+            PutMetric(out, "swm_results_forwarded_total", "counter", "Results forwarded from the workers to Core.", METRIC_RESULTS,
+                      {all[0]});
+        };
+
+        if (endpoint != nullptr)
+        {
+            reactor.Add(endpoint->GetFd(), EPOLLIN, [&](uint32_t events) {
+                int32_t client_fd;
+                while ((client_fd = endpoint->Accept()) >= 0)
+                {
+                    reactor.Add(client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [&reactor, endpoint, &render, client_fd](uint32_t events) {
+                        if (endpoint->Serve(client_fd, render))
+                        {
+                            reactor.Remove(client_fd);
+                            endpoint->Close(client_fd);
+                        }
+                    });
+                }
+            });
+        }
+
+        while (1)
+        {
+            // Results queued while this thread is busy are taken without any system call.
+            reactor.RunOnce(pool.Park() ? POLL_TIMEOUT_MS : 0, own);
+            pool.Unpark();
+
+            pool.Maintain();
+            own->Set(METRIC_QUEUE_BYTES, core_conn.GetPendingBytes() + to_core_batch.GetBacklogBytes());
+            own->Set(METRIC_JOBS, pool.GetJobCount());
+
+            uint64_t now_ms = NowMs();
+            if (welcomed && now_ms >= report_ms)
+            {
+                report_load(now_ms);
+                report_ms = now_ms + LOAD_REPORT_MS;
+            }
         }
     }
 } // namespace AgentImplementation
@@ -528,7 +2435,44 @@ using namespace AgentImplementation;
  */
 int32_t main(int32_t argc, char *argv[])
 {
-    if (argc != 2)
+    string endpoint;
+    string metrics_endpoint;
+    int32_t opt;
+
+    // A peer going away makes writes fail with EPIPE, handled like any other failed write, rather than kill the process.
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "l:b:w:c:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            endpoint = optarg;
+            break;
+        case 'b':
+            g_batch_delay_ms = atoi(optarg);
+            break;
+        case 'w':
+            g_workers = IsNumber(optarg) ? atoi(optarg) : 0;
+            if (g_workers < 1 || g_workers > MAX_AGENT_WORKER)
+            {
+                cerr << "Invalid number of workers '" << optarg << "', expected 1 up to " << MAX_AGENT_WORKER << "." << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            g_ca_file = optarg;
+            break;
+        case 'm':
+            metrics_endpoint = optarg;
+            break;
+        default:
+            PrintUsage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 1)
     {
         cerr << "Agent must take only 1 argument, Its agent Id." << endl;
         PrintUsage();
@@ -536,12 +2480,12 @@ int32_t main(int32_t argc, char *argv[])
     }
 
     int32_t agent_num = 0;
-    if (IsNumber(argv[1]))
+    if (IsNumber(argv[optind]) && strlen(argv[optind]) < 10)
     {
-        agent_num = stoi(argv[1]);
-        if (agent_num < 1 || agent_num > MAX_AGENT)
+        agent_num = stoi(argv[optind]);
+        if (agent_num < 1)
         {
-            cerr << "Invalid agent Id, It must be b/w 1, 2 or 3." << endl;
+            cerr << "Invalid agent Id, It must be a positive number." << endl;
             exit(EXIT_FAILURE);
         }
         cout << "Agent " << agent_num << " is started." << endl;
@@ -552,8 +2496,37 @@ int32_t main(int32_t argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    // Listen on the given endpoint, or on the default one derived from the agent Id.
+    string host = DEFAULT_AGENT_IP;
+    int32_t port = DefaultAgentPort(agent_num);
+    if (!endpoint.empty() && ParseEndpoint(endpoint, host, port) != 0)
+    {
+        cerr << "Invalid endpoint '" << endpoint << "', expected <host>:<port>." << endl;
+        exit(EXIT_FAILURE);
+    }
+    else if (port < 0)
+    {
+        cerr << "Agent " << agent_num << " has no default port, give its endpoint with -l <host>:<port>." << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // libcurl global state must be ready before the worker threads start.
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
+    {
+        cerr << "curl_global_init failed." << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Every probe holds a socket, allow as many descriptors as the system lets us.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
     // Create an instance of Agent.
-    Agent agent(agent_num);
+    Agent agent(agent_num, host, port);
 
     // Bind IP and port.
     agent.Bind();
@@ -561,23 +2534,27 @@ int32_t main(int32_t argc, char *argv[])
     // Set the connection queue it want to listen on.
     agent.Listen();
 
-    // create workers before accepting the connection from Core.
-    vector<Worker> worker;
-    for (int32_t worker_num = 0; worker_num < g_worker; worker_num++)
+    // One worker thread per CPU by default, pinned to it. More workers than CPUs share them.
+    vector<int32_t> allowed = AllowedCpus();
+    if (g_workers == 0)
     {
-        worker.push_back(Worker(worker_num));
+        g_workers = min<int32_t>(allowed.size(), MAX_AGENT_WORKER);
     }
-
-    for (Worker &work : worker)
+    vector<int32_t> cpus;
+    for (int32_t index = 0; index < g_workers; index++)
     {
-        work.InitReqHandler();
+        cpus.push_back(allowed[index % allowed.size()]);
     }
 
-    // Agent accepts the connection from Core.
-    agent.Accept();
+    // Metrics are served from the Agent's event loop, on their own port.
+    MetricsEndpoint metrics;
+    if (!metrics_endpoint.empty() && metrics.Listen(metrics_endpoint) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
 
-    // Agent main/parent process handler.
-    AgentHandler(agent);
+    // Agent main thread handler, the workers run their own.
+    AgentHandler(agent, cpus, metrics_endpoint.empty() ? nullptr : &metrics);
 
     cerr << "If you are seeing this, there is something is fishy!!!" << endl;
 
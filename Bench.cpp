@@ -0,0 +1,1215 @@
+/*************************************************************************************************
+ * @file Bench.cpp
+ *
+ * @brief End-to-end load benchmark of Core and the Agents against a local stand-in web server.
+ *
+ * The benchmark serves HTTP and HTTPS on the loopback interface with an artificial latency, generates a
+ * configuration of as many jobs as asked, runs the agents and Core built next to it, and reports per
+ * interval the probes served, the CPU the agents spend per probe, the rate Core ingests results at and
+ * how long results take from the agent to Core. Nothing leaves the machine.
+ *
+ *************************************************************************************************/
+#include "Common.h"
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+
+#define BENCH_JOBS 2000          ///< Default number of jobs in the generated configuration.
+#define BENCH_AGENTS 4           ///< Default number of agents the jobs are spread over.
+#define BENCH_FREQUENCY_SEC 5    ///< Default seconds between two runs of a job.
+#define BENCH_LATENCY_MS 20      ///< Default time the stand-in server waits before answering.
+#define BENCH_TLS_PERCENT 25     ///< Default share of the jobs probing over HTTPS.
+#define BENCH_INTERVAL_SEC 10    ///< Default length of a measurement round, also Core's summary interval.
+#define BENCH_ROUNDS 3           ///< Default number of measured rounds, after one warm-up round.
+#define BENCH_PORT 9400          ///< Default HTTP port, HTTPS is the next one and the agents follow.
+#define BENCH_BODY_LEN 512       ///< Bytes of every response body.
+#define SERVER_BACKLOG 1024
+#define SERVER_MAX_EVENTS 256
+#define SERVER_READ_LEN (16 << 10)
+#define MAX_HEADER_LEN (64 << 10) ///< A client sending more than this without a full request is dropped.
+#define STARTUP_GRACE_MS 300      ///< Time given to the agents to listen before Core starts.
+#define CORE_LINE_LEN 8192        ///< Longer lines of Core are read in pieces, only its short ingest lines matter.
+
+using namespace std;
+
+namespace
+{
+    // #region Global Variables
+
+    volatile sig_atomic_t g_stop = 0;
+
+    // #endregion
+
+    // #region Utility Methods
+
+    void PrintUsage()
+    {
+        printf("Usage: ./bench [-j <jobs>] [-a <agents>] [-f <frequency-sec>] [-l <latency-ms>] [-t <tls-percent>] [-m cold|warm] "
+               "[-i <interval-sec>] [-n <rounds>] [-p <port>] [-w <workers>]\n");
+    }
+
+    uint64_t NowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    void OnSignal(int)
+    {
+        g_stop = 1;
+    }
+
+    bool WriteFile(const string &path, const string &content)
+    {
+        FILE *file = fopen(path.c_str(), "w");
+        if (file == nullptr)
+        {
+            cerr << "fopen " << path << ": " << strerror(errno) << endl;
+            return false;
+        }
+
+        bool ok = fwrite(content.data(), 1, content.size(), file) == content.size();
+        ok = (fclose(file) == 0) && ok;
+
+        return ok;
+    }
+
+    // #endregion
+} // Anonymous namespace
+
+namespace BenchImplementation
+{
+    /**
+     * @class TestCertificate
+     *
+     * @brief Self-signed certificate of 127.0.0.1, made at startup so that HTTPS needs no file of the tree.
+     */
+    class TestCertificate
+    {
+    public:
+        TestCertificate() : _key(nullptr), _cert(nullptr)
+        {
+        }
+
+        TestCertificate(const TestCertificate &) = delete;
+        TestCertificate &operator=(const TestCertificate &) = delete;
+
+        ~TestCertificate()
+        {
+            X509_free(_cert);
+            EVP_PKEY_free(_key);
+        }
+
+        /**
+         * @brief Generate a P-256 key and a certificate valid for a day.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Generate()
+        {
+            _key = EVP_EC_gen("P-256");
+            _cert = X509_new();
+            if (_key == nullptr || _cert == nullptr)
+            {
+                return -1;
+            }
+
+            X509_set_version(_cert, 2);
+            ASN1_INTEGER_set(X509_get_serialNumber(_cert), (long)time(nullptr));
+            X509_gmtime_adj(X509_getm_notBefore(_cert), -3600);
+            X509_gmtime_adj(X509_getm_notAfter(_cert), 86400);
+            X509_set_pubkey(_cert, _key);
+
+            X509_NAME *name = X509_get_subject_name(_cert);
+            X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)DEFAULT_AGENT_IP, -1, -1, 0);
+            X509_set_issuer_name(_cert, name);
+
+            // It is its own CA: the agents are given it as the only one they trust.
+            X509V3_CTX ctx;
+            X509V3_set_ctx_nodb(&ctx);
+            X509V3_set_ctx(&ctx, _cert, _cert, nullptr, nullptr, 0);
+
+            const pair<int32_t, const char *> extensions[] = {{NID_basic_constraints, "critical,CA:TRUE"},
+                                                               {NID_key_usage, "critical,digitalSignature,keyCertSign"},
+                                                               {NID_subject_alt_name, "IP:" DEFAULT_AGENT_IP}};
+            for (const pair<int32_t, const char *> &extension : extensions)
+            {
+                X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, &ctx, extension.first, extension.second);
+                if (ext == nullptr)
+                {
+                    return -1;
+                }
+                X509_add_ext(_cert, ext, -1);
+                X509_EXTENSION_free(ext);
+            }
+
+            return X509_sign(_cert, _key, EVP_sha256()) > 0 ? 0 : -1;
+        }
+
+        /**
+         * @brief Write the certificate in PEM, for the agents to trust it.
+         *
+         * @param path File to write.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t WritePem(const string &path)
+        {
+            FILE *file = fopen(path.c_str(), "w");
+            if (file == nullptr)
+            {
+                cerr << "fopen " << path << ": " << strerror(errno) << endl;
+                return -1;
+            }
+
+            int32_t ret = PEM_write_X509(file, _cert) == 1 ? 0 : -1;
+            fclose(file);
+
+            return ret;
+        }
+
+        /**
+         * @brief Create a server context serving this certificate.
+         *
+         * @return SSL_CTX* The context, null on failure.
+         */
+        SSL_CTX *NewServerContext()
+        {
+            SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+            if (ctx == nullptr || SSL_CTX_use_certificate(ctx, _cert) != 1 || SSL_CTX_use_PrivateKey(ctx, _key) != 1)
+            {
+                SSL_CTX_free(ctx);
+                return nullptr;
+            }
+            SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+            return ctx;
+        }
+
+    private:
+        EVP_PKEY *_key;
+        X509 *_cert;
+    };
+
+    /**
+     * @class StandInServer
+     *
+     * @brief Minimal HTTP/1.1 server answering any request with the same body after a fixed delay.
+     *
+     * One epoll thread per listening port. Connections are kept alive unless the client closes them, the
+     * delayed answers wait in a min-heap whose head gives the epoll timeout. With a TLS context, every
+     * connection is handshaken first and the bytes go through OpenSSL.
+     */
+    class StandInServer
+    {
+    public:
+        /**
+         * @brief Construct a new Stand In Server object.
+         *
+         * @param latency_ms Time between a request and its answer.
+         * @param body_len Bytes of the response body.
+         * @param tls Context of the HTTPS server, null for plain HTTP. Owned by the caller.
+         */
+        StandInServer(uint32_t latency_ms, uint32_t body_len, SSL_CTX *tls)
+            : _latency_ms(latency_ms), _tls(tls), _listen_fd(-1), _epoll_fd(-1), _next_gen(0), _requests(0), _stop(false)
+        {
+            _response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " + to_string(body_len) + "\r\n\r\n" +
+                        string(body_len, 'x');
+        }
+
+        StandInServer(const StandInServer &) = delete;
+        StandInServer &operator=(const StandInServer &) = delete;
+
+        ~StandInServer()
+        {
+            Stop();
+            for (auto &entry : _clients)
+            {
+                SSL_free(entry.second->ssl);
+                close(entry.first);
+            }
+            if (_epoll_fd >= 0)
+            {
+                close(_epoll_fd);
+            }
+            if (_listen_fd >= 0)
+            {
+                close(_listen_fd);
+            }
+        }
+
+        /**
+         * @brief Listen on the loopback interface.
+         *
+         * @param port Port to listen on.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Listen(int32_t port)
+        {
+            struct sockaddr_in address;
+            int32_t opt = 1;
+
+            if ((_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 || (_epoll_fd = epoll_create1(0)) < 0)
+            {
+                cerr << "StandInServer::Listen: " << strerror(errno) << endl;
+                return -1;
+            }
+            setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+            memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            inet_pton(AF_INET, DEFAULT_AGENT_IP, &address.sin_addr);
+
+            if (bind(_listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(_listen_fd, SERVER_BACKLOG) < 0)
+            {
+                cerr << "StandInServer::Listen " << port << ": " << strerror(errno) << endl;
+                return -1;
+            }
+
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = _listen_fd;
+            epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _listen_fd, &event);
+
+            return 0;
+        }
+
+        void Start()
+        {
+            _thread = thread(&StandInServer::Run, this);
+        }
+
+        void Stop()
+        {
+            _stop = true;
+            if (_thread.joinable())
+            {
+                _thread.join();
+            }
+        }
+
+        /**
+         * @brief Get the number of requests answered so far.
+         */
+        uint64_t GetRequests()
+        {
+            return _requests.load(memory_order_relaxed);
+        }
+
+    private:
+        struct Client
+        {
+            int32_t fd;
+            SSL *ssl;
+            bool handshaken;
+            bool want_write; // EPOLLOUT is watched.
+            uint64_t gen;    // Tells a reused fd from the connection a delayed answer was for.
+            string in;
+            string out;
+            size_t out_pos;
+        };
+
+        struct Answer
+        {
+            uint64_t due_ms;
+            int32_t fd;
+            uint64_t gen;
+
+            bool operator>(const Answer &other) const
+            {
+                return due_ms > other.due_ms;
+            }
+        };
+
+        void Run()
+        {
+            struct epoll_event events[SERVER_MAX_EVENTS];
+
+            while (!_stop)
+            {
+                int32_t timeout = 100;
+                if (!_answers.empty())
+                {
+                    uint64_t now = NowMs();
+                    timeout = (_answers.top().due_ms <= now) ? 0 : min<uint64_t>(timeout, _answers.top().due_ms - now);
+                }
+
+                int32_t count = epoll_wait(_epoll_fd, events, SERVER_MAX_EVENTS, timeout);
+                if (count < 0 && errno != EINTR)
+                {
+                    cerr << "StandInServer::Run: " << strerror(errno) << endl;
+                    return;
+                }
+
+                for (int32_t index = 0; index < count; index++)
+                {
+                    if (events[index].data.fd == _listen_fd)
+                    {
+                        OnAccept();
+                        continue;
+                    }
+
+                    auto found = _clients.find(events[index].data.fd);
+                    if (found == _clients.end())
+                    {
+                        continue;
+                    }
+
+                    Client &client = *found->second;
+                    if ((events[index].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && OnReadable(client) != 0)
+                    {
+                        Close(client.fd);
+                        continue;
+                    }
+                    if ((events[index].events & EPOLLOUT) && Flush(client) != 0)
+                    {
+                        Close(client.fd);
+                    }
+                }
+
+                SendDueAnswers();
+            }
+        }
+
+        void OnAccept()
+        {
+            int32_t fd;
+            int32_t opt = 1;
+
+            while ((fd = accept4(_listen_fd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0)
+            {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+                unique_ptr<Client> client(new Client{fd, nullptr, _tls == nullptr, false, ++_next_gen, string(), string(), 0});
+                if (_tls != nullptr)
+                {
+                    client->ssl = SSL_new(_tls);
+                    SSL_set_fd(client->ssl, fd);
+                    SSL_set_accept_state(client->ssl);
+                }
+
+                struct epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.fd = fd;
+                epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+                _clients[fd] = move(client);
+            }
+        }
+
+        /**
+         * @brief Read what the client sent and queue an answer per complete request.
+         *
+         * @return int32_t Status code, -1 when the connection is to be closed.
+         */
+        int32_t OnReadable(Client &client)
+        {
+            char buf[SERVER_READ_LEN];
+
+            if (!client.handshaken)
+            {
+                int32_t ret = SSL_do_handshake(client.ssl);
+                if (ret != 1)
+                {
+                    return WantsMore(client, ret);
+                }
+                client.handshaken = true;
+                WatchWrite(client, !client.out.empty());
+            }
+
+            while (1)
+            {
+                ssize_t len;
+                if (client.ssl != nullptr)
+                {
+                    len = SSL_read(client.ssl, buf, sizeof(buf));
+                    if (len <= 0)
+                    {
+                        if (WantsMore(client, (int32_t)len) != 0)
+                        {
+                            return -1;
+                        }
+                        break;
+                    }
+                }
+                else
+                {
+                    len = recv(client.fd, buf, sizeof(buf), 0);
+                    if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                    {
+                        return -1;
+                    }
+                    if (len < 0)
+                    {
+                        break;
+                    }
+                }
+                client.in.append(buf, len);
+            }
+
+            return ParseRequests(client);
+        }
+
+        /**
+         * @brief Tell a TLS call that only waits for the socket from a failed one.
+         */
+        int32_t WantsMore(Client &client, int32_t ret)
+        {
+            switch (SSL_get_error(client.ssl, ret))
+            {
+            case SSL_ERROR_WANT_READ:
+                return 0;
+            case SSL_ERROR_WANT_WRITE:
+                WatchWrite(client, true);
+                return 0;
+            default:
+                ERR_clear_error();
+                return -1;
+            }
+        }
+
+        int32_t ParseRequests(Client &client)
+        {
+            size_t start = 0;
+
+            while (1)
+            {
+                size_t end = client.in.find("\r\n\r\n", start);
+                if (end == string::npos)
+                {
+                    break;
+                }
+
+                // Only a body announced by its length is supported, which is all a probe sends.
+                size_t body_len = 0;
+                string head = client.in.substr(start, end - start);
+                for (char &c : head)
+                {
+                    c = tolower(c);
+                }
+                size_t field = head.find("\r\ncontent-length:");
+                if (field != string::npos)
+                {
+                    body_len = strtoul(head.c_str() + field + strlen("\r\ncontent-length:"), nullptr, 10);
+                }
+                if (client.in.size() < end + 4 + body_len)
+                {
+                    break;
+                }
+                start = end + 4 + body_len;
+
+                _answers.push(Answer{NowMs() + _latency_ms, client.fd, client.gen});
+            }
+
+            client.in.erase(0, start);
+            return client.in.size() > MAX_HEADER_LEN ? -1 : 0;
+        }
+
+        /**
+         * @brief Send the answers that are due.
+         */
+        void SendDueAnswers()
+        {
+            uint64_t now = NowMs();
+
+            while (!_answers.empty() && _answers.top().due_ms <= now)
+            {
+                Answer answer = _answers.top();
+                _answers.pop();
+
+                auto found = _clients.find(answer.fd);
+                if (found == _clients.end() || found->second->gen != answer.gen)
+                {
+                    continue;
+                }
+
+                found->second->out += _response;
+                _requests.fetch_add(1, memory_order_relaxed);
+                if (found->second->handshaken && Flush(*found->second) != 0)
+                {
+                    Close(answer.fd);
+                }
+            }
+        }
+
+        int32_t Flush(Client &client)
+        {
+            if (!client.handshaken)
+            {
+                return OnReadable(client);
+            }
+
+            while (client.out_pos < client.out.size())
+            {
+                const char *data = client.out.data() + client.out_pos;
+                size_t len = client.out.size() - client.out_pos;
+                ssize_t sent;
+
+                if (client.ssl != nullptr)
+                {
+                    sent = SSL_write(client.ssl, data, (int32_t)len);
+                    if (sent <= 0)
+                    {
+                        if (SSL_get_error(client.ssl, (int32_t)sent) == SSL_ERROR_WANT_WRITE)
+                        {
+                            break;
+                        }
+                        ERR_clear_error();
+                        return -1;
+                    }
+                }
+                else
+                {
+                    sent = send(client.fd, data, len, MSG_NOSIGNAL);
+                    if (sent < 0)
+                    {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                        {
+                            break;
+                        }
+                        return -1;
+                    }
+                }
+                client.out_pos += sent;
+            }
+
+            if (client.out_pos == client.out.size())
+            {
+                client.out.clear();
+                client.out_pos = 0;
+            }
+            WatchWrite(client, !client.out.empty());
+
+            return 0;
+        }
+
+        void WatchWrite(Client &client, bool enable)
+        {
+            if (client.want_write == enable)
+            {
+                return;
+            }
+
+            struct epoll_event event = {};
+            event.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+            event.data.fd = client.fd;
+            epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, client.fd, &event);
+            client.want_write = enable;
+        }
+
+        void Close(int32_t fd)
+        {
+            auto found = _clients.find(fd);
+            if (found == _clients.end())
+            {
+                return;
+            }
+
+            SSL_free(found->second->ssl);
+            close(fd);
+            _clients.erase(found);
+        }
+
+        uint32_t _latency_ms;
+        SSL_CTX *_tls;
+        int32_t _listen_fd;
+        int32_t _epoll_fd;
+        uint64_t _next_gen;
+        string _response;
+        unordered_map<int32_t, unique_ptr<Client>> _clients;
+        priority_queue<Answer, vector<Answer>, greater<Answer>> _answers;
+        atomic<uint64_t> _requests;
+        atomic<bool> _stop;
+        thread _thread;
+    };
+
+    /**
+     * @brief CPU time of a process, the children it reaped included.
+     */
+    struct ProcessTime
+    {
+        pid_t ppid;
+        uint64_t ticks;
+    };
+
+    /**
+     * @brief Read the CPU time of every process of the machine.
+     *
+     * @return map<pid_t, ProcessTime> Processes by pid.
+     */
+    map<pid_t, ProcessTime> ReadProcessTimes()
+    {
+        map<pid_t, ProcessTime> processes;
+        DIR *dir = opendir("/proc");
+        if (dir == nullptr)
+        {
+            cerr << "opendir /proc: " << strerror(errno) << endl;
+            return processes;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            pid_t pid = atoi(entry->d_name);
+            if (pid <= 0)
+            {
+                continue;
+            }
+
+            char path[64];
+            char line[1024];
+            snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+            FILE *file = fopen(path, "r");
+            if (file == nullptr)
+            {
+                continue;
+            }
+            bool read = fgets(line, sizeof(line), file) != nullptr;
+            fclose(file);
+
+            // The command name may hold spaces, the fields are counted from its closing parenthesis.
+            char *fields = read ? strrchr(line, ')') : nullptr;
+            unsigned long long utime, stime, cutime, cstime;
+            int32_t ppid;
+            if (fields != nullptr && sscanf(fields + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu", &ppid, &utime,
+                                            &stime, &cutime, &cstime) == 5)
+            {
+                processes[pid] = ProcessTime{ppid, utime + stime + cutime + cstime};
+            }
+        }
+        closedir(dir);
+
+        return processes;
+    }
+
+    /**
+     * @brief Sum the CPU time of some processes and of all their descendants.
+     *
+     * @param processes Every process, from ReadProcessTimes.
+     * @param roots Processes to account.
+     *
+     * @return double CPU time in milliseconds.
+     */
+    double TreeCpuMs(const map<pid_t, ProcessTime> &processes, const set<pid_t> &roots)
+    {
+        uint64_t ticks = 0;
+
+        for (const auto &process : processes)
+        {
+            pid_t pid = process.first;
+            for (int32_t depth = 0; depth < 8 && pid > 1; depth++)
+            {
+                if (roots.count(pid) != 0)
+                {
+                    ticks += process.second.ticks;
+                    break;
+                }
+                auto parent = processes.find(pid);
+                pid = (parent == processes.end()) ? 0 : parent->second.ppid;
+            }
+        }
+
+        return ticks * 1000.0 / sysconf(_SC_CLK_TCK);
+    }
+
+    /**
+     * @brief Start a program with its output sent to a file descriptor.
+     *
+     * @param args Program path followed by its arguments.
+     * @param out_fd Descriptor for its standard output.
+     * @param err_fd Descriptor for its standard error.
+     *
+     * @return pid_t Pid of the program, -1 on failure.
+     */
+    pid_t Spawn(const vector<string> &args, int32_t out_fd, int32_t err_fd)
+    {
+        vector<char *> argv;
+        for (const string &arg : args)
+        {
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            cerr << "fork: " << strerror(errno) << endl;
+            return -1;
+        }
+        else if (pid == 0)
+        {
+            dup2(out_fd, STDOUT_FILENO);
+            dup2(err_fd, STDERR_FILENO);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+
+        return pid;
+    }
+
+    /**
+     * @brief Ingest line Core prints with every summary.
+     */
+    struct IngestSample
+    {
+        uint64_t results;
+        uint64_t errors;
+        double rate;
+        double p50_ms;
+        double p99_ms;
+        double max_ms;
+    };
+
+    /**
+     * @class CoreReader
+     *
+     * @brief Reads the output of Core and keeps its ingest lines, the latency summaries are skipped.
+     */
+    class CoreReader
+    {
+    public:
+        CoreReader(int32_t fd) : _file(fdopen(fd, "r")), _closed(false)
+        {
+        }
+
+        ~CoreReader()
+        {
+            if (_thread.joinable())
+            {
+                _thread.join();
+            }
+            if (_file != nullptr)
+            {
+                fclose(_file);
+            }
+        }
+
+        void Start()
+        {
+            _thread = thread(&CoreReader::Run, this);
+        }
+
+        /**
+         * @brief Wait for an ingest line.
+         *
+         * @param index Number of the line, from 0.
+         * @param timeout_ms Time to wait at most.
+         * @param sample Line read.
+         *
+         * @return int32_t Status code, -1 when Core stopped or is late.
+         */
+        int32_t Wait(size_t index, uint64_t timeout_ms, IngestSample &sample)
+        {
+            unique_lock<mutex> lock(_mutex);
+            uint64_t deadline = NowMs() + timeout_ms;
+
+            // Woken up regularly, so that an interrupted benchmark does not wait for Core.
+            while (_samples.size() <= index && !_closed && !g_stop && NowMs() < deadline)
+            {
+                _cond.wait_for(lock, chrono::milliseconds(100));
+            }
+            if (_samples.size() <= index)
+            {
+                return -1;
+            }
+            sample = _samples[index];
+
+            return 0;
+        }
+
+    private:
+        void Run()
+        {
+            char line[CORE_LINE_LEN];
+
+            while (_file != nullptr && fgets(line, sizeof(line), _file) != nullptr)
+            {
+                IngestSample sample;
+                unsigned long long results, errors;
+                if (sscanf(line, "ingest results=%llu err=%llu rate=%lf/s delivery[p50=%lfms p99=%lfms max=%lfms]", &results, &errors,
+                           &sample.rate, &sample.p50_ms, &sample.p99_ms, &sample.max_ms) == 6)
+                {
+                    sample.results = results;
+                    sample.errors = errors;
+                    lock_guard<mutex> lock(_mutex);
+                    _samples.push_back(sample);
+                    _cond.notify_all();
+                }
+            }
+
+            lock_guard<mutex> lock(_mutex);
+            _closed = true;
+            _cond.notify_all();
+        }
+
+        FILE *_file;
+        bool _closed;
+        vector<IngestSample> _samples;
+        mutex _mutex;
+        condition_variable _cond;
+        thread _thread;
+    };
+
+    /**
+     * @brief Settings of one benchmark run.
+     */
+    struct BenchSettings
+    {
+        int32_t jobs = BENCH_JOBS;
+        int32_t agents = BENCH_AGENTS;
+        int32_t frequency_sec = BENCH_FREQUENCY_SEC;
+        int32_t latency_ms = BENCH_LATENCY_MS;
+        int32_t tls_percent = BENCH_TLS_PERCENT;
+        int32_t interval_sec = BENCH_INTERVAL_SEC;
+        int32_t rounds = BENCH_ROUNDS;
+        int32_t port = BENCH_PORT;
+        string mode = "cold";
+        string workers; // Passed to the agents as -w when given.
+    };
+
+    /**
+     * @brief Write the job configuration and the agent inventory of the run.
+     *
+     * @param settings Settings of the run.
+     * @param dir Directory to write to.
+     *
+     * @return int32_t Status code.
+     */
+    int32_t WriteSetup(const BenchSettings &settings, const string &dir)
+    {
+        string config;
+        string inventory;
+
+        for (int32_t index = 0; index < settings.jobs; index++)
+        {
+            // Spread the HTTPS jobs evenly rather than in a block, so that each agent gets its share.
+            bool tls = (index * settings.tls_percent) / 100 != ((index + 1) * settings.tls_percent) / 100;
+            int32_t port = tls ? settings.port + 1 : settings.port;
+
+            config += to_string(index % settings.agents + 1) + (tls ? " https://" : " http://") + DEFAULT_AGENT_IP ":" +
+                      to_string(port) + "/job/" + to_string(index + 1) + " " + to_string(settings.frequency_sec) + " mode=" + settings.mode +
+                      "\n";
+        }
+
+        for (int32_t agent = 1; agent <= settings.agents; agent++)
+        {
+            inventory += to_string(agent) + " " DEFAULT_AGENT_IP ":" + to_string(settings.port + 1 + agent) + "\n";
+        }
+
+        return (WriteFile(dir + "/config.txt", config) && WriteFile(dir + "/agents.txt", inventory)) ? 0 : -1;
+    }
+
+    /**
+     * @brief Counters sampled at the end of every round.
+     */
+    struct Snapshot
+    {
+        uint64_t ms;
+        uint64_t requests;
+        double agent_cpu_ms;
+        double core_cpu_ms;
+    };
+
+    /**
+     * @brief Run the benchmark: start the servers, the agents and Core, then report every round.
+     *
+     * @param settings Settings of the run.
+     * @param bin_dir Directory holding the core and agent binaries.
+     *
+     * @return int32_t Status code.
+     */
+    int32_t RunBench(const BenchSettings &settings, const string &bin_dir)
+    {
+        char dir_template[] = "/tmp/swm-bench-XXXXXX";
+        if (mkdtemp(dir_template) == nullptr)
+        {
+            cerr << "mkdtemp: " << strerror(errno) << endl;
+            return -1;
+        }
+        string dir = dir_template;
+
+        TestCertificate certificate;
+        SSL_CTX *tls = nullptr;
+        if (certificate.Generate() != 0 || certificate.WritePem(dir + "/cert.pem") != 0 || (tls = certificate.NewServerContext()) == nullptr)
+        {
+            cerr << "Cannot make the test certificate." << endl;
+            ERR_print_errors_fp(stderr);
+            return -1;
+        }
+
+        StandInServer http(settings.latency_ms, BENCH_BODY_LEN, nullptr);
+        StandInServer https(settings.latency_ms, BENCH_BODY_LEN, tls);
+        if (http.Listen(settings.port) != 0 || https.Listen(settings.port + 1) != 0 || WriteSetup(settings, dir) != 0)
+        {
+            SSL_CTX_free(tls);
+            return -1;
+        }
+        http.Start();
+        https.Start();
+
+        printf("Benchmark of %d jobs on %d agents every %ds (%.1f probes/s offered), %d%% HTTPS, %s, %dms server latency, files in %s\n",
+               settings.jobs, settings.agents, settings.frequency_sec, (double)settings.jobs / settings.frequency_sec, settings.tls_percent,
+               settings.mode.c_str(), settings.latency_ms, dir.c_str());
+
+        set<pid_t> agents;
+        map<pid_t, int32_t> agent_ids;
+        for (int32_t agent = 1; agent <= settings.agents; agent++)
+        {
+            vector<string> args = {bin_dir + "/agent", "-l", DEFAULT_AGENT_IP ":" + to_string(settings.port + 1 + agent), "-c",
+                                   dir + "/cert.pem"};
+            if (!settings.workers.empty())
+            {
+                args.push_back("-w");
+                args.push_back(settings.workers);
+            }
+            args.push_back(to_string(agent));
+
+            int32_t log_fd = open((dir + "/agent-" + to_string(agent) + ".log").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            pid_t pid = Spawn(args, log_fd, log_fd);
+            close(log_fd);
+            if (pid > 0)
+            {
+                agents.insert(pid);
+                agent_ids[pid] = agent;
+            }
+        }
+        usleep(STARTUP_GRACE_MS * 1000);
+
+        // An agent that did not start is reported now, rather than as Core failing to reach it.
+        for (auto &entry : agent_ids)
+        {
+            int32_t status;
+            if (waitpid(entry.first, &status, WNOHANG) == entry.first)
+            {
+                cerr << "Agent " << entry.second << " exited with " << (WIFEXITED(status) ? "status " : "signal ")
+                     << (WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status)) << " while starting, see " << dir << "/agent-"
+                     << entry.second << ".log." << endl;
+                agents.erase(entry.first);
+            }
+        }
+
+        int32_t out[2];
+        int32_t err_fd = open((dir + "/core.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        pid_t core = -1;
+        if (agents.size() == (size_t)settings.agents && pipe2(out, O_CLOEXEC) == 0)
+        {
+            core = Spawn({bin_dir + "/core", "-a", dir + "/agents.txt", "-i", to_string(settings.interval_sec), dir + "/config.txt"}, out[1],
+                         err_fd);
+            close(out[1]);
+        }
+        close(err_fd);
+
+        int32_t ret = 0;
+        if (agents.size() != (size_t)settings.agents)
+        {
+            cerr << "Cannot start the agents from " << bin_dir << "." << endl;
+            ret = -1;
+        }
+        else if (core < 0)
+        {
+            cerr << "Cannot start Core from " << bin_dir << "." << endl;
+            ret = -1;
+        }
+        else
+        {
+            CoreReader reader(out[0]);
+            reader.Start();
+
+            map<pid_t, ProcessTime> processes = ReadProcessTimes();
+            Snapshot last = {NowMs(), http.GetRequests() + https.GetRequests(), TreeCpuMs(processes, agents), TreeCpuMs(processes, {core})};
+            Snapshot first = last;
+            double worst_p99_ms = 0;
+            double worst_max_ms = 0;
+            double sum_p50_ms = 0;
+            uint64_t results = 0;
+            uint64_t errors = 0;
+
+            printf("%-8s %10s %10s %16s %16s %10s %8s %12s %12s %12s\n", "round", "probes", "probes/s", "agent-cpu/probe", "core-cpu/result",
+                   "ingest/s", "failed", "deliver-p50", "deliver-p99", "deliver-max");
+
+            for (int32_t round = 0; round <= settings.rounds && !g_stop; round++)
+            {
+                IngestSample sample;
+                if (reader.Wait(round, settings.interval_sec * 3000ULL, sample) != 0)
+                {
+                    cerr << (g_stop ? "Interrupted." : "Core stopped reporting, see its log.") << endl;
+                    ret = -1;
+                    break;
+                }
+
+                processes = ReadProcessTimes();
+                Snapshot now = {NowMs(), http.GetRequests() + https.GetRequests(), TreeCpuMs(processes, agents), TreeCpuMs(processes, {core})};
+                uint64_t probes = now.requests - last.requests;
+                double sec = max<uint64_t>(now.ms - last.ms, 1) / 1000.0;
+
+                printf("%-8s %10llu %10.1f %14.3fms %14.3fms %10.1f %8llu %10.3fms %10.3fms %10.3fms\n",
+                       round == 0 ? "warm-up" : to_string(round).c_str(), (unsigned long long)probes, probes / sec,
+                       (now.agent_cpu_ms - last.agent_cpu_ms) / max<uint64_t>(probes, 1),
+                       (now.core_cpu_ms - last.core_cpu_ms) / max<uint64_t>(sample.results, 1), sample.rate,
+                       (unsigned long long)sample.errors, sample.p50_ms, sample.p99_ms, sample.max_ms);
+                fflush(stdout);
+
+                // The warm-up round connects and distributes the jobs, it is left out of the totals.
+                if (round == 0)
+                {
+                    first = now;
+                }
+                else
+                {
+                    results += sample.results;
+                    errors += sample.errors;
+                    sum_p50_ms += sample.p50_ms;
+                    worst_p99_ms = max(worst_p99_ms, sample.p99_ms);
+                    worst_max_ms = max(worst_max_ms, sample.max_ms);
+                }
+                last = now;
+            }
+
+            if (ret == 0 && settings.rounds > 0)
+            {
+                uint64_t probes = last.requests - first.requests;
+                double sec = max<uint64_t>(last.ms - first.ms, 1) / 1000.0;
+
+                printf("%-8s %10llu %10.1f %14.3fms %14.3fms %10.1f %8llu %10.3fms %10.3fms %10.3fms\n", "total",
+                       (unsigned long long)probes, probes / sec, (last.agent_cpu_ms - first.agent_cpu_ms) / max<uint64_t>(probes, 1),
+                       (last.core_cpu_ms - first.core_cpu_ms) / max<uint64_t>(results, 1), results / sec, (unsigned long long)errors,
+                       sum_p50_ms / settings.rounds, worst_p99_ms, worst_max_ms);
+            }
+
+            kill(core, SIGTERM);
+            waitpid(core, nullptr, 0);
+        }
+
+        for (pid_t agent : agents)
+        {
+            kill(agent, SIGTERM);
+        }
+        for (pid_t agent : agents)
+        {
+            waitpid(agent, nullptr, 0);
+        }
+        http.Stop();
+        https.Stop();
+        SSL_CTX_free(tls);
+
+        // Keep the logs of a failed run.
+        if (ret == 0)
+        {
+            for (const char *name : {"config.txt", "agents.txt", "cert.pem", "core.log"})
+            {
+                unlink((dir + "/" + name).c_str());
+            }
+            for (int32_t agent = 1; agent <= settings.agents; agent++)
+            {
+                unlink((dir + "/agent-" + to_string(agent) + ".log").c_str());
+            }
+            rmdir(dir.c_str());
+        }
+
+        return ret;
+    }
+} // namespace BenchImplementation
+
+/**
+ * @brief Main function of the benchmark.
+ *
+ * @param argc A command line argument count.
+ * @param argv An array of command line arguments.
+ *
+ * @return int32_t An application status code.
+ */
+int32_t main(int32_t argc, char *argv[])
+{
+    BenchImplementation::BenchSettings settings;
+    int32_t opt;
+
+    while ((opt = getopt(argc, argv, "j:a:f:l:t:m:i:n:p:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            settings.jobs = atoi(optarg);
+            break;
+        case 'a':
+            settings.agents = atoi(optarg);
+            break;
+        case 'f':
+            settings.frequency_sec = atoi(optarg);
+            break;
+        case 'l':
+            settings.latency_ms = atoi(optarg);
+            break;
+        case 't':
+            settings.tls_percent = atoi(optarg);
+            break;
+        case 'm':
+            settings.mode = optarg;
+            break;
+        case 'i':
+            settings.interval_sec = atoi(optarg);
+            break;
+        case 'n':
+            settings.rounds = atoi(optarg);
+            break;
+        case 'p':
+            settings.port = atoi(optarg);
+            break;
+        case 'w':
+            settings.workers = optarg;
+            break;
+        default:
+            PrintUsage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc || settings.jobs < 1 || settings.agents < 1 || settings.agents > settings.jobs || settings.frequency_sec < 1 ||
+        settings.latency_ms < 0 || settings.tls_percent < 0 || settings.tls_percent > 100 || settings.interval_sec < 1 || settings.rounds < 0 ||
+        settings.port < 1 || settings.port + 1 + settings.agents > 65535 || (settings.mode != "cold" && settings.mode != "warm"))
+    {
+        PrintUsage();
+        exit(EXIT_FAILURE);
+    }
+
+    // Core and the agents are expected next to the benchmark.
+    char self[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    string bin_dir = ".";
+    if (len > 0)
+    {
+        self[len] = '\0';
+        bin_dir = string(self, strrchr(self, '/') - self);
+    }
+
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    return BenchImplementation::RunBench(settings, bin_dir) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -10,31 +10,1613 @@
 #define _SYNTHETIC_WEB_MONITORING_COMMON_H
 
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
-#define MAX_AGENT_WORKER 5 ///< Maximum job an agent can handle
-#define MAX_AGENT 3        ///< Maximum number of Agent a Core need to manage.
-#define MAX_TEST 50        ///< Maximum jobs a core can handle.
+#define MAX_AGENT_WORKER 64 ///< Upper bound of the worker threads of an agent, each of them runs any number of jobs.
+
+#define DEFAULT_AGENT_IP "127.0.0.1"
+#define DEFAULT_AGENT_PORT_BASE 8000 ///< Agent N listens on DEFAULT_AGENT_PORT_BASE + N * DEFAULT_AGENT_PORT_STEP
+#define DEFAULT_AGENT_PORT_STEP 100  ///< unless an endpoint is given explicitly.
 
-#define STRING_LENGTH 128
 #define POLL_TIMEOUT_MS 1000
 
+#define PROBE_COLD 0 ///< Every probe resolves the name, connects and handshakes TLS from scratch.
+#define PROBE_WARM 1 ///< Probes reuse connections, TLS sessions and DNS answers cached by the agent.
+#define MAX_JITTER_PERCENT 50 ///< Runs of a job never start later than half a period.
+#define MAX_TXN_STEPS 16      ///< Steps of a transaction script at most.
+
+#define TXN_ERROR_EXPECT 1001  ///< A step of a transaction answered another HTTP status than the one expected.
+#define TXN_ERROR_EXTRACT 1002 ///< A value to extract was not found in the answer of a step.
+
+#define OP_START 1 ///< Request to run a job, or to update it when the job is already running.
+#define OP_EXIT 2  ///< Request to stop the whole agent.
+#define OP_RESET 3 ///< Agent -> Worker only, drop every job because a new Core session starts.
+#define OP_STOP 4  ///< Request to stop a job.
+
+#define PROTOCOL_VERSION 6
+#define FRAME_HEADER_LEN 6        ///< Payload length (4 bytes, network order), version (1 byte), type (1 byte).
+#define MAX_FRAME_LEN (1 << 20)   ///< Largest payload accepted, anything bigger is a corrupted stream.
+#define READ_CHUNK_LEN (64 << 10) ///< Bytes read from a socket per read() call.
+#define WRITE_CHUNK_LEN (16 << 10) ///< Small frames are appended to the last queued chunk up to this size.
+#define CACHE_LINE_LEN 64
+#define MAX_WRITE_IOV 64           ///< Chunks handed to a single writev() call.
+#define METRICS_REQUEST_LEN 4096   ///< A metrics client sending more than this without a complete request is dropped.
+
+/**
+ * @brief Type of a frame, tells how its payload is to be decoded.
+ */
+enum MessageType : uint8_t
+{
+    MSG_REQUEST = 1,  ///< Core -> Agent, payload is a Request.
+    MSG_RESPONSE = 2,     ///< Agent -> Core, payload is a Response.
+    MSG_RESULT_BATCH = 3, ///< Agent -> Core, payload is a count followed by that many results.
+    MSG_HELLO = 4,        ///< Core -> Agent, first frame on every connection, payload is a Hello.
+    MSG_WELCOME = 5,      ///< Agent -> Core, answer to MSG_HELLO, payload is a Welcome.
+    MSG_LOAD = 6,         ///< Agent -> Core, periodic, payload is a Load.
+};
+
+/**
+ * @brief Value a step of a transaction takes out of its response body, the next steps use it as ${name}.
+ */
+struct TxnExtract
+{
+    std::string name;
+    std::string left;  ///< Text right before the value.
+    std::string right; ///< Text right after it, the value runs to the end of the body when empty.
+
+    bool operator==(const TxnExtract &other) const
+    {
+        return name == other.name && left == other.left && right == other.right;
+    }
+};
+
+/**
+ * @brief One HTTP request of a transaction. ${name} in the URL, headers and body is replaced by a value extracted
+ *        by an earlier step.
+ */
+struct TxnStep
+{
+    std::string method;               ///< GET or POST.
+    std::string url;
+    std::vector<std::string> headers; ///< Each one like "Name: value".
+    std::string body;                 ///< Sent by a POST.
+    uint16_t expect = 0;              ///< HTTP status the step must answer, 0 for any success.
+    std::vector<TxnExtract> extracts;
+
+    bool operator==(const TxnStep &other) const
+    {
+        return method == other.method && url == other.url && headers == other.headers && body == other.body && expect == other.expect &&
+               extracts == other.extracts;
+    }
+};
+
+/**
+ * @brief Result of one step of a transaction, the fields mean the same as in a Response.
+ */
+struct StepTiming
+{
+    uint16_t http_code;
+    uint16_t error;
+    uint32_t dns_us;
+    uint32_t connect_us;
+    uint32_t tls_us;
+    uint32_t ttfb_us;
+    uint32_t total_us;
+    uint64_t bytes;
+};
+
+/**
+ * @brief Opens a session between Core and an Agent.
+ */
+struct Hello
+{
+    uint64_t session; ///< Chosen by Core when it starts, the same on every reconnect.
+};
+
+/**
+ * @brief Tells Core whether the Agent still has the jobs of the session.
+ */
+struct Welcome
+{
+    uint64_t session;
+    uint8_t resumed; ///< 1 when the Agent kept the jobs of this session, 0 when Core must send them again.
+    uint32_t jobs;   ///< Jobs the Agent is running for the session.
+};
+
+/**
+ * @brief Load of an Agent over the last report interval, Core places the pool jobs with it.
+ */
+struct Load
+{
+    uint32_t jobs;         ///< Jobs the Agent runs.
+    uint32_t workers;      ///< Worker threads running.
+    uint32_t max_workers;  ///< Worker threads the Agent may run, its capacity.
+    uint32_t busy;         ///< Time the workers spent handling events, per mille of the interval, summed over the workers.
+    uint32_t probe_mrate;  ///< Probes completed per 1000 seconds.
+};
+
 struct Request
 {
     int32_t op;
-    char url[STRING_LENGTH];
-    int32_t worker;
-    int32_t freq;
+    int32_t job; ///< Job identifier, unique within a Core.
+    int32_t freq; ///< Period in seconds, the first one of an adaptive job.
+    std::string url;
+    uint8_t mode;     ///< PROBE_COLD or PROBE_WARM.
+    uint8_t jitter;   ///< Each run starts late by a random delay up to this percent of the period.
+    int32_t freq_min; ///< Bounds of the period of an adaptive job in seconds, 0 when the period is fixed.
+    int32_t freq_max;
+    std::vector<TxnStep> steps; ///< Script of a transaction, run in order instead of fetching the URL. Empty for a plain probe.
 };
 
+/**
+ * @brief Result of one probe. Phases are durations in microseconds and add up to about total_us. The phases of a
+ *        transaction are the sums over its steps, its HTTP status the one of its last step run.
+ */
 struct Response
 {
     int32_t option;
+    int32_t job; ///< Job the result belongs to, Core knows its URL.
     int32_t runs;
-    double status;
-    char message[STRING_LENGTH];
-    char url[STRING_LENGTH];
+    uint32_t dns_us;     ///< Name resolution.
+    uint32_t connect_us; ///< TCP handshake, once the name is resolved.
+    uint32_t tls_us;     ///< TLS handshake, 0 for plain HTTP.
+    uint32_t ttfb_us;    ///< Request sent until the first byte of the response arrived.
+    uint32_t total_us;   ///< Whole probe, from start to the last byte.
+    uint16_t http_code;  ///< HTTP status code, 0 when no response was received.
+    uint16_t error;      ///< libcurl error code, or TXN_ERROR_*, 0 on success.
+    uint64_t bytes;      ///< Body bytes downloaded.
+    uint8_t mode;        ///< Probe mode the result was measured with, PROBE_COLD or PROBE_WARM.
+    uint64_t time_ms;    ///< Wall clock time the probe completed at, milliseconds since the epoch.
+    std::vector<StepTiming> steps; ///< Steps a transaction ran, up to the one that failed. Empty for a plain probe.
 };
 
+// #region Wire encoding
+
+/**
+ * @brief Append an unsigned LEB128 varint.
+ */
+inline void PutVarint(std::string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+/**
+ * @brief Append a signed value as a zigzag varint, small negative values stay small.
+ */
+inline void PutSigned(std::string &out, int64_t value)
+{
+    PutVarint(out, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+/**
+ * @brief Append a length prefixed string.
+ */
+inline void PutString(std::string &out, const std::string &value)
+{
+    PutVarint(out, value.size());
+    out.append(value);
+}
+
+/**
+ * @class Decoder
+ *
+ * @brief Bounds checked reader over a frame payload, any overrun marks the decoder as failed.
+ */
+class Decoder
+{
+public:
+    /**
+     * @brief Construct a new Decoder object.
+     *
+     * @param data First byte of the payload.
+     * @param len Payload length.
+     */
+    Decoder(const uint8_t *data, size_t len) : _pos(data), _end(data + len)
+    {
+    }
+
+    /**
+     * @brief Read an unsigned LEB128 varint.
+     */
+    uint64_t GetVarint()
+    {
+        uint64_t value = 0;
+        for (int32_t shift = 0; shift < 64 && _pos < _end; shift += 7)
+        {
+            uint8_t byte = *_pos++;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return value;
+            }
+        }
+
+        _failed = true;
+        return 0;
+    }
+
+    /**
+     * @brief Read a zigzag encoded signed varint.
+     */
+    int64_t GetSigned()
+    {
+        uint64_t value = GetVarint();
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    }
+
+    /**
+     * @brief Read a length prefixed string.
+     */
+    std::string GetString()
+    {
+        uint64_t len = GetVarint();
+        if (_failed || len > (uint64_t)(_end - _pos))
+        {
+            _failed = true;
+            return std::string();
+        }
+
+        std::string value((const char *)_pos, len);
+        _pos += len;
+        return value;
+    }
+
+    /**
+     * @brief Get the number of bytes not read yet.
+     */
+    size_t GetRemaining()
+    {
+        return _end - _pos;
+    }
+
+    /**
+     * @brief Whether a read went past the payload or hit a malformed field.
+     */
+    bool Failed()
+    {
+        return _failed;
+    }
+
+private:
+    const uint8_t *_pos;
+    const uint8_t *_end;
+    bool _failed = false;
+};
+
+/**
+ * @brief Start a frame in the buffer, the length is patched by EndFrame once the payload is appended.
+ *
+ * @return size_t Offset of the frame within the buffer.
+ */
+inline size_t BeginFrame(std::string &out, MessageType type)
+{
+    size_t start = out.size();
+    out.append(4, '\0');
+    out.push_back((char)PROTOCOL_VERSION);
+    out.push_back((char)type);
+    return start;
+}
+
+/**
+ * @brief Write the payload length of a frame started with BeginFrame.
+ */
+inline void EndFrame(std::string &out, size_t start)
+{
+    uint32_t len = out.size() - start - FRAME_HEADER_LEN;
+    out[start] = (char)(len >> 24);
+    out[start + 1] = (char)(len >> 16);
+    out[start + 2] = (char)(len >> 8);
+    out[start + 3] = (char)len;
+}
+
+/**
+ * @brief Append a Request frame to the buffer.
+ */
+inline void EncodeRequest(const Request &req, std::string &out)
+{
+    size_t start = BeginFrame(out, MSG_REQUEST);
+    PutVarint(out, req.op);
+    PutVarint(out, req.job);
+    PutVarint(out, req.freq);
+    PutString(out, req.url);
+    PutVarint(out, req.mode);
+    PutVarint(out, req.jitter);
+    PutVarint(out, req.freq_min);
+    PutVarint(out, req.freq_max);
+    PutVarint(out, req.steps.size());
+    for (const TxnStep &step : req.steps)
+    {
+        PutString(out, step.method);
+        PutString(out, step.url);
+        PutVarint(out, step.headers.size());
+        for (const std::string &header : step.headers)
+        {
+            PutString(out, header);
+        }
+        PutString(out, step.body);
+        PutVarint(out, step.expect);
+        PutVarint(out, step.extracts.size());
+        for (const TxnExtract &extract : step.extracts)
+        {
+            PutString(out, extract.name);
+            PutString(out, extract.left);
+            PutString(out, extract.right);
+        }
+    }
+    EndFrame(out, start);
+}
+
+/**
+ * @brief Decode the payload of a MSG_REQUEST frame.
+ *
+ * @return bool False when the payload is malformed.
+ */
+inline bool DecodeRequest(const uint8_t *payload, size_t len, Request &req)
+{
+    Decoder dec(payload, len);
+    req.op = dec.GetVarint();
+    req.job = dec.GetVarint();
+    req.freq = dec.GetVarint();
+    req.url = dec.GetString();
+    req.mode = dec.GetVarint();
+    req.jitter = dec.GetVarint();
+    req.freq_min = dec.GetVarint();
+    req.freq_max = dec.GetVarint();
+
+    // Counts are checked against the bytes left before anything is allocated for them.
+    uint64_t steps = dec.GetVarint();
+    req.steps.clear();
+    if (steps > MAX_TXN_STEPS)
+    {
+        return false;
+    }
+    req.steps.resize(steps);
+    for (TxnStep &step : req.steps)
+    {
+        step.method = dec.GetString();
+        step.url = dec.GetString();
+        uint64_t headers = dec.GetVarint();
+        if (headers > dec.GetRemaining())
+        {
+            return false;
+        }
+        step.headers.resize(headers);
+        for (std::string &header : step.headers)
+        {
+            header = dec.GetString();
+        }
+        step.body = dec.GetString();
+        step.expect = dec.GetVarint();
+        uint64_t extracts = dec.GetVarint();
+        if (extracts > dec.GetRemaining())
+        {
+            return false;
+        }
+        step.extracts.resize(extracts);
+        for (TxnExtract &extract : step.extracts)
+        {
+            extract.name = dec.GetString();
+            extract.left = dec.GetString();
+            extract.right = dec.GetString();
+        }
+    }
+    return !dec.Failed();
+}
+
+/**
+ * @brief Append the fields of a Response without any frame header, as found in a result batch.
+ */
+inline void EncodeResult(const Response &resp, std::string &out)
+{
+    PutVarint(out, resp.option);
+    PutVarint(out, resp.job);
+    PutVarint(out, resp.runs);
+    PutVarint(out, resp.dns_us);
+    PutVarint(out, resp.connect_us);
+    PutVarint(out, resp.tls_us);
+    PutVarint(out, resp.ttfb_us);
+    PutVarint(out, resp.total_us);
+    PutVarint(out, resp.http_code);
+    PutVarint(out, resp.error);
+    PutVarint(out, resp.bytes);
+    PutVarint(out, resp.mode);
+    PutVarint(out, resp.time_ms);
+    PutVarint(out, resp.steps.size());
+    for (const StepTiming &step : resp.steps)
+    {
+        PutVarint(out, step.http_code);
+        PutVarint(out, step.error);
+        PutVarint(out, step.dns_us);
+        PutVarint(out, step.connect_us);
+        PutVarint(out, step.tls_us);
+        PutVarint(out, step.ttfb_us);
+        PutVarint(out, step.total_us);
+        PutVarint(out, step.bytes);
+    }
+}
+
+/**
+ * @brief Append a Hello frame to the buffer.
+ */
+inline void EncodeHello(const Hello &hello, std::string &out)
+{
+    size_t start = BeginFrame(out, MSG_HELLO);
+    PutVarint(out, hello.session);
+    EndFrame(out, start);
+}
+
+/**
+ * @brief Decode the payload of a MSG_HELLO frame.
+ *
+ * @return bool False when the payload is malformed.
+ */
+inline bool DecodeHello(const uint8_t *payload, size_t len, Hello &hello)
+{
+    Decoder dec(payload, len);
+    hello.session = dec.GetVarint();
+    return !dec.Failed();
+}
+
+/**
+ * @brief Append a Welcome frame to the buffer.
+ */
+inline void EncodeWelcome(const Welcome &welcome, std::string &out)
+{
+    size_t start = BeginFrame(out, MSG_WELCOME);
+    PutVarint(out, welcome.session);
+    PutVarint(out, welcome.resumed);
+    PutVarint(out, welcome.jobs);
+    EndFrame(out, start);
+}
+
+/**
+ * @brief Decode the payload of a MSG_WELCOME frame.
+ *
+ * @return bool False when the payload is malformed.
+ */
+inline bool DecodeWelcome(const uint8_t *payload, size_t len, Welcome &welcome)
+{
+    Decoder dec(payload, len);
+    welcome.session = dec.GetVarint();
+    welcome.resumed = dec.GetVarint();
+    welcome.jobs = dec.GetVarint();
+    return !dec.Failed();
+}
+
+/**
+ * @brief Append a Load frame to the buffer.
+ */
+inline void EncodeLoad(const Load &load, std::string &out)
+{
+    size_t start = BeginFrame(out, MSG_LOAD);
+    PutVarint(out, load.jobs);
+    PutVarint(out, load.workers);
+    PutVarint(out, load.max_workers);
+    PutVarint(out, load.busy);
+    PutVarint(out, load.probe_mrate);
+    EndFrame(out, start);
+}
+
+/**
+ * @brief Decode the payload of a MSG_LOAD frame.
+ *
+ * @return bool False when the payload is malformed.
+ */
+inline bool DecodeLoad(const uint8_t *payload, size_t len, Load &load)
+{
+    Decoder dec(payload, len);
+    load.jobs = dec.GetVarint();
+    load.workers = dec.GetVarint();
+    load.max_workers = dec.GetVarint();
+    load.busy = dec.GetVarint();
+    load.probe_mrate = dec.GetVarint();
+    return !dec.Failed();
+}
+
+/**
+ * @brief Read the fields of one Response written by EncodeResult.
+ *
+ * @return bool False when the data is malformed.
+ */
+inline bool DecodeResult(Decoder &dec, Response &resp)
+{
+    resp.option = dec.GetVarint();
+    resp.job = dec.GetVarint();
+    resp.runs = dec.GetVarint();
+    resp.dns_us = dec.GetVarint();
+    resp.connect_us = dec.GetVarint();
+    resp.tls_us = dec.GetVarint();
+    resp.ttfb_us = dec.GetVarint();
+    resp.total_us = dec.GetVarint();
+    resp.http_code = dec.GetVarint();
+    resp.error = dec.GetVarint();
+    resp.bytes = dec.GetVarint();
+    resp.mode = dec.GetVarint();
+    resp.time_ms = dec.GetVarint();
+
+    uint64_t steps = dec.GetVarint();
+    if (steps > MAX_TXN_STEPS)
+    {
+        return false;
+    }
+    resp.steps.resize(steps);
+    for (StepTiming &step : resp.steps)
+    {
+        step.http_code = dec.GetVarint();
+        step.error = dec.GetVarint();
+        step.dns_us = dec.GetVarint();
+        step.connect_us = dec.GetVarint();
+        step.tls_us = dec.GetVarint();
+        step.ttfb_us = dec.GetVarint();
+        step.total_us = dec.GetVarint();
+        step.bytes = dec.GetVarint();
+    }
+    return !dec.Failed();
+}
+
+/**
+ * @brief Append a Response frame to the buffer.
+ */
+inline void EncodeResponse(const Response &resp, std::string &out)
+{
+    size_t start = BeginFrame(out, MSG_RESPONSE);
+    EncodeResult(resp, out);
+    EndFrame(out, start);
+}
+
+/**
+ * @brief Decode the payload of a MSG_RESPONSE frame.
+ *
+ * @return bool False when the payload is malformed.
+ */
+inline bool DecodeResponse(const uint8_t *payload, size_t len, Response &resp)
+{
+    Decoder dec(payload, len);
+    return DecodeResult(dec, resp);
+}
+
+/**
+ * @brief Decode every result of a MSG_RESULT_BATCH frame in one pass.
+ *
+ * @param payload Frame payload.
+ * @param len Payload length.
+ * @param on_result Callback receiving each decoded Response.
+ *
+ * @return int32_t Number of results decoded, -1 when the payload is malformed.
+ */
+template <typename Callback>
+int32_t DecodeResultBatch(const uint8_t *payload, size_t len, Callback on_result)
+{
+    Decoder dec(payload, len);
+    Response resp;
+    uint64_t count = dec.GetVarint();
+
+    for (uint64_t index = 0; index < count; index++)
+    {
+        if (!DecodeResult(dec, resp))
+        {
+            return -1;
+        }
+        on_result(resp);
+    }
+
+    return dec.Failed() ? -1 : (int32_t)count;
+}
+
+// #endregion
+
+/**
+ * @brief One complete frame taken out of a connection read buffer.
+ *
+ * Pointers stay valid until the next call to Connection::Fill.
+ */
+struct Frame
+{
+    MessageType type;
+    const uint8_t *payload; ///< Payload, after the header.
+    size_t len;             ///< Payload length.
+    const uint8_t *raw;     ///< Whole frame, header included, handy to forward it untouched.
+    size_t raw_len;
+};
+
+/**
+ * @brief Hot-path counters and gauges a thread keeps in its MetricBlock.
+ */
+enum MetricId
+{
+    METRIC_PROBES,         ///< Probes completed.
+    METRIC_PROBES_FAILED,  ///< Probes, or results received by Core, that failed. See IsFailedProbe.
+    METRIC_PROBE_BYTES,    ///< Body bytes downloaded by the probes.
+    METRIC_LAG_US,         ///< Sum of the delays between the planned and the actual start of the runs.
+    METRIC_LAG_COUNT,      ///< Runs the lag was measured for.
+    METRIC_LOOP_US,        ///< Sum of the time spent handling events, waiting excluded.
+    METRIC_LOOP_COUNT,     ///< Event loop iterations that handled events.
+    METRIC_BYTES_IN,       ///< Bytes read from the sockets of the protocol connections.
+    METRIC_BYTES_OUT,      ///< Bytes written to them.
+    METRIC_QUEUE_BYTES,    ///< Gauge: bytes waiting to be sent.
+    METRIC_JOBS,           ///< Gauge: jobs run, or owned.
+    METRIC_REQUESTS,       ///< Job requests forwarded.
+    METRIC_RESULTS,        ///< Results forwarded to Core by an Agent, received by Core.
+    METRIC_ALERTS,         ///< Alerts raised by the anomaly detectors of Core.
+    METRIC_COUNT
+};
+
+/**
+ * @class MetricBlock
+ *
+ * @brief Metrics of a single writer, read by the metrics endpoint at any time.
+ *
+ * The writer is the only one updating a block, so an update is a relaxed load and store rather than a locked
+ * read-modify-write, and blocks are padded to whole cache lines so that two writers never share one.
+ */
+class MetricBlock
+{
+public:
+    void Add(MetricId id, uint64_t delta)
+    {
+        _values[id].store(_values[id].load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    void Set(MetricId id, uint64_t value)
+    {
+        _values[id].store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t Get(MetricId id) const
+    {
+        return _values[id].load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> _values[METRIC_COUNT];
+    char _pad[CACHE_LINE_LEN - (METRIC_COUNT * sizeof(uint64_t)) % CACHE_LINE_LEN];
+};
+
+/**
+ * @class MetricsArea
+ *
+ * @brief Cache line aligned array of metric blocks, one per thread of the process.
+ */
+class MetricsArea
+{
+public:
+    /**
+     * @brief Allocate a zeroed area.
+     *
+     * @param count Number of blocks.
+     */
+    explicit MetricsArea(size_t count)
+    {
+        void *blocks = nullptr;
+        int32_t ret = posix_memalign(&blocks, CACHE_LINE_LEN, count * sizeof(MetricBlock));
+        if (ret != 0)
+        {
+            std::cerr << "posix_memalign: " << strerror(ret) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        memset(blocks, 0, count * sizeof(MetricBlock));
+        _blocks = (MetricBlock *)blocks;
+    }
+
+    MetricsArea(const MetricsArea &) = delete;
+    MetricsArea &operator=(const MetricsArea &) = delete;
+
+    ~MetricsArea()
+    {
+        free(_blocks);
+    }
+
+    MetricBlock *Get(size_t index)
+    {
+        return &_blocks[index];
+    }
+
+private:
+    MetricBlock *_blocks;
+};
+
+/**
+ * @class Connection
+ *
+ * @brief Non-blocking stream socket with a read buffer reassembling frames and a queue of chunks the kernel
+ * did not take yet.
+ */
+class Connection
+{
+public:
+    /**
+     * @brief Construct a new Connection object.
+     *
+     * @param fd Connected non-blocking socket, or -1.
+     */
+    explicit Connection(int32_t fd = -1) : _fd(fd)
+    {
+    }
+
+    /**
+     * @brief Get the socket file descriptor.
+     *
+     * @return int32_t A socket file descriptor, -1 when not connected.
+     */
+    int32_t GetFd()
+    {
+        return _fd;
+    }
+
+    /**
+     * @brief Account the bytes read and written from now on.
+     *
+     * @param metrics Block of the thread owning the connection, or null.
+     */
+    void SetMetrics(MetricBlock *metrics)
+    {
+        _metrics = metrics;
+    }
+
+    /**
+     * @brief Attach a new socket, dropping whatever was buffered for the previous one.
+     *
+     * @param fd Connected non-blocking socket, or -1.
+     */
+    void Reset(int32_t fd)
+    {
+        _fd = fd;
+        _rbuf.clear();
+        _rpos = 0;
+        _wqueue.clear();
+        _wpos = 0;
+        _wbytes = 0;
+        _broken = false;
+    }
+
+    /**
+     * @brief Read everything the socket has to offer.
+     *
+     * @return int32_t 1 while the connection is open, 0 once the peer closed it, -1 on failure.
+     */
+    int32_t Fill()
+    {
+        // Drop consumed bytes before growing the buffer.
+        if (_rpos > 0)
+        {
+            _rbuf.erase(0, _rpos);
+            _rpos = 0;
+        }
+
+        while (true)
+        {
+            size_t used = _rbuf.size();
+            _rbuf.resize(used + READ_CHUNK_LEN);
+
+            ssize_t ret = read(_fd, &_rbuf[used], READ_CHUNK_LEN);
+            _rbuf.resize(used + (ret > 0 ? ret : 0));
+
+            if (ret > 0)
+            {
+                if (_metrics != nullptr)
+                {
+                    _metrics->Add(METRIC_BYTES_IN, ret);
+                }
+                continue;
+            }
+            if (ret == 0)
+            {
+                return 0;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 1;
+            }
+            if (errno != EINTR)
+            {
+                std::cerr << "read: " << strerror(errno) << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    /**
+     * @brief Take the next complete frame out of the read buffer.
+     *
+     * @param frame Receives the frame.
+     *
+     * @return bool True when a frame was available, check IsBroken() when false.
+     */
+    bool NextFrame(Frame &frame)
+    {
+        size_t available = _rbuf.size() - _rpos;
+        if (_broken || available < FRAME_HEADER_LEN)
+        {
+            return false;
+        }
+
+        const uint8_t *head = (const uint8_t *)_rbuf.data() + _rpos;
+        uint32_t len = ((uint32_t)head[0] << 24) | ((uint32_t)head[1] << 16) | ((uint32_t)head[2] << 8) | head[3];
+
+        if (head[4] != PROTOCOL_VERSION || len > MAX_FRAME_LEN)
+        {
+            std::cerr << "Protocol error: version " << (int32_t)head[4] << ", frame length " << len << std::endl;
+            _broken = true;
+            return false;
+        }
+
+        if (available < FRAME_HEADER_LEN + len)
+        {
+            return false; // Rest of the frame is still on the way.
+        }
+
+        frame.type = (MessageType)head[5];
+        frame.payload = head + FRAME_HEADER_LEN;
+        frame.len = len;
+        frame.raw = head;
+        frame.raw_len = FRAME_HEADER_LEN + len;
+        _rpos += frame.raw_len;
+
+        return true;
+    }
+
+    /**
+     * @brief Whether the stream can no longer be decoded.
+     */
+    bool IsBroken()
+    {
+        return _broken;
+    }
+
+    /**
+     * @brief Append encoded frames to the write queue, Flush() sends them.
+     *
+     * Small writes are coalesced into the last queued chunk.
+     *
+     * @param data Encoded frames.
+     * @param len Number of bytes.
+     */
+    void Queue(const void *data, size_t len)
+    {
+        if (_wqueue.empty() || _wqueue.back().size() + len > WRITE_CHUNK_LEN)
+        {
+            _wqueue.push_back(std::string());
+        }
+
+        _wqueue.back().append((const char *)data, len);
+        _wbytes += len;
+    }
+
+    void Queue(const std::string &data)
+    {
+        Queue(data.data(), data.size());
+    }
+
+    /**
+     * @brief Hand a whole chunk to the write queue without copying it.
+     *
+     * @param chunk Encoded bytes, left empty.
+     */
+    void Queue(std::string &&chunk)
+    {
+        if (chunk.empty())
+        {
+            return;
+        }
+
+        _wbytes += chunk.size();
+        _wqueue.push_back(std::move(chunk));
+        chunk.clear();
+    }
+
+    /**
+     * @brief Write as much of the write queue as the socket accepts, several chunks per writev() call.
+     *
+     * @return int32_t 0 when everything is sent, 1 when bytes are left for the next writable event, -1 on failure.
+     */
+    int32_t Flush()
+    {
+        struct iovec iov[MAX_WRITE_IOV];
+
+        while (!_wqueue.empty())
+        {
+            int32_t count = 0;
+            for (auto itr = _wqueue.begin(); itr != _wqueue.end() && count < MAX_WRITE_IOV; ++itr, ++count)
+            {
+                size_t skip = (count == 0) ? _wpos : 0;
+                iov[count].iov_base = (void *)(itr->data() + skip);
+                iov[count].iov_len = itr->size() - skip;
+            }
+
+            ssize_t ret = writev(_fd, iov, count);
+            if (ret < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return 1;
+                }
+                if (errno != EINTR)
+                {
+                    std::cerr << "writev: " << strerror(errno) << std::endl;
+                    return -1;
+                }
+                continue;
+            }
+
+            // Release every chunk fully written.
+            size_t written = ret;
+            _wbytes -= written;
+            if (_metrics != nullptr)
+            {
+                _metrics->Add(METRIC_BYTES_OUT, written);
+            }
+            while (written > 0)
+            {
+                size_t left = _wqueue.front().size() - _wpos;
+                if (written < left)
+                {
+                    _wpos += written;
+                    break;
+                }
+
+                written -= left;
+                _wqueue.pop_front();
+                _wpos = 0;
+            }
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Whether some bytes wait for the socket to become writable.
+     */
+    bool HasPending()
+    {
+        return _wbytes > 0;
+    }
+
+    /**
+     * @brief Get the number of bytes waiting in the write queue.
+     */
+    size_t GetPendingBytes()
+    {
+        return _wbytes;
+    }
+
+private:
+    int32_t _fd;
+    std::string _rbuf;
+    size_t _rpos = 0; // Start of the first frame not consumed yet.
+    std::deque<std::string> _wqueue;
+    size_t _wpos = 0;   // Bytes of the first queued chunk already written.
+    size_t _wbytes = 0; // Bytes queued and not written yet.
+    bool _broken = false;
+    MetricBlock *_metrics = nullptr;
+};
+
+/**
+ * @class SpscRing
+ *
+ * @brief Bounded lock-free queue between exactly one producer thread and one consumer thread.
+ *
+ * Each side keeps a private copy of the other side's index and only reloads the shared one when the copy
+ * says the ring is full or empty, so the shared cache lines bounce once per batch rather than per item.
+ */
+template <typename T>
+class SpscRing
+{
+public:
+    /**
+     * @brief Construct a new Spsc Ring object.
+     *
+     * @param capacity Number of items the ring holds, rounded up to a power of two.
+     */
+    explicit SpscRing(size_t capacity) : _head(0), _tail_cache(0), _tail(0), _head_cache(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        _items.resize(size);
+        _mask = size - 1;
+    }
+
+    /**
+     * @brief Append an item, producer side.
+     *
+     * @return bool False when the ring is full.
+     */
+    bool TryPush(const T &item)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head_cache > _mask)
+        {
+            _head_cache = _head.load(std::memory_order_acquire);
+            if (tail - _head_cache > _mask)
+            {
+                return false;
+            }
+        }
+
+        _items[tail & _mask] = item;
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Take up to max items, consumer side.
+     *
+     * @param out Receives the items.
+     * @param max Room in out.
+     *
+     * @return size_t Number of items taken, 0 when the ring is empty.
+     */
+    size_t TryPop(T *out, size_t max)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail_cache)
+        {
+            _tail_cache = _tail.load(std::memory_order_acquire);
+            if (head == _tail_cache)
+            {
+                return 0;
+            }
+        }
+
+        size_t count = std::min(max, _tail_cache - head);
+        for (size_t index = 0; index < count; index++)
+        {
+            out[index] = _items[(head + index) & _mask];
+        }
+        _head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * @brief Check whether the ring looks empty, from any thread.
+     */
+    bool IsEmpty()
+    {
+        return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Get the number of queued items, from any thread. Only a snapshot while both sides run.
+     */
+    size_t GetSize()
+    {
+        size_t head = _head.load(std::memory_order_acquire);
+        return _tail.load(std::memory_order_acquire) - head;
+    }
+
+private:
+    // Consumer and producer indexes on their own cache lines, they only ever grow.
+    std::atomic<size_t> _head;
+    size_t _tail_cache;
+    char _pad_head[CACHE_LINE_LEN];
+    std::atomic<size_t> _tail;
+    size_t _head_cache;
+    char _pad_tail[CACHE_LINE_LEN];
+    std::vector<T> _items;
+    size_t _mask;
+};
+
+/**
+ * @class Notifier
+ *
+ * @brief Wakes a consumer thread sleeping on empty queues, with a system call only when it actually sleeps.
+ */
+class Notifier
+{
+public:
+    /**
+     * @brief Construct a new Notifier object.
+     */
+    Notifier() : _waiting(false)
+    {
+        if ((_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        {
+            std::cerr << "eventfd: " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Notifier(const Notifier &) = delete;
+    Notifier &operator=(const Notifier &) = delete;
+
+    ~Notifier()
+    {
+        close(_fd);
+    }
+
+    /**
+     * @brief Producer side, call after publishing items.
+     */
+    void Notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiting.load(std::memory_order_relaxed))
+        {
+            uint64_t one = 1;
+            if (write(_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            {
+                std::cerr << "write: " << strerror(errno) << std::endl;
+            }
+        }
+    }
+
+    /**
+     * @brief Consumer side, sleep until notified or timed out unless there is already work.
+     *
+     * @param timeout_ms Longest sleep.
+     * @param has_work Tells whether the queues have items, checked once the consumer is marked waiting.
+     */
+    template <typename Predicate>
+    void Wait(int32_t timeout_ms, Predicate has_work)
+    {
+        if (Park(has_work))
+        {
+            struct pollfd pfd = {_fd, POLLIN, 0};
+            if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+            {
+                std::cerr << "poll: " << strerror(errno) << std::endl;
+            }
+        }
+
+        Unpark();
+        Drain();
+    }
+
+    /**
+     * @brief Consumer side sleeping in its own event loop, watching GetFd(): mark the consumer waiting before it sleeps.
+     *
+     * @param has_work Tells whether the queues have items, checked once the consumer is marked waiting.
+     *
+     * @return bool True when the consumer may sleep, false when there is already work.
+     */
+    template <typename Predicate>
+    bool Park(Predicate has_work)
+    {
+        _waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        return !has_work();
+    }
+
+    /**
+     * @brief Consumer side, once awake. Producers stop signaling until the next Park().
+     */
+    void Unpark()
+    {
+        _waiting.store(false, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Consumer side, reset the file descriptor after it was readable.
+     */
+    void Drain()
+    {
+        uint64_t count;
+        if (read(_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        {
+            std::cerr << "read: " << strerror(errno) << std::endl;
+        }
+    }
+
+    int32_t GetFd()
+    {
+        return _fd;
+    }
+
+private:
+    int32_t _fd;
+    std::atomic<bool> _waiting;
+};
+
+/**
+ * @brief Split a "host:port" endpoint.
+ *
+ * @param endpoint Endpoint string, like "127.0.0.1:8100".
+ * @param host Receives the host part.
+ * @param port Receives the port part.
+ *
+ * @return int32_t Status code.
+ */
+inline int32_t ParseEndpoint(const std::string &endpoint, std::string &host, int32_t &port)
+{
+    size_t colon = endpoint.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == endpoint.size())
+    {
+        return -1;
+    }
+
+    char *end = nullptr;
+    long value = strtol(endpoint.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || value <= 0 || value > 65535)
+    {
+        return -1;
+    }
+
+    host = endpoint.substr(0, colon);
+    port = (int32_t)value;
+
+    return 0;
+}
+
+/**
+ * @brief Get the port an agent listens on when no endpoint is configured for it.
+ *
+ * @param agent_id A unique Agent identifier.
+ *
+ * @return int32_t Port number, -1 if the identifier has no default port.
+ */
+inline int32_t DefaultAgentPort(int32_t agent_id)
+{
+    int64_t port = DEFAULT_AGENT_PORT_BASE + (int64_t)agent_id * DEFAULT_AGENT_PORT_STEP;
+
+    return (agent_id < 1 || port > 65535) ? -1 : (int32_t)port;
+}
+
+/**
+ * @brief Get the wall clock time, results are stamped with it so they can be stored and queried by date.
+ *
+ * @return uint64_t Milliseconds since the epoch.
+ */
+inline uint64_t WallClockMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Get the monotonic time, precise enough to time a single event loop iteration.
+ *
+ * @return uint64_t Microseconds since an arbitrary point.
+ */
+inline uint64_t MonotonicUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Tell whether a probe failed: transfer error, no answer or HTTP error status.
+ */
+inline bool IsFailedProbe(uint16_t http_code, uint16_t error)
+{
+    return error != 0 || http_code == 0 || http_code >= 400;
+}
+
+// #region Metrics exposition
+
+/**
+ * @brief One series of a metric family: a block and the labels telling it apart, like thread="worker-2".
+ */
+struct MetricSeries
+{
+    const MetricBlock *block;
+    std::string labels;
+};
+
+/**
+ * @brief Quote a label value of the Prometheus text format.
+ */
+inline std::string EscapeLabel(const std::string &value)
+{
+    std::string out;
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else
+        {
+            out += c;
+        }
+    }
+
+    return out;
+}
+
+/**
+ * @brief Append the HELP and TYPE lines of a metric family.
+ */
+inline void PutMetricFamily(std::string &out, const char *name, const char *type, const char *help)
+{
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+/**
+ * @brief Append one sample line.
+ *
+ * @param out Exposition being built.
+ * @param name Sample name.
+ * @param labels Labels without the braces, may be empty.
+ * @param value Sample value.
+ */
+inline void PutMetricSample(std::string &out, const std::string &name, const std::string &labels, double value)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), " %.15g\n", value);
+    out += labels.empty() ? name : name + "{" + labels + "}";
+    out += buf;
+}
+
+/**
+ * @brief Append a counter or gauge family with one sample per series.
+ *
+ * @param scale Factor applied to the raw values, like 1e-6 to turn microseconds into seconds.
+ */
+inline void PutMetric(std::string &out, const char *name, const char *type, const char *help, MetricId id,
+                      const std::vector<MetricSeries> &series, double scale = 1)
+{
+    PutMetricFamily(out, name, type, help);
+    for (const MetricSeries &one : series)
+    {
+        PutMetricSample(out, name, one.labels, one.block->Get(id) * scale);
+    }
+}
+
+/**
+ * @brief Append a summary family made of a sum in microseconds and a count, exposed in seconds.
+ */
+inline void PutSummary(std::string &out, const char *name, const char *help, MetricId sum_us, MetricId count,
+                       const std::vector<MetricSeries> &series)
+{
+    PutMetricFamily(out, name, "summary", help);
+    for (const MetricSeries &one : series)
+    {
+        PutMetricSample(out, std::string(name) + "_sum", one.labels, one.block->Get(sum_us) / 1e6);
+        PutMetricSample(out, std::string(name) + "_count", one.labels, one.block->Get(count));
+    }
+}
+
+/**
+ * @class MetricsEndpoint
+ *
+ * @brief Non-blocking HTTP listener answering every GET with the Prometheus text exposition.
+ *
+ * The owner watches the listening socket and the accepted clients with its own event loop, so the endpoint
+ * fits a reactor as well as a poll loop of a thread of its own. Each client gets one answer and is closed.
+ */
+class MetricsEndpoint
+{
+public:
+    typedef std::function<void(std::string &)> Render;
+
+    MetricsEndpoint() : _fd(-1)
+    {
+    }
+
+    MetricsEndpoint(const MetricsEndpoint &) = delete;
+    MetricsEndpoint &operator=(const MetricsEndpoint &) = delete;
+
+    ~MetricsEndpoint()
+    {
+        for (auto &client : _clients)
+        {
+            close(client.first);
+        }
+        if (_fd >= 0)
+        {
+            close(_fd);
+        }
+    }
+
+    /**
+     * @brief Listen for metrics clients.
+     *
+     * @param endpoint Address to listen on, like "127.0.0.1:9464".
+     *
+     * @return int32_t Status code.
+     */
+    int32_t Listen(const std::string &endpoint)
+    {
+        std::string host;
+        int32_t port;
+        struct addrinfo hints;
+        struct addrinfo *addr = nullptr;
+        int32_t on = 1;
+
+        if (ParseEndpoint(endpoint, host, port) != 0)
+        {
+            std::cerr << "Invalid metrics endpoint '" << endpoint << "', expected <host>:<port>." << std::endl;
+            return -1;
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int32_t ret = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addr);
+        if (ret != 0)
+        {
+            std::cerr << "getaddrinfo: " << host << ": " << gai_strerror(ret) << std::endl;
+            return -1;
+        }
+
+        _fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_fd < 0 || setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 || bind(_fd, addr->ai_addr, addr->ai_addrlen) < 0 ||
+            listen(_fd, SOMAXCONN) < 0)
+        {
+            std::cerr << "Metrics endpoint " << endpoint << ": " << strerror(errno) << std::endl;
+            freeaddrinfo(addr);
+            return -1;
+        }
+        freeaddrinfo(addr);
+
+        return 0;
+    }
+
+    /**
+     * @brief Get the listening socket, readable when a client is waiting.
+     */
+    int32_t GetFd()
+    {
+        return _fd;
+    }
+
+    /**
+     * @brief Accept one waiting client.
+     *
+     * @return int32_t Socket of the client to watch for reads and writes, -1 when none is waiting.
+     */
+    int32_t Accept()
+    {
+        int32_t fd = accept4(_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                std::cerr << "accept: " << strerror(errno) << std::endl;
+            }
+            return -1;
+        }
+
+        _clients[fd] = Client();
+        return fd;
+    }
+
+    /**
+     * @brief Read the request of a ready client and send it the metrics, as far as the socket allows.
+     *
+     * @param fd Socket of the client.
+     * @param render Fills the exposition in, called once the request is complete.
+     *
+     * @return bool True once the client is done with, the caller stops watching it and calls Close().
+     */
+    bool Serve(int32_t fd, const Render &render)
+    {
+        auto itr = _clients.find(fd);
+        if (itr == _clients.end())
+        {
+            return true;
+        }
+        Client &client = itr->second;
+
+        char buf[1024];
+        ssize_t len = -1;
+        while (client.out.empty() && (len = read(fd, buf, sizeof(buf))) != 0)
+        {
+            if (len < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+                if (errno != EINTR)
+                {
+                    return true;
+                }
+                continue;
+            }
+
+            client.in.append(buf, len);
+            if (client.in.size() > METRICS_REQUEST_LEN)
+            {
+                return true;
+            }
+        }
+        if (len == 0 && client.out.empty())
+        {
+            return true; // Left before asking anything.
+        }
+
+        if (client.out.empty())
+        {
+            if (client.in.find("\r\n\r\n") == std::string::npos)
+            {
+                return false;
+            }
+
+            std::string body;
+            const char *status = "200 OK";
+            if (client.in.compare(0, 4, "GET ") == 0)
+            {
+                render(body);
+            }
+            else
+            {
+                status = "405 Method Not Allowed";
+            }
+            client.out = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                         std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        }
+
+        while (client.sent < client.out.size())
+        {
+            len = send(fd, client.out.data() + client.sent, client.out.size() - client.sent, MSG_NOSIGNAL);
+            if (len < 0)
+            {
+                return !(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+            }
+            client.sent += len;
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Whether the answer to a client waits for its socket to be writable, rather than its request for data.
+     */
+    bool IsSending(int32_t fd)
+    {
+        auto itr = _clients.find(fd);
+        return itr != _clients.end() && !itr->second.out.empty();
+    }
+
+    /**
+     * @brief Close a client, once the caller no longer watches it.
+     */
+    void Close(int32_t fd)
+    {
+        _clients.erase(fd);
+        close(fd);
+    }
+
+private:
+    struct Client
+    {
+        std::string in;
+        std::string out;
+        size_t sent = 0;
+    };
+
+    int32_t _fd;
+    std::map<int32_t, Client> _clients;
+};
+
+// #endregion
+
 #endif // !_SYNTHETIC_WEB_MONITORING_COMMON_H
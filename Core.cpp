@@ -6,17 +6,71 @@
  *************************************************************************************************/
 #include "Common.h"
 
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <random>
+#include <thread>
 #include <vector>
 #include <sstream>
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
 #include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define MAX_URL_LEN 50
+#define MAX_URL_LEN 2048
+#define SUMMARY_INTERVAL_SEC 10 ///< Default interval between two latency summaries.
+#define HIST_SUB_BITS 3         ///< Each power of two is split in 2^HIST_SUB_BITS buckets, about 6% precision.
+#define HIST_MAX_BITS 27        ///< Latencies from 2^HIST_MAX_BITS us (134s) on share the last bucket.
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define STORE_MAGIC 0x32535453       ///< "STS2", first bytes of every segment file of the result store.
+#define STORE_JOBS_FILE "jobs"       ///< Dictionary of a store, one "<store-job-id> <agent|@pool> <url>" line per job.
+#define STORE_HEADER_LEN 4096        ///< The header takes a page, so that every column starts on a page.
+#define STORE_SEGMENT_ROWS (1 << 16) ///< Rows per segment file, about 2.9MB.
+#define RESULT_RING_LEN 8192         ///< Results queued from one thread to the next before the producer waits.
+#define RESULT_BATCH_LEN 256         ///< Results a consumer takes from a queue at once.
+#define RECONNECT_MIN_MS 500         ///< First delay before connecting again to an Agent, doubled on each failure
+#define RECONNECT_MAX_MS 30000       ///< up to this one.
+#define CONFIG_SETTLE_MS 200         ///< The config file is reloaded once it was left untouched for this long.
+#define MAX_FREQUENCY_SEC 86400      ///< Longest period of a job.
+#define MAX_SLO_MS 3600000           ///< Highest latency objective of a job.
+#define MAX_CONFIG_ERRORS 20         ///< Invalid config lines reported one by one, the others are only counted.
+#define BALANCE_CHECK_MS 1000        ///< Interval between two checks of the pools.
+#define PLACE_SETTLE_MS 3000         ///< Jobs of the pools wait for every Agent to connect at start, for this long at most.
+#define LEAVE_GRACE_MS 10000         ///< An Agent down for this long leaves its pools, its jobs go to the others.
+#define REBALANCE_MS 10000           ///< Interval between two balancing rounds of the pools.
+#define REBALANCE_MOVES 64           ///< Jobs moved per balancing round at most, unless an Agent joined or left.
+#define REBALANCE_TOLERANCE 0.1      ///< A pool is balanced while its loads are within 10% of the highest one.
+#define MIN_COST_MRATE 100           ///< Load reports below 0.1 probe/s tell little about the cost of a probe.
+#define OUTPUT_FLUSH_MS 1000         ///< Default time results are buffered for before being written out.
+#define OUTPUT_BUFFER_LEN (1 << 18)  ///< Bytes of results an output buffers at most, before the flush interval.
+#define OUTPUT_KEEP_FILES 5          ///< Rotated output files kept, <file>.1 being the most recent one.
+#define OUTPUT_MAGIC 0x31525753      ///< "SWR1", first bytes of every binary output file.
+#define DETECT_WARMUP 20             ///< Successful results a detector learns the latency of a target from, before judging it.
+#define DETECT_DEV_FLOOR 0.05        ///< Deviations are taken as 5% of the latency at least, steady targets do not alert on noise.
+#define EWMA_WEIGHT (1.0 / 8)        ///< Weight of a result in the fast average of the EWMA detector.
+#define EWMA_ALERT_DEVS 4.0          ///< A result this many deviations above the fast average is an outlier.
+#define CUSUM_WEIGHT (1.0 / 64)      ///< Weight of a result in the baseline of the CUSUM detector.
+#define CUSUM_SLACK 0.5              ///< Deviations above the baseline a result may be by without adding to the sum.
+#define CUSUM_CLIP 3.0               ///< Deviations a result counts for at most, a lone spike cannot raise the alert.
+#define CUSUM_LIMIT 10.0             ///< The CUSUM alert is raised once the sum exceeds this, the sum is capped there.
+#define ALERT_RUNS 3                 ///< Results in a row that raise, or clear, an EWMA or SLO alert.
 
 using namespace std;
 
@@ -24,9 +78,8 @@ namespace
 {
     // #region Global Variables
 
-    int32_t port[MAX_AGENT] = {8100, 8200, 8300};
-    char ip[MAX_AGENT][32] = {"127.0.0.1", "127.0.0.1", "127.0.0.1"};
-    struct pollfd poll_fd[MAX_AGENT];
+    uint64_t g_session = 0;        // Session of this Core with every Agent, kept across reconnects.
+    int32_t g_summary_sec = SUMMARY_INTERVAL_SEC;
 
     // #endregion
 
@@ -34,7 +87,179 @@ namespace
 
     void printUsage()
     {
-        printf("Usage: ./core <conf-file>");
+        printf("Usage: ./core [-a <agent-inventory>] [-n <ingest-threads>] [-i <summary-interval-sec>] [-r] [-s <store-dir>]\n"
+               "              [-o <format>[:<file>]]... [-F <flush-ms>] [-R <rotate-MB>] [-A <alert-file>] [-m <metrics-host>:<port>]\n"
+               "              <conf-file>\n"
+               "       <format> is text, jsonl or binary, results go to stdout without a file. -r is -o text.\n"
+               "       ./core -q <store-dir> [-f <from>] [-t <to>] [-j <job>] [-d <step-sec>]\n"
+               "       <from> and <to> are epoch seconds, or seconds relative to now when negative.\n"
+               "       <job> is a job id of the store, a URL, or \"<agent> <url>\" or \"@<pool> <url>\".\n");
+    }
+
+    uint64_t NowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    string FormatMs(uint32_t us)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.3fms", us / 1000.0);
+        return buf;
+    }
+
+    string FormatTime(int64_t ms)
+    {
+        char buf[48];
+        struct tm tm;
+        time_t sec = ms / 1000;
+
+        gmtime_r(&sec, &tm);
+        size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(buf + len, sizeof(buf) - len, ".%03dZ", (int32_t)(ms % 1000));
+        return buf;
+    }
+
+    /**
+     * @brief Append a string to a JSON document, quoted and escaped.
+     */
+    static void PutJsonString(string &out, const string &str)
+    {
+        out += '"';
+        for (char ch : str)
+        {
+            if (ch == '"' || ch == '\\')
+            {
+                out += '\\';
+                out += ch;
+            }
+            else if ((unsigned char)ch < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)ch);
+                out += buf;
+            }
+            else
+            {
+                out += ch;
+            }
+        }
+        out += '"';
+    }
+
+    /**
+     * @brief One whitespace separated field of a config line, pointing into the file.
+     */
+    struct Token
+    {
+        const char *ptr;
+        size_t len;
+
+        bool Is(const char *str) const
+        {
+            return strlen(str) == len && memcmp(ptr, str, len) == 0;
+        }
+
+        string Str() const
+        {
+            return string(ptr, len);
+        }
+    };
+
+    /**
+     * @brief Take the next field of a line, a field starting with '#' comments out the rest of the line.
+     *
+     * @param pos Position in the line, moved past the field.
+     * @param end End of the line.
+     * @param token Set to the field.
+     *
+     * @return bool False at the end of the line.
+     */
+    bool NextToken(const char *&pos, const char *end, Token &token)
+    {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r'))
+        {
+            pos++;
+        }
+
+        if (pos == end || *pos == '#')
+        {
+            pos = end;
+            return false;
+        }
+
+        token.ptr = pos;
+        while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\r')
+        {
+            pos++;
+        }
+        token.len = pos - token.ptr;
+
+        return true;
+    }
+
+    /**
+     * @brief Read a decimal integer field, the whole field must be a number within bounds.
+     *
+     * @return bool False when it is not.
+     */
+    bool ParseInt(const Token &token, int64_t min, int64_t max, int32_t &value)
+    {
+        int64_t number = 0;
+
+        if (token.len == 0 || token.len > 10)
+        {
+            return false;
+        }
+
+        for (size_t index = 0; index < token.len; index++)
+        {
+            if (token.ptr[index] < '0' || token.ptr[index] > '9')
+            {
+                return false;
+            }
+            number = number * 10 + (token.ptr[index] - '0');
+        }
+
+        if (number < min || number > max)
+        {
+            return false;
+        }
+
+        value = (int32_t)number;
+        return true;
+    }
+
+    /**
+     * @brief Read a "<low>:<high>" field of two integers within bounds, low not above high.
+     *
+     * @return bool False when it is not.
+     */
+    bool ParseRange(const Token &token, int64_t min, int64_t max, int32_t &low, int32_t &high)
+    {
+        const char *colon = (const char *)memchr(token.ptr, ':', token.len);
+
+        return colon != nullptr && ParseInt(Token{token.ptr, (size_t)(colon - token.ptr)}, min, max, low) &&
+               ParseInt(Token{colon + 1, (size_t)(token.ptr + token.len - colon - 1)}, low, max, high);
+    }
+
+    /**
+     * @brief Whether a pool name is made of letters, digits, '-', '_' and '.' only.
+     */
+    bool IsPoolName(const char *name, size_t len)
+    {
+        for (size_t index = 0; index < len; index++)
+        {
+            if (!isalnum((unsigned char)name[index]) && name[index] != '-' && name[index] != '_' && name[index] != '.')
+            {
+                return false;
+            }
+        }
+
+        return len > 0;
     }
 
     // #endregion
@@ -51,24 +276,110 @@ namespace CoreImplementation
     {
     public:
         /**
-         * @brief Construct a new Job Parser object.
+         * @brief Construct an empty Job Parser object, filled by Parse.
+         */
+        JobParser() = default;
+
+        /**
+         * @brief Parse one line of the config file: <Agent-ID>|@<pool> <URL> <Frequency> [key=value ...] [# comment].
          *
-         * @param str A single line from config file to fetch all the required data.
+         * @param begin First character of the line.
+         * @param end End of the line, its newline excluded.
+         * @param error Set to the reason when the line is not a valid job.
+         *
+         * @return int32_t 1 for a job, 0 for a line without any, -1 for an invalid line.
          */
-        JobParser(string str)
+        int32_t Parse(const char *begin, const char *end, string &error)
         {
-            vector<string> internal;
-            stringstream ss(str);
-            string tok;
+            const char *pos = begin;
+            Token token;
+
+            if (!NextToken(pos, end, token))
+            {
+                return 0;
+            }
+
+            // A job of a pool runs on whichever Agent of the pool Core places it on.
+            if (token.len > 0 && token.ptr[0] == '@')
+            {
+                if (!IsPoolName(token.ptr + 1, token.len - 1))
+                {
+                    error = "invalid pool name '" + token.Str() + "'";
+                    return -1;
+                }
+                _pool.assign(token.ptr + 1, token.len - 1);
+            }
+            else if (!ParseInt(token, 1, INT32_MAX, _agent_id))
+            {
+                error = "invalid agent id '" + token.Str() + "'";
+                return -1;
+            }
+
+            if (!NextToken(pos, end, token))
+            {
+                error = "missing URL";
+                return -1;
+            }
+            if (token.len > MAX_URL_LEN)
+            {
+                error = "URL longer than " + to_string(MAX_URL_LEN) + " characters";
+                return -1;
+            }
+            _url.assign(token.ptr, token.len);
+
+            if (!NextToken(pos, end, token))
+            {
+                error = "missing frequency";
+                return -1;
+            }
+            if (!ParseInt(token, 1, MAX_FREQUENCY_SEC, _frequency))
+            {
+                error = "invalid frequency '" + token.Str() + "', seconds from 1 to " + to_string(MAX_FREQUENCY_SEC);
+                return -1;
+            }
+
+            // Optional settings follow as key=value.
+            while (NextToken(pos, end, token))
+            {
+                const char *equal = (const char *)memchr(token.ptr, '=', token.len);
+                Token key = {token.ptr, equal ? (size_t)(equal - token.ptr) : token.len};
+                Token value = {equal ? equal + 1 : token.ptr + token.len, equal ? token.len - key.len - 1 : 0};
+
+                int32_t number;
+                int32_t high;
+                if (key.Is("mode") && (value.Is("cold") || value.Is("warm")))
+                {
+                    _mode = value.Is("warm") ? PROBE_WARM : PROBE_COLD;
+                }
+                else if (key.Is("jitter") && value.len > 1 && value.ptr[value.len - 1] == '%' &&
+                         ParseInt(Token{value.ptr, value.len - 1}, 0, MAX_JITTER_PERCENT, number))
+                {
+                    _jitter = number;
+                }
+                else if (key.Is("adaptive") && ParseRange(value, 1, MAX_FREQUENCY_SEC, number, high))
+                {
+                    _freq_min = number;
+                    _freq_max = high;
+                }
+                else if (key.Is("slo") && value.len > 2 && memcmp(value.ptr + value.len - 2, "ms", 2) == 0 &&
+                         ParseInt(Token{value.ptr, value.len - 2}, 1, MAX_SLO_MS, number))
+                {
+                    _slo_ms = number;
+                }
+                else
+                {
+                    error = "invalid setting '" + token.Str() + "'";
+                    return -1;
+                }
+            }
 
-            while (ss >> tok)
+            if (_freq_max != 0 && (_frequency < _freq_min || _frequency > _freq_max))
             {
-                internal.push_back(tok);
+                error = "frequency " + to_string(_frequency) + " out of the adaptive bounds";
+                return -1;
             }
 
-            _agent_id = stoi(internal[0]);
-            _url = internal[1];
-            _frequency = stoi(internal[2]);
+            return 1;
         }
 
         /**
@@ -79,13 +390,33 @@ namespace CoreImplementation
         /**
          * @brief Get the Agent Id to which this job is supposed to be assigned.
          *
-         * @return int32_t A unique Agent identifier.
+         * @return int32_t A unique Agent identifier, 0 for a job of a pool not placed yet.
          */
         int32_t GetAgentId()
         {
             return _agent_id;
         }
 
+        /**
+         * @brief Place a job of a pool on an Agent.
+         *
+         * @param agent_id Agent of the pool, 0 when none can run it.
+         */
+        void SetAgentId(int32_t agent_id)
+        {
+            _agent_id = agent_id;
+        }
+
+        /**
+         * @brief Get the pool of the job.
+         *
+         * @return string& Pool name, empty for a job pinned to its Agent.
+         */
+        string &GetPool()
+        {
+            return _pool;
+        }
+
         /**
          * @brief Get the under test for this specific job.
          *
@@ -96,6 +427,46 @@ namespace CoreImplementation
             return _url;
         }
 
+        /**
+         * @brief Get the identifier Core and Agent use to refer to this job.
+         *
+         * @return int32_t A unique job identifier.
+         */
+        int32_t GetJobId()
+        {
+            return _job_id;
+        }
+
+        /**
+         * @brief Set the identifier of this job.
+         *
+         * @param job_id A unique job identifier.
+         */
+        void SetJobId(int32_t job_id)
+        {
+            _job_id = job_id;
+        }
+
+        /**
+         * @brief Get the probe mode of this job.
+         *
+         * @return uint8_t PROBE_COLD or PROBE_WARM.
+         */
+        uint8_t GetMode()
+        {
+            return _mode;
+        }
+
+        /**
+         * @brief Get the jitter of the runs of this job.
+         *
+         * @return uint8_t Percent of the period a run may start late by, at random.
+         */
+        uint8_t GetJitter()
+        {
+            return _jitter;
+        }
+
         /**
          * @brief Get the frequency of number of time this jib need to be run by Agent.
          *
@@ -106,366 +477,4219 @@ namespace CoreImplementation
             return _frequency;
         }
 
-    private:
-        int32_t _agent_id;
-        string _url;
-        int32_t _frequency;
-    };
+        /**
+         * @brief Get the bounds of the period of an adaptive job, the frequency is the first period.
+         *
+         * @return int32_t Shortest period in seconds, 0 when the period is fixed.
+         */
+        int32_t GetFrequencyMin()
+        {
+            return _freq_min;
+        }
 
-    /**
-     * @class ConfigParser
-     *
-     * @brief Implements all the configuration parsing related functionalities.
-     */
-    class ConfigParser
-    {
-    public:
         /**
-         * @brief Construct a new Config Parser object.
+         * @return int32_t Longest period in seconds, 0 when the period is fixed.
+         */
+        int32_t GetFrequencyMax()
+        {
+            return _freq_max;
+        }
+
+        /**
+         * @brief Whether the job runs a transaction script, its URL being "txn:<script>".
+         */
+        bool IsTransaction()
+        {
+            return _url.compare(0, 4, "txn:") == 0;
+        }
+
+        /**
+         * @brief Get the script file of a transaction, as written in the config file.
+         */
+        string GetScriptPath()
+        {
+            return _url.substr(4);
+        }
+
+        /**
+         * @brief Set the steps of a transaction, shared by the jobs running the same script.
+         */
+        void SetSteps(shared_ptr<const vector<TxnStep>> steps)
+        {
+            _steps = steps;
+        }
+
+        /**
+         * @brief Get the steps of a transaction.
          *
-         * @param name Config file name with full path.
+         * @return const vector<TxnStep>& Steps in order, empty for a plain probe.
          */
-        ConfigParser(string name) : file(name)
+        const vector<TxnStep> &GetSteps()
         {
-            cout << "Reading config file: " << file << endl;
+            static const vector<TxnStep> none;
+            return _steps ? *_steps : none;
         }
 
         /**
-         * @brief Destroy the Config Parser object.
+         * @brief Get the latency objective of this job, Core alerts when probes keep exceeding it.
+         *
+         * @return int32_t Milliseconds, 0 when only failures are alerted on.
          */
-        ~ConfigParser() = default;
+        int32_t GetSloMs()
+        {
+            return _slo_ms;
+        }
 
         /**
-         * @brief Parse the configuration into specified data types.
+         * @brief Get the key of the job across configuration reloads: its Agent, or its pool, and its URL.
          *
-         * @return int32_t Status code.
+         * @return string "<agent> <url>" or "@<pool> <url>".
          */
-        int32_t parseConfig()
+        string GetKey()
         {
-            ifstream conf_file(file);
+            return (_pool.empty() ? to_string(_agent_id) : "@" + _pool) + " " + _url;
+        }
 
-            if (conf_file.is_open())
-            {
-                string line;
-                while (getline(conf_file, line))
-                {
-                    if (line.size() == 0)
-                    {
-                        continue;
-                    }
+        /**
+         * @brief Whether the Agent would run this job the same way as another one of the same key.
+         *
+         * @param other Job to compare with.
+         *
+         * @return bool False when the job must be sent again.
+         */
+        bool SameSettings(JobParser &other)
+        {
+            return _frequency == other._frequency && _mode == other._mode && _jitter == other._jitter && _freq_min == other._freq_min &&
+                   _freq_max == other._freq_max && GetSteps() == other.GetSteps();
+        }
 
-                    JobParser job(line);
-                    if (job.GetUrl().size() > MAX_URL_LEN)
-                    {
-                        cerr << "Skipping test, URL length is exceeded limit of " << MAX_URL_LEN << " for url: "
-                             << "'" << job.GetUrl() << "'" << endl;
-                        continue;
-                    }
+    private:
+        int32_t _job_id = 0;
+        int32_t _agent_id = 0;
+        string _pool;
+        string _url;
+        int32_t _frequency = 0;
+        uint8_t _mode = PROBE_COLD;
+        uint8_t _jitter = 0;
+        int32_t _freq_min = 0; // Bounds of the period of an adaptive job, 0 for a fixed one.
+        int32_t _freq_max = 0;
+        int32_t _slo_ms = 0; // Only known to Core.
+        shared_ptr<const vector<TxnStep>> _steps;
+    };
 
-                    if (job.GetAgentId() < 1 || job.GetAgentId() > MAX_AGENT)
-                    {
-                        cerr << "Skipping test, Invalid agent Id: " << job.GetAgentId() << endl;
-                        continue;
-                    }
+    /**
+     * @brief Check that every ${name} of a step refers to a value extracted by an earlier step.
+     *
+     * @param text URL, header or body of the step.
+     * @param known Names extracted so far.
+     * @param error Set to the reason when a name is unknown.
+     *
+     * @return bool False when a name is unknown.
+     */
+    static bool CheckValues(const string &text, unordered_map<string, bool> &known, string &error)
+    {
+        for (size_t pos = text.find("${"); pos != string::npos; pos = text.find("${", pos + 2))
+        {
+            size_t close = text.find('}', pos);
+            string name = text.substr(pos + 2, close == string::npos ? string::npos : close - pos - 2);
+            if (close == string::npos || !known[name])
+            {
+                error = "unknown value '${" + name + "}'";
+                return false;
+            }
+        }
+        return true;
+    }
 
-                    jobs.push_back(job);
-                    if (jobs.size() >= MAX_TEST)
-                    {
-                        cout << "Support maximum " << MAX_TEST << " tests, rest will be ignored." << endl;
-                        break;
-                    }
+    /**
+     * @brief Parse a transaction script, one keyword per line:
+     *
+     *        GET|POST <URL>             starts a step
+     *        header <Name>: <value>     adds a request header to the step
+     *        body <text>                sets the body of a POST
+     *        expect <status>            fails the transaction unless the step answers this HTTP status
+     *        extract <name> <left>*<right>  takes the text between left and right out of the response body
+     *
+     *        Lines starting with '#' are comments.
+     *
+     * @param path Script file.
+     * @param steps Receives the steps.
+     * @param error Set to "<line>: <reason>" when the script is invalid.
+     *
+     * @return int32_t Status code.
+     */
+    static int32_t ParseScript(const string &path, vector<TxnStep> &steps, string &error)
+    {
+        ifstream script(path);
+        unordered_map<string, bool> known;
+
+        if (!script.is_open())
+        {
+            error = "cannot open script " + path + ": " + strerror(errno);
+            return -1;
+        }
+
+        string line;
+        int32_t line_num = 0;
+        while (getline(script, line))
+        {
+            line_num++;
+
+            size_t begin = line.find_first_not_of(" \t\r");
+            if (begin == string::npos || line[begin] == '#')
+            {
+                continue;
+            }
+            size_t end = line.find_last_not_of(" \t\r") + 1;
+            size_t space = line.find_first_of(" \t", begin);
+            string keyword = line.substr(begin, min(space, end) - begin);
+            size_t rest_pos = (space < end) ? line.find_first_not_of(" \t", space) : end;
+            string rest = line.substr(rest_pos, end - rest_pos);
+
+            string reason;
+            if (keyword == "GET" || keyword == "POST")
+            {
+                // Values are extracted once a step is done, the steps after it may use them.
+                for (size_t index = 0; !steps.empty() && index < steps.back().extracts.size(); index++)
+                {
+                    known[steps.back().extracts[index].name] = true;
+                }
+
+                if (steps.size() == MAX_TXN_STEPS)
+                {
+                    reason = "more than " + to_string(MAX_TXN_STEPS) + " steps";
+                }
+                else if (rest.empty() || rest.size() > MAX_URL_LEN || rest.find_first_of(" \t") != string::npos)
+                {
+                    reason = "invalid URL '" + rest + "'";
+                }
+                else if (CheckValues(rest, known, reason))
+                {
+                    steps.push_back(TxnStep());
+                    steps.back().method = keyword;
+                    steps.back().url = rest;
+                }
+            }
+            else if (steps.empty())
+            {
+                reason = "'" + keyword + "' before the first step";
+            }
+            else if (keyword == "header")
+            {
+                size_t colon = rest.find(':');
+                if (colon == string::npos || colon == 0)
+                {
+                    reason = "invalid header '" + rest + "'";
+                }
+                else if (CheckValues(rest, known, reason))
+                {
+                    steps.back().headers.push_back(rest);
+                }
+            }
+            else if (keyword == "body")
+            {
+                if (steps.back().method != "POST")
+                {
+                    reason = "body of a " + steps.back().method + " step";
+                }
+                else if (CheckValues(rest, known, reason))
+                {
+                    steps.back().body = rest;
+                }
+            }
+            else if (keyword == "expect")
+            {
+                int32_t code;
+                if (!ParseInt(Token{rest.data(), rest.size()}, 100, 599, code))
+                {
+                    reason = "invalid status '" + rest + "'";
+                }
+                else
+                {
+                    steps.back().expect = code;
+                }
+            }
+            else if (keyword == "extract")
+            {
+                size_t split = rest.find_first_of(" \t");
+                string name = rest.substr(0, split);
+                string pattern = (split == string::npos) ? "" : rest.substr(rest.find_first_not_of(" \t", split));
+                size_t star = pattern.find('*');
+                bool valid_name = !name.empty() && all_of(name.begin(), name.end(), [](char ch) { return isalnum((unsigned char)ch) || ch == '_'; });
+
+                if (!valid_name || star == string::npos || star == 0)
+                {
+                    reason = "invalid extract '" + rest + "', <name> <left>*<right> expected";
+                }
+                else
+                {
+                    steps.back().extracts.push_back(TxnExtract{name, pattern.substr(0, star), pattern.substr(star + 1)});
+                }
+            }
+            else
+            {
+                reason = "unknown keyword '" + keyword + "'";
+            }
+
+            if (!reason.empty())
+            {
+                error = path + ":" + to_string(line_num) + ": " + reason;
+                return -1;
+            }
+        }
+
+        if (steps.empty())
+        {
+            error = "script " + path + " has no step";
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @class ConfigParser
+     *
+     * @brief Implements all the configuration parsing related functionalities.
+     */
+    class ConfigParser
+    {
+    public:
+        /**
+         * @brief Construct a new Config Parser object.
+         *
+         * @param name Config file name with full path.
+         */
+        ConfigParser(string name) : file(name)
+        {
+            cout << "Reading config file: " << file << endl;
+        }
+
+        /**
+         * @brief Destroy the Config Parser object.
+         */
+        ~ConfigParser() = default;
+
+        /**
+         * @brief Parse the configuration into specified data types. The file is mapped and parsed in place, an invalid line
+         *        is reported with its number and skipped.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t parseConfig()
+        {
+            uint64_t start_us = MonotonicUs();
+            int32_t fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+
+            if (fd < 0 || fstat(fd, &st) < 0)
+            {
+                cerr << "Couldn't open config file for reading: " << strerror(errno) << endl;
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                return -1;
+            }
+
+            const char *data = nullptr;
+            if (st.st_size > 0)
+            {
+                void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+                if (map == MAP_FAILED)
+                {
+                    cerr << "mmap: " << strerror(errno) << std::endl;
+                    close(fd);
+                    return -1;
+                }
+                data = (const char *)map;
+            }
+            close(fd);
+
+            // One job per line at most, so that the list never grows on the way.
+            const char *end = data + st.st_size;
+            size_t lines = 1;
+            for (const char *pos = data; pos < end && (pos = (const char *)memchr(pos, '\n', end - pos)) != nullptr; pos++)
+            {
+                lines++;
+            }
+            jobs.reserve(lines);
+
+            int32_t line_num = 0;
+            int32_t invalid = 0;
+            string error;
+            for (const char *line = data; line < end;)
+            {
+                const char *eol = (const char *)memchr(line, '\n', end - line);
+                eol = eol ? eol : end;
+                line_num++;
+
+                // Parsed in place, the slot is given back unless the line is a job.
+                jobs.emplace_back();
+                int32_t ret = jobs.back().Parse(line, eol, error);
+                line = eol + 1;
+                if (ret > 0 && jobs.back().IsTransaction() && LoadScript(jobs.back(), error) != 0)
+                {
+                    ret = -1;
+                }
+
+                if (ret <= 0)
+                {
+                    jobs.pop_back();
+                    if (ret < 0 && ++invalid <= MAX_CONFIG_ERRORS)
+                    {
+                        cerr << file << ":" << line_num << ": " << error << ", line skipped." << endl;
+                    }
+                    continue;
+                }
+
+                jobs.back().SetJobId(jobs.size()); // Position in the job list, plus one.
+            }
+
+            if (data != nullptr)
+            {
+                munmap((void *)data, st.st_size);
+            }
+
+            if (invalid > MAX_CONFIG_ERRORS)
+            {
+                cerr << file << ": " << invalid - MAX_CONFIG_ERRORS << " more invalid lines skipped." << endl;
+            }
+
+            char took[32];
+            snprintf(took, sizeof(took), "%.1fms", (MonotonicUs() - start_us) / 1000.0);
+            cout << "Number jobs to execute:" << jobs.size() << " (" << line_num << " lines in " << took << ")" << endl;
+
+            return 0;
+        }
+
+        /**
+         * @brief Get the total number of jobs an Agent has to perform.
+         *
+         * @return int32_t Job count.
+         */
+        int32_t getJobCount()
+        {
+            return jobs.size();
+        }
+
+        /**
+         * @brief Get the list of the jobs that an Agent will perform.
+         *
+         * @return vector<JobParser>& List of job instances.
+         */
+        vector<JobParser> &GetJobList()
+        {
+            return jobs;
+        }
+
+        /**
+         * @brief Get the scripts of the transaction jobs.
+         *
+         * @return vector<string> Path of each script, relative to the current directory.
+         */
+        vector<string> GetScriptPaths()
+        {
+            vector<string> paths;
+            for (auto &script : scripts)
+            {
+                paths.push_back(script.first);
+            }
+
+            return paths;
+        }
+
+    private:
+        /**
+         * @brief Give a transaction job the steps of its script, a relative path being relative to the config file.
+         *        Each valid script is parsed once per reload, an invalid one is still listed by GetScriptPaths so that
+         *        fixing it triggers a reload.
+         *
+         * @return int32_t Status code, error is set on failure.
+         */
+        int32_t LoadScript(JobParser &job, string &error)
+        {
+            string path = job.GetScriptPath();
+            size_t slash = file.rfind('/');
+            if (path.empty() || path[0] != '/')
+            {
+                path = (slash == string::npos ? "" : file.substr(0, slash + 1)) + path;
+            }
+
+            shared_ptr<const vector<TxnStep>> &steps = scripts[path];
+            if (!steps)
+            {
+                vector<TxnStep> parsed;
+                if (ParseScript(path, parsed, error) != 0)
+                {
+                    return -1;
+                }
+                steps = make_shared<const vector<TxnStep>>(std::move(parsed));
+            }
+
+            job.SetSteps(steps);
+            return 0;
+        }
+
+        vector<JobParser> jobs;
+        string file;
+        unordered_map<string, shared_ptr<const vector<TxnStep>>> scripts; // By path, null for an invalid script.
+    };
+
+    /**
+     * @class JobTable
+     *
+     * @brief Snapshot of the jobs of one version of the configuration, shared by every thread. Only the last latency of
+     *        each job changes once the table is published.
+     */
+    class JobTable
+    {
+    public:
+        /**
+         * @brief Construct a new Job Table object.
+         *
+         * @param jobs Jobs with their identifiers set.
+         * @param version Version of the configuration, the first one is 1.
+         * @param next_id Lowest identifier never used by a job so far.
+         */
+        JobTable(vector<JobParser> jobs, uint64_t version, int32_t next_id) : _jobs(std::move(jobs)), _version(version), _next_id(next_id)
+        {
+            for (JobParser &job : _jobs)
+            {
+                _next_id = max(_next_id, job.GetJobId() + 1);
+            }
+
+            _by_id.resize(_next_id, nullptr);
+            for (JobParser &job : _jobs)
+            {
+                _by_id[job.GetJobId()] = &job;
+                _by_agent[job.GetAgentId()].push_back(&job);
+            }
+
+            _last_us.reset(new atomic<uint32_t>[_next_id]);
+            for (int32_t index = 0; index < _next_id; index++)
+            {
+                _last_us[index].store(UINT32_MAX, memory_order_relaxed);
+            }
+        }
+
+        JobTable(const JobTable &) = delete;
+        JobTable &operator=(const JobTable &) = delete;
+
+        /**
+         * @brief Find a job by its identifier.
+         *
+         * @param job_id Job identifier.
+         *
+         * @return JobParser* The job, null when this version has no such job.
+         */
+        JobParser *Find(int32_t job_id)
+        {
+            return (job_id > 0 && job_id < _next_id) ? _by_id[job_id] : nullptr;
+        }
+
+        /**
+         * @brief Get every job, in the order of the configuration file.
+         */
+        vector<JobParser> &GetJobs()
+        {
+            return _jobs;
+        }
+
+        /**
+         * @brief Get the jobs of one Agent.
+         *
+         * @param agent_id Agent identifier.
+         *
+         * @return const vector<JobParser *>& Jobs of the Agent, possibly none.
+         */
+        const vector<JobParser *> &GetAgentJobs(int32_t agent_id)
+        {
+            static const vector<JobParser *> none;
+            auto found = _by_agent.find(agent_id);
+
+            return (found == _by_agent.end()) ? none : found->second;
+        }
+
+        /**
+         * @brief Get the version of the configuration this table comes from.
+         */
+        uint64_t GetVersion()
+        {
+            return _version;
+        }
+
+        /**
+         * @brief Get the lowest identifier never used by a job so far, every job identifier is below it.
+         */
+        int32_t GetNextId()
+        {
+            return _next_id;
+        }
+
+        /**
+         * @brief Keep the total time of the last result of a job, from the aggregation thread.
+         *
+         * @param job_id Identifier of a job of this table.
+         * @param total_us Total time in microseconds.
+         */
+        void SetLastUs(int32_t job_id, uint32_t total_us)
+        {
+            _last_us[job_id].store(std::min<uint32_t>(total_us, UINT32_MAX - 1), memory_order_relaxed);
+        }
+
+        /**
+         * @brief Get the total time of the last result of a job, from any thread.
+         *
+         * @param job_id Identifier of a job of this table.
+         *
+         * @return uint32_t Microseconds, UINT32_MAX while the job has no result.
+         */
+        uint32_t GetLastUs(int32_t job_id)
+        {
+            return _last_us[job_id].load(memory_order_relaxed);
+        }
+
+    private:
+        vector<JobParser> _jobs;
+        uint64_t _version;
+        int32_t _next_id;
+        vector<JobParser *> _by_id; // Indexed by job id, null for the ids of other versions.
+        unordered_map<int32_t, vector<JobParser *>> _by_agent;
+        unique_ptr<atomic<uint32_t>[]> _last_us; // Indexed by job id.
+    };
+
+    /**
+     * @class JobRegistry
+     *
+     * @brief Publishes the current job table. A thread keeps its own reference to a table and only takes the new one
+     *        when the version has moved, so that checking for a reload costs an atomic load.
+     */
+    class JobRegistry
+    {
+    public:
+        /**
+         * @brief Construct a new Job Registry object.
+         *
+         * @param table Job table of the configuration read at start.
+         */
+        JobRegistry(shared_ptr<JobTable> table) : _table(table), _version(table->GetVersion())
+        {
+        }
+
+        /**
+         * @brief Get the current job table, from any thread.
+         */
+        shared_ptr<JobTable> Get()
+        {
+            return atomic_load(&_table);
+        }
+
+        /**
+         * @brief Get the version of the current job table, from any thread.
+         */
+        uint64_t GetVersion()
+        {
+            return _version.load(memory_order_acquire);
+        }
+
+        /**
+         * @brief Make a job table the current one, from the reloading thread only.
+         *
+         * The version moves first: a thread seeing the new table also sees the new version, so the next thread down a
+         * queue never misses a job the previous one already knew. A thread seeing the new version early keeps the old table
+         * a little longer, its table version still differs and it looks again on the next check.
+         *
+         * @param table New job table.
+         */
+        void Publish(shared_ptr<JobTable> table)
+        {
+            _version.store(table->GetVersion(), memory_order_release);
+            atomic_store(&_table, table);
+        }
+
+    private:
+        shared_ptr<JobTable> _table;
+        atomic<uint64_t> _version;
+    };
+
+    /**
+     * @brief Give the jobs of a new configuration their identifiers from the current job table. A job keeps its identifier while
+     *        its Agent, or pool, and URL stay the same, so that it keeps running and keeps its statistics. A job of a pool also
+     *        stays on its Agent. New jobs get identifiers never used before, so a late result of a removed job is never taken for
+     *        another job.
+     *
+     * @param current Job table in use.
+     * @param jobs Jobs of the new configuration, their identifiers are set here.
+     * @param agent_index Position of each known Agent ID.
+     *
+     * @return bool False when no job changed.
+     */
+    static bool DiffJobs(JobTable &current, vector<JobParser> &jobs, unordered_map<int32_t, size_t> &agent_index)
+    {
+        unordered_map<string, deque<JobParser *>> before; // An Agent may probe the same URL twice, those are matched in order.
+        int32_t next_id = current.GetNextId();
+        size_t added = 0;
+        size_t changed = 0;
+
+        for (JobParser &job : current.GetJobs())
+        {
+            before[job.GetKey()].push_back(&job);
+        }
+
+        for (JobParser &job : jobs)
+        {
+            deque<JobParser *> &same = before[job.GetKey()];
+            if (same.empty())
+            {
+                job.SetJobId(next_id++);
+                added++;
+                cout << "Job " << job.GetJobId() << " added: " << job.GetKey() << endl;
+                if (job.GetPool().empty() && agent_index.find(job.GetAgentId()) == agent_index.end())
+                {
+                    cerr << "Core dont know agent with Id: " << job.GetAgentId() << endl;
+                }
+                continue;
+            }
+
+            JobParser *old = same.front();
+            same.pop_front();
+            job.SetJobId(old->GetJobId());
+            if (!job.GetPool().empty())
+            {
+                job.SetAgentId(old->GetAgentId());
+            }
+            if (!job.SameSettings(*old) || job.GetSloMs() != old->GetSloMs())
+            {
+                changed++; // A new objective is not sent, the Agents keep running the job.
+                cout << "Job " << job.GetJobId() << " changed: " << job.GetKey() << endl;
+            }
+        }
+
+        vector<int32_t> removed;
+        for (auto &key : before)
+        {
+            for (JobParser *job : key.second)
+            {
+                removed.push_back(job->GetJobId());
+            }
+        }
+        sort(removed.begin(), removed.end());
+        for (int32_t job_id : removed)
+        {
+            cout << "Job " << job_id << " removed: " << current.Find(job_id)->GetKey() << endl;
+        }
+
+        if (added == 0 && changed == 0 && removed.empty())
+        {
+            cout << "Configuration unchanged, " << jobs.size() << " jobs." << endl;
+            return false;
+        }
+
+        cout << "Configuration " << current.GetVersion() + 1 << ": " << added << " added, " << removed.size() << " removed, " << changed
+             << " changed, " << jobs.size() - added - changed << " unchanged." << endl;
+
+        return true;
+    }
+
+    /**
+     * @brief Build the job table that follows the current one, the last latency of the jobs it keeps is carried over.
+     *
+     * @param current Job table in use.
+     * @param jobs Jobs of the new table, with their identifiers set.
+     *
+     * @return shared_ptr<JobTable> New job table.
+     */
+    static shared_ptr<JobTable> NextTable(JobTable &current, vector<JobParser> &jobs)
+    {
+        shared_ptr<JobTable> next = make_shared<JobTable>(std::move(jobs), current.GetVersion() + 1, current.GetNextId());
+
+        for (JobParser &job : next->GetJobs())
+        {
+            if (job.GetJobId() < current.GetNextId() && current.GetLastUs(job.GetJobId()) != UINT32_MAX)
+            {
+                next->SetLastUs(job.GetJobId(), current.GetLastUs(job.GetJobId()));
+            }
+        }
+
+        return next;
+    }
+
+    /**
+     * @brief Network endpoint of one Agent.
+     */
+    struct AgentEndpoint
+    {
+        int32_t id;
+        string host;
+        int32_t port;
+        string pool; // Pool the Agent runs jobs of, if any.
+    };
+
+    /**
+     * @class InventoryParser
+     *
+     * @brief Reads the agent inventory, where each line is like <Agent-ID> <host>:<port> [pool=<name>].
+     */
+    class InventoryParser
+    {
+    public:
+        /**
+         * @brief Construct a new Inventory Parser object.
+         *
+         * @param name Inventory file name with full path.
+         */
+        InventoryParser(string name) : file(name)
+        {
+            cout << "Reading agent inventory: " << file << endl;
+        }
+
+        /**
+         * @brief Destroy the Inventory Parser object.
+         */
+        ~InventoryParser() = default;
+
+        /**
+         * @brief Parse the inventory, lines starting with '#' are comments.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t parseInventory()
+        {
+            ifstream inventory_file(file);
+            unordered_map<int32_t, bool> known;
+
+            if (!inventory_file.is_open())
+            {
+                cerr << "Couldn't open agent inventory for reading." << endl;
+                return -1;
+            }
+
+            string line;
+            int32_t line_num = 0;
+            while (getline(inventory_file, line))
+            {
+                line_num++;
+
+                stringstream ss(line);
+                string id;
+                string endpoint;
+                if (!(ss >> id) || id[0] == '#')
+                {
+                    continue;
+                }
+
+                AgentEndpoint agent;
+                string pool;
+                char *end = nullptr;
+                agent.id = strtol(id.c_str(), &end, 10);
+                if (*end != '\0' || agent.id < 1 || !(ss >> endpoint) || ParseEndpoint(endpoint, agent.host, agent.port) != 0 ||
+                    ((ss >> pool) && (pool.compare(0, 5, "pool=") != 0 || !IsPoolName(pool.c_str() + 5, pool.size() - 5))))
+                {
+                    cerr << "Skipping agent, invalid inventory line " << line_num << ": '" << line << "'" << endl;
+                    continue;
+                }
+
+                if (known[agent.id])
+                {
+                    cerr << "Skipping agent, duplicate Agent Id " << agent.id << " at line " << line_num << endl;
+                    continue;
+                }
+
+                known[agent.id] = true;
+                agent.pool = pool.empty() ? "" : pool.substr(5);
+                agents.push_back(agent);
+            }
+
+            cout << "Number of agents in inventory:" << agents.size() << endl;
+
+            return 0;
+        }
+
+        /**
+         * @brief Get the endpoints of all the agents.
+         *
+         * @return vector<AgentEndpoint>& List of agent endpoints.
+         */
+        vector<AgentEndpoint> &GetAgentList()
+        {
+            return agents;
+        }
+
+    private:
+        vector<AgentEndpoint> agents;
+        string file;
+    };
+
+    /**
+     * @brief Build an inventory out of the Agent IDs jobs refer to, using the default endpoint of each agent.
+     *
+     * @param jobs List of the jobs to be performed.
+     * @param agents Receives one endpoint per distinct Agent ID.
+     */
+    static void DefaultInventory(vector<JobParser> &jobs, vector<AgentEndpoint> &agents)
+    {
+        unordered_map<int32_t, bool> known;
+        unordered_map<string, bool> known_pools;
+
+        for (JobParser &job : jobs)
+        {
+            if (!job.GetPool().empty())
+            {
+                if (!known_pools[job.GetPool()])
+                {
+                    cerr << "Pool " << job.GetPool() << " has no agent, pools are made in an agent inventory." << endl;
+                    known_pools[job.GetPool()] = true;
+                }
+                continue;
+            }
+
+            if (known[job.GetAgentId()])
+            {
+                continue;
+            }
+
+            known[job.GetAgentId()] = true;
+            if (DefaultAgentPort(job.GetAgentId()) < 0)
+            {
+                cerr << "Agent " << job.GetAgentId() << " has no default endpoint, add it to an agent inventory." << endl;
+                continue;
+            }
+
+            agents.push_back(AgentEndpoint{job.GetAgentId(), DEFAULT_AGENT_IP, DefaultAgentPort(job.GetAgentId())});
+        }
+    }
+
+    /**
+     * @brief State of an Agent, written by the thread serving it and read by the thread placing the jobs of the pools.
+     */
+    struct AgentStatus
+    {
+        atomic<bool> ready{false};       ///< Session open.
+        atomic<uint64_t> changed_ms{0};  ///< When ready last changed.
+        atomic<uint64_t> report_ms{0};   ///< When the last load report came, 0 before the first one.
+        atomic<uint32_t> max_workers{0}; ///< Fields of the last load report.
+        atomic<uint32_t> busy{0};
+        atomic<uint32_t> probe_mrate{0};
+    };
+
+    /**
+     * @class Balancer
+     *
+     * @brief Places the jobs of each pool on the Agents of the pool, the least loaded first.
+     *
+     * The load of an Agent is predicted from the probes per second of all its jobs, times the worker time a probe costs on
+     * that Agent, over its workers, both as the Agent reports them. A job stays where it is unless its Agent left the pool,
+     * or the pool became unbalanced: moving a job costs a cold start of its probes.
+     */
+    class Balancer
+    {
+    public:
+        /**
+         * @brief Construct a new Balancer object.
+         *
+         * @param endpoints Agents of the inventory.
+         * @param status State of each Agent, in the same order.
+         */
+        Balancer(vector<AgentEndpoint> &endpoints, AgentStatus *status) : _status(status)
+        {
+            for (size_t index = 0; index < endpoints.size(); index++)
+            {
+                _ids.push_back(endpoints[index].id);
+                _pools.push_back(endpoints[index].pool);
+                _index[endpoints[index].id] = index;
+                if (!endpoints[index].pool.empty())
+                {
+                    _members[endpoints[index].pool].push_back(index);
+                }
+            }
+
+            _alive.assign(endpoints.size(), false);
+            _cost.assign(endpoints.size(), 0);
+            _report_ms.assign(endpoints.size(), 0);
+            _start_ms = NowMs();
+            _check_ms = _start_ms + REBALANCE_MS;
+        }
+
+        /**
+         * @brief Take the new load reports in, and tell whether the jobs of the pools have to be placed again. Called every second.
+         *
+         * @param now_ms Current time.
+         *
+         * @return size_t Jobs that may be moved to balance the pools, 0 when there is nothing to do.
+         */
+        size_t Check(uint64_t now_ms)
+        {
+            if (_members.empty())
+            {
+                return 0;
+            }
+
+            for (size_t index = 0; index < _ids.size(); index++)
+            {
+                uint64_t report_ms = _status[index].report_ms.load(memory_order_acquire);
+                uint32_t mrate = _status[index].probe_mrate.load(memory_order_relaxed);
+                if (report_ms != _report_ms[index] && mrate >= MIN_COST_MRATE)
+                {
+                    double cost = (double)_status[index].busy.load(memory_order_relaxed) / mrate;
+                    _cost[index] = (_cost[index] == 0) ? cost : (_cost[index] + cost) / 2;
+                }
+                _report_ms[index] = report_ms;
+            }
+
+            // Agents are given a moment to connect at start, so that the first one up does not get every job.
+            vector<bool> alive(_ids.size(), false);
+            bool all_ready = true;
+            for (size_t index = 0; index < _ids.size(); index++)
+            {
+                AgentStatus &status = _status[index];
+                bool ready = status.ready.load(memory_order_acquire);
+                alive[index] = ready || (_alive[index] && now_ms < status.changed_ms.load(memory_order_relaxed) + LEAVE_GRACE_MS);
+                all_ready = all_ready && ready;
+            }
+            if (!all_ready && now_ms < _start_ms + PLACE_SETTLE_MS)
+            {
+                return 0;
+            }
+
+            if (alive != _alive)
+            {
+                _alive.swap(alive);
+                _check_ms = now_ms + REBALANCE_MS;
+                return SIZE_MAX;
+            }
+
+            if (now_ms >= _check_ms)
+            {
+                _check_ms = now_ms + REBALANCE_MS;
+                return REBALANCE_MOVES;
+            }
+
+            return 0;
+        }
+
+        /**
+         * @brief Place the jobs of the pools that are not on a live Agent of their pool, then balance each pool.
+         *
+         * @param jobs Job list, the Agent of each job of a pool is set here.
+         * @param max_moves Jobs moved between live Agents of a pool to balance it, at most.
+         *
+         * @return size_t Jobs placed or moved.
+         */
+        size_t Place(vector<JobParser> &jobs, size_t max_moves)
+        {
+            size_t total = 0;
+            vector<double> unit(_ids.size(), 1); // Predicted load of one probe per second.
+            vector<double> load(_ids.size(), 0);
+            double known_cost = 0;
+            size_t known = 0;
+
+            for (size_t index = 0; index < _ids.size(); index++)
+            {
+                if (_cost[index] > 0)
+                {
+                    known_cost += _cost[index];
+                    known++;
+                }
+            }
+            for (size_t index = 0; index < _ids.size(); index++)
+            {
+                double cost = (_cost[index] > 0) ? _cost[index] : (known > 0 ? known_cost / known : 1);
+                unit[index] = cost / max<uint32_t>(_status[index].max_workers.load(memory_order_relaxed), 1);
+            }
+
+            // Jobs of the pools by pool and Agent, the other jobs only add to the load of their Agent.
+            unordered_map<string, map<size_t, multimap<double, JobParser *>>> placed;
+            unordered_map<string, vector<JobParser *>> orphans;
+            for (JobParser &job : jobs)
+            {
+                auto found = _index.find(job.GetAgentId());
+                size_t index = (found == _index.end()) ? SIZE_MAX : found->second;
+                if (!job.GetPool().empty() && (index == SIZE_MAX || !_alive[index] || _pools[index] != job.GetPool()))
+                {
+                    orphans[job.GetPool()].push_back(&job);
+                    continue;
+                }
+
+                if (index != SIZE_MAX)
+                {
+                    load[index] += unit[index] / job.GetFrequency();
+                    if (!job.GetPool().empty())
+                    {
+                        placed[job.GetPool()][index].emplace(1.0 / job.GetFrequency(), &job);
+                    }
+                }
+            }
+
+            for (auto &pool : _members)
+            {
+                vector<size_t> live;
+                for (size_t index : pool.second)
+                {
+                    if (_alive[index])
+                    {
+                        live.push_back(index);
+                        placed[pool.first][index]; // Every live Agent can take jobs.
+                    }
+                }
+
+                // Orphans first, the heaviest ones while the loads are still far apart.
+                vector<JobParser *> &waiting = orphans[pool.first];
+                sort(waiting.begin(), waiting.end(), [](JobParser *a, JobParser *b) { return a->GetFrequency() < b->GetFrequency(); });
+                size_t moved = 0;
+                for (JobParser *job : waiting)
+                {
+                    size_t best = SIZE_MAX;
+                    for (size_t index : live)
+                    {
+                        if (best == SIZE_MAX || load[index] + unit[index] / job->GetFrequency() < load[best] + unit[best] / job->GetFrequency())
+                        {
+                            best = index;
+                        }
+                    }
+
+                    int32_t agent_id = (best == SIZE_MAX) ? 0 : _ids[best];
+                    if (agent_id != job->GetAgentId())
+                    {
+                        job->SetAgentId(agent_id);
+                        moved++;
+                    }
+                    if (best != SIZE_MAX)
+                    {
+                        load[best] += unit[best] / job->GetFrequency();
+                        placed[pool.first][best].emplace(1.0 / job->GetFrequency(), job);
+                    }
+                }
+
+                size_t balanced = Balance(placed[pool.first], load, unit, max_moves);
+                size_t waiting_count = (live.empty()) ? waiting.size() : 0;
+                if (waiting_count != _waiting[pool.first])
+                {
+                    cerr << "Pool " << pool.first << " has no agent up, " << waiting_count << " jobs wait for one." << endl;
+                    _waiting[pool.first] = waiting_count;
+                }
+                if (moved + balanced > 0)
+                {
+                    cout << "Pool " << pool.first << ": " << moved << " jobs placed, " << balanced << " moved to balance " << live.size()
+                         << " agents." << endl;
+                }
+                total += moved + balanced;
+            }
+
+            for (auto &pool : orphans)
+            {
+                if (_members.find(pool.first) == _members.end() && !pool.second.empty() && !_waiting[pool.first])
+                {
+                    cerr << "Pool " << pool.first << " has no agent in the inventory." << endl;
+                    _waiting[pool.first] = pool.second.size();
+                }
+            }
+
+            return total;
+        }
+
+    private:
+        /**
+         * @brief Move jobs from the most to the least loaded Agent of a pool while it lowers the highest load noticeably.
+         *
+         * @return size_t Jobs moved.
+         */
+        size_t Balance(map<size_t, multimap<double, JobParser *>> &agents, vector<double> &load, vector<double> &unit, size_t max_moves)
+        {
+            size_t moves = 0;
+
+            while (moves < max_moves && agents.size() > 1)
+            {
+                size_t high = agents.begin()->first;
+                size_t low = high;
+                for (auto &agent : agents)
+                {
+                    high = (load[agent.first] > load[high]) ? agent.first : high;
+                    low = (load[agent.first] < load[low]) ? agent.first : low;
+                }
+                if (load[high] - load[low] <= load[high] * REBALANCE_TOLERANCE || agents[high].empty())
+                {
+                    break;
+                }
+
+                // The job evening the two loads out is the best, else the largest one below it.
+                multimap<double, JobParser *> &from = agents[high];
+                double even = (load[high] - load[low]) / (unit[high] + unit[low]);
+                auto pick = from.upper_bound(even);
+                if (pick == from.begin())
+                {
+                    break; // Even the lightest job would overshoot.
+                }
+                --pick;
+
+                double weight = pick->first;
+                JobParser *job = pick->second;
+                from.erase(pick);
+                agents[low].emplace(weight, job);
+                load[high] -= unit[high] * weight;
+                load[low] += unit[low] * weight;
+                job->SetAgentId(_ids[low]);
+                moves++;
+            }
+
+            return moves;
+        }
+
+        AgentStatus *_status;
+        vector<int32_t> _ids;
+        vector<string> _pools;
+        unordered_map<int32_t, size_t> _index;
+        map<string, vector<size_t>> _members; // Agents of each pool.
+        vector<bool> _alive;                  // Up, or down for less than LEAVE_GRACE_MS.
+        vector<double> _cost;                 // Worker seconds per probe, averaged over the reports.
+        vector<uint64_t> _report_ms;          // Last report taken in.
+        unordered_map<string, size_t> _waiting;
+        uint64_t _start_ms;
+        uint64_t _check_ms;
+    };
+
+    /**
+     * @class ConfigWatcher
+     *
+     * @brief Thread reloading the configuration file whenever it is written, placing the jobs of the pools, and publishing
+     *        the new job tables.
+     *
+     * The directory is watched rather than the file, so that editors replacing the file by a renamed copy are seen too,
+     * and so are the directories of the transaction scripts. The pools are checked on their own schedule, whether the
+     * directories are busy or not watched at all.
+     */
+    class ConfigWatcher
+    {
+    public:
+        /**
+         * @brief Construct a new Config Watcher object.
+         *
+         * @param file Configuration file.
+         * @param registry Registry the new job tables are published to.
+         * @param agent_index Position of each known Agent ID.
+         * @param balancer Places the jobs of the pools.
+         */
+        ConfigWatcher(const string &file, JobRegistry &registry, unordered_map<int32_t, size_t> &agent_index, Balancer &balancer)
+            : _file(file), _registry(registry), _agent_index(agent_index), _balancer(balancer), _fd(-1), _wd(-1)
+        {
+            size_t slash = file.rfind('/');
+            _dir = (slash == string::npos) ? "." : (slash == 0 ? "/" : file.substr(0, slash));
+            _name = (slash == string::npos) ? file : file.substr(slash + 1);
+        }
+
+        /**
+         * @brief Start watching the configuration file and placing the jobs of the pools. The jobs of the pools are placed
+         *        even when the file cannot be watched.
+         *
+         * @param scripts Scripts of the transaction jobs of the configuration, watched too.
+         *
+         * @return int32_t Status code, -1 when the file is not watched.
+         */
+        int32_t Start(const vector<string> &scripts)
+        {
+            int32_t ret = 0;
+
+            if ((_fd = inotify_init1(IN_CLOEXEC)) < 0)
+            {
+                cerr << "inotify_init1: " << strerror(errno) << std::endl;
+                ret = -1;
+            }
+            else if ((_wd = inotify_add_watch(_fd, _dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO)) < 0)
+            {
+                cerr << "inotify_add_watch: " << _dir << ": " << strerror(errno) << std::endl;
+                close(_fd);
+                _fd = -1;
+                ret = -1;
+            }
+            else
+            {
+                WatchScripts(scripts, false);
+            }
+
+            thread(&ConfigWatcher::Run, this).detach();
+
+            return ret;
+        }
+
+    private:
+        void Run()
+        {
+            alignas(struct inotify_event) char buf[4096];
+            struct pollfd pfd = {_fd, POLLIN, 0}; // Never ready without a watch.
+            uint64_t reload_ms = 0;               // Time the file is reloaded at, 0 when unchanged.
+            uint64_t check_ms = NowMs() + BALANCE_CHECK_MS;
+
+            while (1)
+            {
+                // The pools are checked on time however busy the directory is.
+                uint64_t now = NowMs();
+                if (now >= check_ms)
+                {
+                    size_t max_moves = _balancer.Check(now);
+                    if (max_moves > 0)
+                    {
+                        Rebalance(max_moves);
+                    }
+                    check_ms = now + BALANCE_CHECK_MS;
+                }
+
+                if (reload_ms != 0 && now >= reload_ms)
+                {
+                    reload_ms = 0;
+                    Reload();
+                }
+
+                uint64_t wake_ms = (reload_ms != 0) ? min(reload_ms, check_ms) : check_ms;
+                int32_t ready = poll(&pfd, 1, (int32_t)(wake_ms - min(wake_ms, NowMs())));
+                if (ready < 0)
+                {
+                    if (errno != EINTR)
+                    {
+                        cerr << "poll: " << strerror(errno) << std::endl;
+                    }
+                    continue;
+                }
+
+                if (ready == 0)
+                {
+                    continue;
+                }
+
+                ssize_t len = read(_fd, buf, sizeof(buf));
+                if (len < 0)
+                {
+                    if (errno != EINTR)
+                    {
+                        cerr << "read: " << strerror(errno) << std::endl;
+                    }
+                    continue;
+                }
+
+                // A file is often written in several steps, it is reloaded once it stays untouched for a moment.
+                for (char *ptr = buf; ptr < buf + len;)
+                {
+                    struct inotify_event *event = (struct inotify_event *)ptr;
+                    if (event->len > 0 &&
+                        ((event->wd == _wd && _name == event->name) || _scripts.count(make_pair(event->wd, string(event->name))) > 0))
+                    {
+                        reload_ms = NowMs() + CONFIG_SETTLE_MS;
+                    }
+                    ptr += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+
+        void Reload()
+        {
+            ConfigParser parser(_file);
+
+            if (parser.parseConfig() != 0)
+            {
+                cerr << "Configuration reload failed, the running jobs are kept." << endl;
+                WatchScripts(parser.GetScriptPaths(), true);
+                return;
+            }
+
+            WatchScripts(parser.GetScriptPaths(), false);
+
+            shared_ptr<JobTable> current = _registry.Get();
+            if (DiffJobs(*current, parser.GetJobList(), _agent_index))
+            {
+                _balancer.Place(parser.GetJobList(), 0);
+                _registry.Publish(NextTable(*current, parser.GetJobList()));
+            }
+        }
+
+        void WatchScripts(const vector<string> &scripts, bool keep)
+        {
+            set<pair<int32_t, string>> watched = keep ? _scripts : set<pair<int32_t, string>>();
+            for (const string &path : scripts)
+            {
+                // A directory already watched keeps its watch descriptor.
+                size_t slash = path.rfind('/');
+                string dir = (slash == string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+                int32_t wd = inotify_add_watch(_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+                if (wd < 0)
+                {
+                    cerr << "inotify_add_watch: " << dir << ": " << strerror(errno) << ", changes of " << path << " are not seen." << endl;
+                    continue;
+                }
+                watched.insert(make_pair(wd, path.substr(slash + 1)));
+            }
+
+            // Directories of scripts no longer used stop being watched, unless the file is there too.
+            set<int32_t> stale;
+            for (auto &script : _scripts)
+            {
+                auto used = watched.lower_bound(make_pair(script.first, string()));
+                if (script.first != _wd && (used == watched.end() || used->first != script.first))
+                {
+                    stale.insert(script.first);
+                }
+            }
+            for (int32_t wd : stale)
+            {
+                inotify_rm_watch(_fd, wd);
+            }
+            _scripts.swap(watched);
+        }
+
+        void Rebalance(size_t max_moves)
+        {
+            shared_ptr<JobTable> current = _registry.Get();
+            vector<JobParser> jobs = current->GetJobs();
+
+            if (_balancer.Place(jobs, max_moves) > 0)
+            {
+                _registry.Publish(NextTable(*current, jobs));
+            }
+        }
+
+        string _file;
+        string _dir;
+        string _name;
+        JobRegistry &_registry;
+        unordered_map<int32_t, size_t> &_agent_index;
+        Balancer &_balancer;
+        int32_t _fd;
+        int32_t _wd;                          // Watch of the directory of the file.
+        set<pair<int32_t, string>> _scripts; // Watch of the directory and name of each script.
+    };
+
+    /**
+     * @class Agent
+     *
+     * @brief Implements all the functionalities that deals with Agents.
+     *
+     * The connection goes through connecting, session handshake and ready. Whenever it drops, it is opened
+     * again with an exponential backoff, and the Agent's jobs are sent again only when it lost the session.
+     */
+    class Agent
+    {
+    public:
+        /**
+         * @brief Construct a new Agent object.
+         *
+         * @param endpoint Identifier and address of the Agent to connect with.
+         * @param agent_status State shared with the thread placing the jobs of the pools.
+         */
+        Agent(const AgentEndpoint &endpoint, AgentStatus *agent_status)
+            : agent_id(endpoint.id), host(endpoint.host), port(endpoint.port), poll_set(nullptr), poll_index(0), status(agent_status)
+        {
+            sock_fd = -1;
+            state = DISCONNECTED;
+            dirty = false;
+            retry_ms = 0;
+            backoff_ms = RECONNECT_MIN_MS;
+        }
+
+        /**
+         * @brief Destroy the Agent object.
+         */
+        ~Agent() = default;
+
+        /**
+         * @brief Give the Agent its slot in the poll set of the thread that will serve it.
+         *
+         * @param set Poll set of the thread.
+         * @param index Position of this Agent in the poll set.
+         */
+        void SetPollSlot(vector<struct pollfd> *set, size_t index)
+        {
+            poll_set = set;
+            poll_index = index;
+        }
+
+        /**
+         * @brief Account the traffic with the Agent in the metrics of the thread serving it.
+         *
+         * @param metrics Block of the thread.
+         */
+        void SetMetrics(MetricBlock *metrics)
+        {
+            conn.SetMetrics(metrics);
+        }
+
+        /**
+         * @brief Get the number of bytes waiting for the socket to be writable.
+         */
+        size_t GetPendingBytes()
+        {
+            return conn.GetPendingBytes();
+        }
+
+        /**
+         * @brief Set the jobs the Agent has to run. They are sent once the Agent has accepted the session, or right away
+         *        when it has, and then only what differs from the jobs it already runs.
+         *
+         * @param list Jobs of the Agent, their job table must be kept until the next call.
+         */
+        void SetJobs(const vector<JobParser *> &list)
+        {
+            jobs = list;
+            if (state == READY)
+            {
+                SyncJobs();
+            }
+        }
+
+        /**
+         * @brief Start a non-blocking connection with the Agent, the handshake follows once it is writable.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t ConnectAgent()
+        {
+            struct addrinfo hints;
+            struct addrinfo *addr = nullptr;
+
+            bzero(&hints, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+
+            int32_t ret = getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addr);
+            if (ret != 0)
+            {
+                cerr << "getaddrinfo: " << host << ": " << gai_strerror(ret) << std::endl;
+                ScheduleRetry();
+                return -1;
+            }
+
+            if ((sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+            {
+                cerr << "socket: " << strerror(errno) << std::endl;
+                freeaddrinfo(addr);
+                ScheduleRetry();
+                return -1;
+            }
+
+            int32_t on = 1;
+            if (setsockopt(sock_fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&on, sizeof(on)) < 0)
+            {
+                cerr << "setsockopt: " << strerror(errno) << std::endl;
+            }
+
+            ret = connect(sock_fd, addr->ai_addr, addr->ai_addrlen);
+            freeaddrinfo(addr);
+            if (ret < 0 && errno != EINPROGRESS)
+            {
+                cerr << "connect: agent " << agent_id << " at " << host << ":" << port << ": " << strerror(errno) << std::endl;
+                Disconnect();
+                return -1;
+            }
+
+            /* Register fd for polling, it turns writable once connected */
+            (*poll_set)[poll_index].fd = sock_fd;
+            (*poll_set)[poll_index].events = POLLOUT;
+            conn.Reset(sock_fd);
+            state = CONNECTING;
+
+            return 0;
+        }
+
+        /**
+         * @brief Serve a writable socket: complete the connection, or send what is still buffered.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t OnWritable()
+        {
+            if (state != CONNECTING)
+            {
+                return Flush();
+            }
+
+            int32_t error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+            {
+                cerr << "connect: agent " << agent_id << " at " << host << ":" << port << ": " << strerror(error ? error : errno) << std::endl;
+                Disconnect();
+                return -1;
+            }
+
+            // Open the session, the Agent tells whether it still runs our jobs.
+            Hello hello;
+            string frame;
+
+            hello.session = g_session;
+            EncodeHello(hello, frame);
+            conn.Queue(frame);
+            (*poll_set)[poll_index].events = POLLIN;
+            state = HANDSHAKE;
+
+            return Flush();
+        }
+
+        /**
+         * @brief Handle the answer of the Agent to the session handshake.
+         *
+         * @param welcome Answer from the Agent.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t OnWelcome(Welcome &welcome)
+        {
+            if (state != HANDSHAKE)
+            {
+                return -1;
+            }
+
+            state = READY;
+            backoff_ms = RECONNECT_MIN_MS;
+            status->changed_ms.store(NowMs(), memory_order_relaxed);
+            status->ready.store(true, memory_order_release);
+
+            if (welcome.resumed && welcome.session == g_session)
+            {
+                // Only the jobs changed by a reload while the connection was down are sent, unless the Agent may have
+                // missed some requests: then every job is sent again and every job stopped in the session stopped again.
+                cout << "Agent " << agent_id << " resumed the session, " << welcome.jobs << " jobs are still running." << endl;
+                bool resend = dirty || welcome.jobs != running.size();
+                if (resend)
+                {
+                    cout << "Agent " << agent_id << " may have missed requests, sending its " << jobs.size() << " jobs again." << endl;
+                }
+                else
+                {
+                    stopped.clear(); // The Agent got every stop.
+                }
+                dirty = false;
+                SyncJobs(resend);
+                return 0;
+            }
+
+            cout << "Agent " << agent_id << " started a new session, sending its " << jobs.size() << " jobs." << endl;
+            running.clear();
+            stopped.clear();
+            dirty = false;
+            SyncJobs();
+
+            return 0;
+        }
+
+        /**
+         * @brief Keep the last load report of the Agent for the thread placing the jobs of the pools.
+         *
+         * @param load Load of the Agent over the last report interval.
+         */
+        void OnLoad(Load &load)
+        {
+            status->max_workers.store(load.max_workers, memory_order_relaxed);
+            status->busy.store(load.busy, memory_order_relaxed);
+            status->probe_mrate.store(load.probe_mrate, memory_order_relaxed);
+            status->report_ms.store(NowMs(), memory_order_release);
+        }
+
+        /**
+         * @brief Send the Agent what differs between the jobs it runs and the jobs it has to run: a stop for each removed job,
+         *        a start for each new or changed job, the Agent replaces a job it already runs.
+         *
+         * @param resend Whether the Agent may have missed requests of the session: every job is sent, and every job stopped
+         *               in the session is stopped again.
+         */
+        void SyncJobs(bool resend = false)
+        {
+            unordered_map<int32_t, JobParser> now;
+
+            for (auto job_id = stopped.begin(); resend && job_id != stopped.end(); ++job_id)
+            {
+                running.emplace(*job_id, JobParser()); // Stopped again below, unless it runs again.
+            }
+
+            for (JobParser *job : jobs)
+            {
+                auto found = running.find(job->GetJobId());
+                // Nothing is sent once the connection failed, the next session sends everything again.
+                if (state == READY && (resend || found == running.end() || !found->second.SameSettings(*job)))
+                {
+                    SendReqToAgent(*job);
+                }
+                if (found != running.end())
+                {
+                    running.erase(found);
+                }
+                now.emplace(job->GetJobId(), *job);
+            }
+
+            for (auto &removed : running)
+            {
+                if (state == READY)
+                {
+                    SendStopToAgent(removed.first);
+                }
+                stopped.insert(removed.first);
+            }
+            running.swap(now);
+        }
+
+        /**
+         * @brief To send job details to Agent for execution.
+         *
+         * @param job A job instance which hold all the details.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t SendReqToAgent(JobParser &job)
+        {
+            if (state == READY)
+            {
+                Request request;
+                string frame;
+
+                request.url = job.GetUrl();
+                request.job = job.GetJobId();
+                request.op = OP_START;
+                request.freq = job.GetFrequency();
+                request.mode = job.GetMode();
+                request.jitter = job.GetJitter();
+                request.freq_min = job.GetFrequencyMin();
+                request.freq_max = job.GetFrequencyMax();
+                request.steps = job.GetSteps();
+
+                EncodeRequest(request, frame);
+                conn.Queue(frame);
+                Flush();
+            }
+            else
+            {
+                cerr << "Agent " << agent_id << " is not alive." << endl;
+            }
+            return 0;
+        }
+
+        /**
+         * @brief Make the Agent stop a job.
+         *
+         * @param job_id Identifier of the job.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t SendStopToAgent(int32_t job_id)
+        {
+            Request request = Request();
+            string frame;
+
+            request.job = job_id;
+            request.op = OP_STOP;
+
+            EncodeRequest(request, frame);
+            conn.Queue(frame);
+
+            return Flush();
+        }
+
+        /**
+         * @brief Send the buffered requests, watching for the socket to be writable while some are left. A connection
+         *        that fails is dropped, to be opened again.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Flush()
+        {
+            int32_t ret = conn.Flush();
+            if (ret < 0)
+            {
+                if (state != DISCONNECTED)
+                {
+                    cerr << "Agent " << agent_id << " connection failed." << endl;
+                    Disconnect();
+                }
+                return -1;
+            }
+
+            if (ret > 0)
+            {
+                (*poll_set)[poll_index].events |= POLLOUT;
+            }
+            else
+            {
+                (*poll_set)[poll_index].events &= ~POLLOUT;
+            }
+
+            return 0;
+        }
+
+        /**
+         * @brief Read everything the Agent has sent and hand each complete frame over.
+         *
+         * @param on_frame Callback receiving each frame.
+         *
+         * @return int32_t 1 while connected, 0 when the Agent closed the connection, -1 on failure.
+         */
+        template <typename Callback>
+        int32_t Receive(Callback on_frame)
+        {
+            Frame frame;
+            int32_t ret = conn.Fill();
+
+            while (conn.NextFrame(frame))
+            {
+                on_frame(frame);
+            }
+
+            return conn.IsBroken() ? -1 : ret;
+        }
+
+        /**
+         * @brief Drop the connection with the Agent, a new one is tried after the backoff delay.
+         */
+        void Disconnect()
+        {
+            if (sock_fd >= 0 && close(sock_fd) == -1)
+            {
+                cerr << "close: " << strerror(errno) << std::endl;
+            }
+
+            sock_fd = -1;
+            (*poll_set)[poll_index].fd = -1; // Ignored by poll from now on.
+            if (conn.GetPendingBytes() > 0)
+            {
+                dirty = true; // Requests recorded in running are dropped unsent.
+            }
+            conn.Reset(-1);
+            ScheduleRetry();
+
+            if (status->ready.load(memory_order_relaxed))
+            {
+                status->changed_ms.store(NowMs(), memory_order_relaxed);
+                status->ready.store(false, memory_order_release);
+            }
+        }
+
+        /**
+         * @brief Tell when the next connection attempt is due.
+         *
+         * @return uint64_t Monotonic time in milliseconds, 0 while a connection is open or being opened.
+         */
+        uint64_t GetRetryTime()
+        {
+            return (state == DISCONNECTED) ? max<uint64_t>(retry_ms, 1) : 0;
+        }
+
+        /**
+         * @brief Get the unique identifier of the Agent.
+         *
+         * @return int32_t An Agent identifier.
+         */
+        int32_t GetAgentId()
+        {
+            return agent_id;
+        }
+
+        /**
+         * @brief Get the socket fd that is being used to connect with Agent.
+         *
+         * @return int32_t A socket file descriptor.
+         */
+        int32_t GetSocketFd()
+        {
+            return sock_fd;
+        }
+
+    private:
+        enum State
+        {
+            DISCONNECTED, // Waiting for the next connection attempt.
+            CONNECTING,   // Non-blocking connect in progress.
+            HANDSHAKE,    // Hello sent, waiting for the Welcome.
+            READY         // Session open, requests can be sent.
+        };
+
+        void ScheduleRetry()
+        {
+            state = DISCONNECTED;
+            retry_ms = NowMs() + backoff_ms;
+            backoff_ms = min(backoff_ms * 2, (uint32_t)RECONNECT_MAX_MS);
+        }
+
+        int32_t agent_id;
+        string host;
+        int32_t port;
+        vector<struct pollfd> *poll_set; // Poll set of the thread serving this Agent.
+        size_t poll_index;              // Slot of this Agent in the poll set.
+        int32_t sock_fd;
+        Connection conn;
+        vector<JobParser *> jobs;                 // Jobs this Agent has to run, in the job table of the thread serving it.
+        unordered_map<int32_t, JobParser> running; // Copy of the jobs sent in this session, what the Agent runs.
+        unordered_set<int32_t> stopped;            // Jobs stopped in this session, since the Agent last proved it got every request.
+        bool dirty;                                // Requests were dropped unsent with the last connection.
+        AgentStatus *status;
+        State state;
+        uint64_t retry_ms;   // Time of the next connection attempt.
+        uint32_t backoff_ms; // Delay before the attempt after that one.
+    };
+
+    /**
+     * @class LatencyHistogram
+     *
+     * @brief Log-linear histogram of latencies in microseconds, in the spirit of an HDR histogram.
+     *
+     * Values below 2^HIST_SUB_BITS have a bucket each, every power of two above is split into 2^HIST_SUB_BITS
+     * buckets, so a bucket is never wider than about 12% of its values. Recording is a few bit operations.
+     */
+    class LatencyHistogram
+    {
+    public:
+        /**
+         * @brief Construct an empty Latency Histogram object.
+         */
+        LatencyHistogram()
+        {
+            Reset();
+        }
+
+        /**
+         * @brief Forget every recorded value.
+         */
+        void Reset()
+        {
+            memset(_buckets, 0, sizeof(_buckets));
+            _count = 0;
+            _max = 0;
+        }
+
+        /**
+         * @brief Record one latency.
+         *
+         * @param us Latency in microseconds.
+         */
+        void Record(uint32_t us)
+        {
+            _buckets[BucketOf(us)]++;
+            _count++;
+            _max = std::max(_max, us);
+        }
+
+        /**
+         * @brief Add all the values of another histogram.
+         *
+         * @param other Histogram to add.
+         */
+        void Merge(const LatencyHistogram &other)
+        {
+            for (int32_t index = 0; index < HIST_BUCKETS; index++)
+            {
+                _buckets[index] += other._buckets[index];
+            }
+            _count += other._count;
+            _max = std::max(_max, other._max);
+        }
+
+        /**
+         * @brief Get an estimate of a percentile.
+         *
+         * @param quantile Percentile as a fraction, like 0.99.
+         *
+         * @return uint32_t Middle of the bucket holding the percentile, in microseconds. 0 when empty.
+         */
+        uint32_t Percentile(double quantile)
+        {
+            uint64_t rank = (uint64_t)(quantile * _count + 0.999999);
+            uint64_t seen = 0;
+
+            for (int32_t index = 0; index < HIST_BUCKETS && _count > 0; index++)
+            {
+                seen += _buckets[index];
+                if (seen >= rank && _buckets[index] > 0)
+                {
+                    return std::min(MiddleOf(index), _max);
+                }
+            }
+
+            return _max;
+        }
+
+        /**
+         * @brief Get the number of recorded values.
+         */
+        uint64_t GetCount()
+        {
+            return _count;
+        }
+
+        /**
+         * @brief Get the largest recorded value, exact.
+         */
+        uint32_t GetMax()
+        {
+            return _max;
+        }
+
+    private:
+        static int32_t BucketOf(uint32_t us)
+        {
+            if (us < (1u << HIST_SUB_BITS))
+            {
+                return us;
+            }
+
+            int32_t msb = 31 - __builtin_clz(us);
+            if (msb >= HIST_MAX_BITS)
+            {
+                return HIST_BUCKETS - 1;
+            }
+
+            int32_t shift = msb - HIST_SUB_BITS;
+            return ((shift + 1) << HIST_SUB_BITS) + ((us >> shift) & ((1u << HIST_SUB_BITS) - 1));
+        }
+
+        static uint32_t MiddleOf(int32_t index)
+        {
+            if (index < (1 << HIST_SUB_BITS))
+            {
+                return index;
+            }
+
+            int32_t shift = (index >> HIST_SUB_BITS) - 1;
+            uint32_t low = ((1u << HIST_SUB_BITS) + (index & ((1 << HIST_SUB_BITS) - 1))) << shift;
+            return low + ((1u << shift) >> 1);
+        }
+
+        uint32_t _buckets[HIST_BUCKETS];
+        uint64_t _count;
+        uint32_t _max;
+    };
+
+    /**
+     * @class RollingHistogram
+     *
+     * @brief Sliding time window made of a ring of histogram slots.
+     *
+     * A slot is recycled once it falls out of the window, so memory is bounded by the slot count and a
+     * record costs the same whatever the window length. Slots are only allocated once they get a value.
+     */
+    class RollingHistogram
+    {
+    public:
+        /**
+         * @brief Construct a new Rolling Histogram object.
+         *
+         * @param slot_sec Time span of one slot.
+         * @param slots Number of slots, the window covers slot_sec * slots.
+         */
+        RollingHistogram(uint32_t slot_sec, uint32_t slots) : _slot_sec(slot_sec), _slots(slots)
+        {
+        }
+
+        /**
+         * @brief Record one probe.
+         *
+         * @param now_sec Current time in seconds.
+         * @param us Latency of a successful probe.
+         * @param failed Whether the probe failed, failures are counted but carry no latency.
+         */
+        void Record(uint64_t now_sec, uint32_t us, bool failed)
+        {
+            uint64_t epoch = now_sec / _slot_sec;
+            Slot &slot = _slots[epoch % _slots.size()];
+
+            if (slot.epoch != epoch)
+            {
+                slot.epoch = epoch;
+                slot.errors = 0;
+                if (slot.hist)
+                {
+                    slot.hist->Reset();
+                }
+            }
+
+            if (failed)
+            {
+                slot.errors++;
+                return;
+            }
+
+            if (!slot.hist)
+            {
+                slot.hist.reset(new LatencyHistogram());
+            }
+            slot.hist->Record(us);
+        }
+
+        /**
+         * @brief Merge every slot still inside the window.
+         *
+         * @param now_sec Current time in seconds.
+         * @param out Receives the merged latencies.
+         *
+         * @return uint64_t Number of failed probes inside the window.
+         */
+        uint64_t Snapshot(uint64_t now_sec, LatencyHistogram &out)
+        {
+            uint64_t epoch = now_sec / _slot_sec;
+            uint64_t errors = 0;
+
+            out.Reset();
+            for (Slot &slot : _slots)
+            {
+                if (slot.epoch + _slots.size() > epoch && slot.epoch <= epoch)
+                {
+                    errors += slot.errors;
+                    if (slot.hist)
+                    {
+                        out.Merge(*slot.hist);
+                    }
+                }
+            }
+
+            return errors;
+        }
+
+    private:
+        struct Slot
+        {
+            uint64_t epoch = UINT64_MAX; // Slot period number the slot holds, none yet.
+            uint64_t errors = 0;
+            unique_ptr<LatencyHistogram> hist;
+        };
+
+        uint32_t _slot_sec;
+        vector<Slot> _slots;
+    };
+
+    /**
+     * @class AnomalyDetector
+     *
+     * @brief Online detectors of one URL probed by one Agent, updated on every result in constant time and memory.
+     *
+     * - EWMA: a run of results far above a fast moving average of the latency. Outliers are kept out of the average
+     *   until the alert is raised, then the average follows them and the alert clears once it caught up.
+     * - CUSUM: the cumulative sum of the deviations above a slow baseline, which catches a lasting shift too small
+     *   for a single result to stand out. Outliers and results coming while the alert is raised are kept out of the
+     *   baseline, so the alert stays raised until latency goes back to it.
+     * - SLO: a run of failed probes, or of latencies above the objective of the job.
+     *
+     * The latency detectors work on the logarithm of the total time: latency noise grows with latency and has a long
+     * tail, which the logarithm makes close to normal, and a shift is measured as a ratio whatever the target.
+     * An alert is raised or cleared on a run of results, never on a single one, so a noisy target does not flap.
+     */
+    class AnomalyDetector
+    {
+    public:
+        enum Kind
+        {
+            EWMA,
+            CUSUM,
+            SLO,
+            KINDS
+        };
+
+        /**
+         * @brief Set the latency objective, or 0 to only alert on failures.
+         */
+        void SetSloUs(uint64_t slo_us)
+        {
+            _slo_us = slo_us;
+        }
+
+        /**
+         * @brief Account one result in every detector.
+         *
+         * @param us Total time of the probe.
+         * @param failed Whether the probe failed, its latency is then left out of the averages.
+         *
+         * @return uint32_t Bit 1 << kind set for every detector whose alert this result raised or cleared.
+         */
+        uint32_t Record(uint32_t us, bool failed)
+        {
+            uint32_t before = _raised;
+
+            Streak(SLO, failed || (_slo_us != 0 && us > _slo_us));
+            if (failed)
+            {
+                return _raised ^ before;
+            }
+
+            double value = log(max<uint32_t>(us, 1));
+            _samples++;
+
+            bool outlier = false;
+            bool follow = true;
+            if (_samples > DETECT_WARMUP)
+            {
+                outlier = value - _mean > EWMA_ALERT_DEVS * Deviation(EWMA);
+                follow = !outlier || IsRaised(EWMA);
+                Streak(EWMA, outlier);
+
+                double score = min((value - _base) / Deviation(CUSUM), CUSUM_CLIP);
+                _sum = min(max(_sum + score - CUSUM_SLACK, 0.0), CUSUM_LIMIT);
+                if (_sum >= CUSUM_LIMIT)
+                {
+                    _raised |= 1 << CUSUM;
+                }
+                else if (_sum == 0)
+                {
+                    _raised &= ~(1 << CUSUM);
+                }
+            }
+
+            // The first results weigh the same, so that the averages start from the mean of the warm up.
+            if (follow)
+            {
+                Smooth(value, max(EWMA_WEIGHT, 1.0 / _samples), _mean, _var);
+            }
+            if (!outlier && !IsRaised(CUSUM))
+            {
+                Smooth(value, max(CUSUM_WEIGHT, 1.0 / _samples), _base, _base_var);
+            }
+
+            return _raised ^ before;
+        }
+
+        /**
+         * @brief Whether the alert of a detector is raised.
+         */
+        bool IsRaised(Kind kind)
+        {
+            return (_raised >> kind) & 1;
+        }
+
+        /**
+         * @brief Get the latency a detector compares results with: the fast average, the baseline or the objective.
+         *
+         * @return double Microseconds.
+         */
+        double GetReferenceUs(Kind kind)
+        {
+            return (kind == SLO) ? _slo_us : exp((kind == EWMA) ? _mean : _base);
+        }
+
+        /**
+         * @brief Get how far above its reference a latency is one deviation away, for a detector.
+         *
+         * @return double Microseconds, 0 for SLO.
+         */
+        double GetDeviationUs(Kind kind)
+        {
+            return (kind == SLO) ? 0 : GetReferenceUs(kind) * expm1(Deviation(kind));
+        }
+
+    private:
+        /**
+         * @brief Get the deviation of the logarithm of the latency, for EWMA or CUSUM.
+         */
+        double Deviation(Kind kind)
+        {
+            return max(sqrt((kind == EWMA) ? _var : _base_var), DETECT_DEV_FLOOR);
+        }
+
+        /**
+         * @brief Count a result that disagrees with the state of a detector, the state flips after ALERT_RUNS in a row.
+         */
+        void Streak(Kind kind, bool bad)
+        {
+            if (bad == IsRaised(kind))
+            {
+                _streak[kind] = 0;
+            }
+            else if (++_streak[kind] >= ALERT_RUNS)
+            {
+                _raised ^= 1 << kind;
+                _streak[kind] = 0;
+            }
+        }
+
+        /**
+         * @brief Move an exponentially weighted average and variance towards a value.
+         */
+        static void Smooth(double value, double weight, double &mean, double &var)
+        {
+            double diff = value - mean;
+            double step = weight * diff;
+
+            mean += step;
+            var = (1 - weight) * (var + diff * step);
+        }
+
+        double _mean = 0; // Fast average and variance of the log latency, EWMA.
+        double _var = 0;
+        double _base = 0; // Slow baseline and variance of the log latency, CUSUM.
+        double _base_var = 0;
+        double _sum = 0;
+        uint64_t _slo_us = 0;
+        uint32_t _samples = 0;
+        uint32_t _raised = 0; // Bit 1 << kind per raised alert.
+        uint8_t _streak[KINDS] = {};
+    };
+    static_assert(sizeof(AnomalyDetector) == 64, "One detector per agent and URL fits a cache line");
+
+    /**
+     * @class LatencyStats
+     *
+     * @brief Streaming latency aggregates of one URL probed by one Agent, over 1 minute, 5 minutes and 1 hour, and the
+     *        anomaly detectors watching it.
+     */
+    class LatencyStats
+    {
+    public:
+        static const int32_t WINDOWS = 3;
+
+        /**
+         * @brief Construct a new Latency Stats object.
+         *
+         * @param job A job of the Agent, or of the pool, and URL the statistics are about.
+         */
+        LatencyStats(JobParser &job) : _key(job.GetKey()), _pool(job.GetPool()), _url(job.GetUrl())
+        {
+            _owner = job.GetPool().empty() ? "agent=" + to_string(job.GetAgentId()) : "pool=" + job.GetPool();
+            _windows.push_back(RollingHistogram(10, 6));  // 1m in 10s slots.
+            _windows.push_back(RollingHistogram(60, 5));  // 5m in 1m slots.
+            _windows.push_back(RollingHistogram(300, 12)); // 1h in 5m slots.
+        }
+
+        /**
+         * @brief Set the latency objective the SLO detector checks, from the job of the statistics.
+         */
+        void SetSlo(JobParser &job)
+        {
+            _detector.SetSloUs((uint64_t)job.GetSloMs() * 1000);
+        }
+
+        /**
+         * @brief Account one result in every window and detector.
+         *
+         * @param resp Result from the Agent.
+         * @param agent_id Agent the result comes from.
+         * @param now_sec Current time in seconds.
+         * @param alerts Receives one JSON line per alert raised or cleared by the result.
+         *
+         * @return uint32_t Number of alerts raised.
+         */
+        uint32_t Record(Response &resp, int32_t agent_id, uint64_t now_sec, string &alerts)
+        {
+            bool failed = IsFailedProbe(resp.http_code, resp.error);
+
+            for (RollingHistogram &window : _windows)
+            {
+                window.Record(now_sec, resp.total_us, failed);
+            }
+
+            uint32_t changed = _detector.Record(resp.total_us, failed);
+            return changed ? PutAlerts(resp, agent_id, changed, alerts) : 0;
+        }
+
+        /**
+         * @brief Get the key of the jobs sharing these statistics, the same as JobParser::GetKey.
+         *
+         * @return string "<agent> <url>".
+         */
+        string GetKey()
+        {
+            return _key;
+        }
+
+        /**
+         * @brief Print one summary line: count, failures and total time percentiles per window.
+         *
+         * @param now_sec Current time in seconds.
+         * @param out Stream to print to.
+         */
+        void Print(uint64_t now_sec, ostream &out)
+        {
+            static const char *names[WINDOWS] = {"1m", "5m", "1h"};
+            LatencyHistogram merged;
+
+            out << _owner << " " << _url;
+            for (int32_t index = 0; index < WINDOWS; index++)
+            {
+                uint64_t errors = _windows[index].Snapshot(now_sec, merged);
+                out << " " << names[index] << "[n=" << merged.GetCount() << " err=" << errors << " p50=" << FormatMs(merged.Percentile(0.50))
+                    << " p95=" << FormatMs(merged.Percentile(0.95)) << " p99=" << FormatMs(merged.Percentile(0.99))
+                    << " max=" << FormatMs(merged.GetMax()) << "]";
+            }
+            for (int32_t kind = 0; kind < AnomalyDetector::KINDS; kind++)
+            {
+                if (_detector.IsRaised((AnomalyDetector::Kind)kind))
+                {
+                    out << " alert=" << alert_names[kind];
+                }
+            }
+            out << "\n";
+        }
+
+    private:
+        static const char *alert_names[AnomalyDetector::KINDS];
+
+        uint32_t PutAlerts(Response &resp, int32_t agent_id, uint32_t changed, string &out)
+        {
+            uint32_t raised = 0;
+            char buf[256];
+
+            for (int32_t kind = 0; kind < AnomalyDetector::KINDS; kind++)
+            {
+                if (((changed >> kind) & 1) == 0)
+                {
+                    continue;
+                }
+
+                AnomalyDetector::Kind detector = (AnomalyDetector::Kind)kind;
+                bool up = _detector.IsRaised(detector);
+                raised += up ? 1 : 0;
+
+                out += "{\"time\":\"" + FormatTime(resp.time_ms ? resp.time_ms : WallClockMs());
+                snprintf(buf, sizeof(buf), "\",\"alert\":\"%s\",\"state\":\"%s\",\"job\":%d,\"agent\":%d,", alert_names[kind],
+                         up ? "raised" : "cleared", resp.job, agent_id);
+                out += buf;
+                if (!_pool.empty())
+                {
+                    out += "\"pool\":";
+                    PutJsonString(out, _pool);
+                    out += ',';
+                }
+                out += "\"url\":";
+                PutJsonString(out, _url);
+                snprintf(buf, sizeof(buf), ",\"code\":%u,\"error\":%u,\"total_us\":%u,\"reference_us\":%.0f,\"deviation_us\":%.0f}\n",
+                         resp.http_code, resp.error, resp.total_us, _detector.GetReferenceUs(detector), _detector.GetDeviationUs(detector));
+                out += buf;
+            }
+
+            return raised;
+        }
+
+        string _key;
+        string _owner; // "agent=<id>" or "pool=<name>".
+        string _pool;
+        string _url;
+        vector<RollingHistogram> _windows;
+        AnomalyDetector _detector;
+    };
+
+    const char *LatencyStats::alert_names[AnomalyDetector::KINDS] = {"ewma", "cusum", "slo"};
+
+    /**
+     * @class Aggregator
+     *
+     * @brief Keeps the latency statistics of every (Agent, URL) and (pool, URL) pair, a result is routed to them by its job id.
+     *        Their anomaly detectors run on every result, the alerts are written once per round of results.
+     */
+    class Aggregator
+    {
+    public:
+        /**
+         * @brief Construct a new Aggregator object.
+         *
+         * @param table Job table of the configuration read at start.
+         * @param alerts Stream the alerts are written to.
+         */
+        Aggregator(shared_ptr<JobTable> table, ostream &alerts) : _alert_out(alerts)
+        {
+            _interval_start_ms = NowMs();
+            _interval_errors = 0;
+
+            Update(table);
+        }
+
+        /**
+         * @brief Route results with a new job table. Jobs probing the same URL from the same Agent share their statistics,
+         *        which are kept across tables while the pair has jobs.
+         *
+         * @param table New job table.
+         */
+        void Update(shared_ptr<JobTable> table)
+        {
+            unordered_map<string, unique_ptr<LatencyStats>> kept;
+            unordered_map<string, LatencyStats *> by_key;
+
+            for (unique_ptr<LatencyStats> &stats : _stats)
+            {
+                string key = stats->GetKey();
+                kept[key] = std::move(stats);
+            }
+            _stats.clear();
+
+            _by_job.assign(table->GetNextId(), nullptr);
+            for (JobParser &job : table->GetJobs())
+            {
+                LatencyStats *&stats = by_key[job.GetKey()];
+                if (stats == nullptr)
+                {
+                    unique_ptr<LatencyStats> &old = kept[job.GetKey()];
+                    _stats.push_back(old ? std::move(old) : unique_ptr<LatencyStats>(new LatencyStats(job)));
+                    stats = _stats.back().get();
+                    stats->SetSlo(job); // The first job of the pair sets its objective.
+                }
+                _by_job[job.GetJobId()] = stats;
+            }
+
+            _table = table;
+        }
+
+        /**
+         * @brief Account one result.
+         *
+         * @param resp Result from an Agent.
+         * @param agent_id Agent the result comes from.
+         *
+         * @return bool False when the job is not in the job table, the result is then dropped.
+         */
+        bool Record(Response &resp, int32_t agent_id)
+        {
+            if (resp.job < 1 || resp.job >= (int32_t)_by_job.size() || _by_job[resp.job] == nullptr)
+            {
+                return false;
+            }
+
+            _alerts_raised += _by_job[resp.job]->Record(resp, agent_id, NowMs() / 1000, _alerts);
+            _interval_errors += IsFailedProbe(resp.http_code, resp.error) ? 1 : 0;
+            _table->SetLastUs(resp.job, resp.total_us);
+
+            // Delivery delay: from the probe completing on the Agent to its result reaching this thread.
+            int64_t delay_ms = (int64_t)WallClockMs() - (int64_t)resp.time_ms;
+            _delivery.Record((uint32_t)std::min<int64_t>(std::max<int64_t>(delay_ms, 0), UINT32_MAX / 1000) * 1000);
+
+            return true;
+        }
+
+        /**
+         * @brief Write the alerts of the results recorded since the last call.
+         *
+         * @return uint64_t Number of alerts raised since the last call.
+         */
+        uint64_t FlushAlerts()
+        {
+            uint64_t raised = _alerts_raised;
+
+            if (!_alerts.empty())
+            {
+                _alert_out << _alerts << flush;
+                _alerts.clear();
+                _alerts_raised = 0;
+            }
+
+            return raised;
+        }
+
+        /**
+         * @brief Get the job table results are routed with.
+         */
+        shared_ptr<JobTable> &GetTable()
+        {
+            return _table;
+        }
+
+        /**
+         * @brief Print the ingest line of the last interval, then the summary of every (Agent, URL) pair.
+         */
+        void PrintSummary()
+        {
+            uint64_t now_ms = NowMs();
+            uint64_t now_sec = now_ms / 1000;
+            double interval_sec = std::max<uint64_t>(now_ms - _interval_start_ms, 1) / 1000.0;
+            ostringstream out;
+            char rate[32];
+
+            snprintf(rate, sizeof(rate), "%.1f", _delivery.GetCount() / interval_sec);
+            out << "ingest results=" << _delivery.GetCount() << " err=" << _interval_errors << " rate=" << rate
+                << "/s delivery[p50=" << FormatMs(_delivery.Percentile(0.50)) << " p99=" << FormatMs(_delivery.Percentile(0.99)) << " max=" << FormatMs(_delivery.GetMax()) << "]\n";
+            _delivery.Reset();
+            _interval_start_ms = now_ms;
+            _interval_errors = 0;
+
+            out << "---- Latency summary, total time per agent and URL ----\n";
+            for (unique_ptr<LatencyStats> &stats : _stats)
+            {
+                stats->Print(now_sec, out);
+            }
+
+            cout << out.str() << flush;
+        }
+
+    private:
+        vector<unique_ptr<LatencyStats>> _stats;
+        vector<LatencyStats *> _by_job; // Indexed by job id.
+        LatencyHistogram _delivery;     // Reset at every summary.
+        uint64_t _interval_start_ms;
+        uint64_t _interval_errors;
+        shared_ptr<JobTable> _table;
+        ostream &_alert_out;
+        string _alerts; // JSON lines, written after each round of results.
+        uint64_t _alerts_raised = 0;
+    };
+
+    /**
+     * @brief Columns of the time-series store, each one is a contiguous array inside a segment file.
+     */
+    enum StoreColumn
+    {
+        COL_TIME,    ///< int32_t, milliseconds since the previous row (first row: since SegmentHeader::first_ms).
+        COL_JOB,     ///< uint32_t, job id of the store, see STORE_JOBS_FILE.
+        COL_AGENT,   ///< uint32_t
+        COL_CODE,    ///< uint16_t, HTTP status code.
+        COL_ERROR,   ///< uint16_t, libcurl error code.
+        COL_DNS,     ///< uint32_t, microseconds, like the other phases.
+        COL_CONNECT, ///< uint32_t
+        COL_TLS,     ///< uint32_t
+        COL_TTFB,    ///< uint32_t
+        COL_TOTAL,   ///< uint32_t
+        COL_BYTES,   ///< uint64_t
+        COL_COUNT
+    };
+
+    const uint32_t column_width[COL_COUNT] = {4, 4, 4, 2, 2, 4, 4, 4, 4, 4, 8};
+
+    /**
+     * @brief First page of a segment file.
+     */
+    struct SegmentHeader
+    {
+        uint32_t magic;
+        uint32_t capacity; ///< Rows the segment can hold.
+        uint64_t rows;     ///< Rows written so far, readers never look past it.
+        int64_t first_ms;  ///< Time of the first row, base of the delta encoded time column.
+        int64_t last_ms;   ///< Time of the last row, base of the next delta.
+        int64_t min_ms;    ///< Time range of the segment, a range scan skips segments outside of it.
+        int64_t max_ms;
+    };
+
+    /**
+     * @class Segment
+     *
+     * @brief One memory-mapped segment file: a header page followed by one array per column.
+     *
+     * The file is created at its full size, sparse, so columns never move. Since each column is its own
+     * array, a reader only faults in the pages of the columns it reads.
+     */
+    class Segment
+    {
+    public:
+        /**
+         * @brief Construct a closed Segment object.
+         */
+        Segment() : _base(nullptr), _len(0)
+        {
+        }
+
+        Segment(const Segment &) = delete;
+        Segment &operator=(const Segment &) = delete;
+
+        ~Segment()
+        {
+            Close();
+        }
+
+        /**
+         * @brief Create a new, empty segment file and map it.
+         *
+         * @param path Path of the file, it must not exist.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Create(const string &path)
+        {
+            int32_t fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd < 0)
+            {
+                cerr << "open " << path << ": " << strerror(errno) << endl;
+                return -1;
+            }
+
+            if (ftruncate(fd, FileLength(STORE_SEGMENT_ROWS)) != 0)
+            {
+                cerr << "ftruncate " << path << ": " << strerror(errno) << endl;
+                close(fd);
+                return -1;
+            }
+
+            int32_t ret = Map(fd, path, true);
+            close(fd);
+            if (ret != 0)
+            {
+                return -1;
+            }
+
+            SegmentHeader *header = GetHeader();
+            header->magic = STORE_MAGIC;
+            header->capacity = STORE_SEGMENT_ROWS;
+
+            return 0;
+        }
+
+        /**
+         * @brief Map an existing segment file.
+         *
+         * @param path Path of the file.
+         * @param writable Whether rows will be appended.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Open(const string &path, bool writable)
+        {
+            int32_t fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+            if (fd < 0)
+            {
+                cerr << "open " << path << ": " << strerror(errno) << endl;
+                return -1;
+            }
+
+            int32_t ret = Map(fd, path, writable);
+            close(fd);
+            if (ret != 0)
+            {
+                return -1;
+            }
+
+            SegmentHeader *header = GetHeader();
+            if (header->magic != STORE_MAGIC || FileLength(header->capacity) != _len || header->rows > header->capacity)
+            {
+                cerr << path << ": not a segment of the result store." << endl;
+                Close();
+                return -1;
+            }
+
+            return 0;
+        }
+
+        /**
+         * @brief Unmap the segment, if any.
+         */
+        void Close()
+        {
+            if (_base != nullptr)
+            {
+                munmap(_base, _len);
+                _base = nullptr;
+                _len = 0;
+            }
+        }
+
+        /**
+         * @brief Ask the kernel to start writing the dirty pages back, without waiting for it.
+         */
+        void Sync()
+        {
+            if (_base != nullptr && msync(_base, _len, MS_ASYNC) != 0)
+            {
+                cerr << "msync: " << strerror(errno) << endl;
+            }
+        }
+
+        /**
+         * @brief Get the header of the mapped segment.
+         */
+        SegmentHeader *GetHeader()
+        {
+            return (SegmentHeader *)_base;
+        }
+
+        /**
+         * @brief Get the number of rows a reader may look at.
+         */
+        uint64_t GetRows()
+        {
+            return __atomic_load_n(&GetHeader()->rows, __ATOMIC_ACQUIRE);
+        }
+
+        /**
+         * @brief Get the array of one column.
+         *
+         * @param column Column to get, T must match its width.
+         */
+        template <typename T>
+        T *GetColumn(StoreColumn column)
+        {
+            size_t offset = STORE_HEADER_LEN;
+            for (int32_t index = 0; index < column; index++)
+            {
+                offset += (size_t)column_width[index] * GetHeader()->capacity;
+            }
+
+            return (T *)((char *)_base + offset);
+        }
+
+    private:
+        static size_t FileLength(uint32_t capacity)
+        {
+            size_t len = STORE_HEADER_LEN;
+            for (int32_t index = 0; index < COL_COUNT; index++)
+            {
+                len += (size_t)column_width[index] * capacity;
+            }
+
+            return len;
+        }
+
+        int32_t Map(int32_t fd, const string &path, bool writable)
+        {
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < STORE_HEADER_LEN)
+            {
+                cerr << path << ": truncated segment." << endl;
+                return -1;
+            }
+
+            void *base = mmap(nullptr, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            if (base == MAP_FAILED)
+            {
+                cerr << "mmap " << path << ": " << strerror(errno) << endl;
+                return -1;
+            }
+
+            _base = base;
+            _len = st.st_size;
+
+            return 0;
+        }
+
+        void *_base;
+        size_t _len;
+    };
+
+    /**
+     * @brief List the segment files of a store, oldest first.
+     *
+     * @param dir Store directory.
+     * @param segments Receives the segment numbers.
+     *
+     * @return int32_t Status code.
+     */
+    static int32_t ListSegments(const string &dir, vector<uint32_t> &segments)
+    {
+        DIR *handle = opendir(dir.c_str());
+        if (handle == nullptr)
+        {
+            cerr << "opendir " << dir << ": " << strerror(errno) << endl;
+            return -1;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(handle)) != nullptr)
+        {
+            uint32_t number;
+            char tail;
+            if (sscanf(entry->d_name, "segment-%u.col%c", &number, &tail) == 1)
+            {
+                segments.push_back(number);
+            }
+        }
+        closedir(handle);
+
+        sort(segments.begin(), segments.end());
+
+        return 0;
+    }
+
+    /**
+     * @brief Get the path of a segment file.
+     */
+    static string SegmentPath(const string &dir, uint32_t number)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "segment-%08u.col", number);
+
+        return dir + "/" + name;
+    }
+
+    /**
+     * @brief Read the job dictionary of a store.
+     *
+     * @param dir Store directory.
+     * @param jobs Receives the key of each store job id, "<agent> <url>" or "@<pool> <url>" like JobParser::GetKey.
+     *
+     * @return int32_t Status code, a store without a dictionary yet has no jobs.
+     */
+    static int32_t LoadStoreJobs(const string &dir, map<uint32_t, string> &jobs)
+    {
+        string path = dir + "/" STORE_JOBS_FILE;
+        ifstream file(path);
+        if (!file)
+        {
+            if (errno == ENOENT)
+            {
+                return 0;
+            }
+            cerr << "open " << path << ": " << strerror(errno) << endl;
+            return -1;
+        }
+
+        string line;
+        while (getline(file, line))
+        {
+            istringstream fields(line);
+            uint32_t id;
+            string target, url;
+            if (!(fields >> id >> target >> url) || id == 0)
+            {
+                cerr << path << ": skipping malformed line: " << line << endl;
+                continue;
+            }
+            jobs[id] = target + " " + url;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @class TimeSeriesStore
+     *
+     * @brief Append-only columnar store of every result, made of fixed size memory-mapped segment files.
+     */
+    class TimeSeriesStore
+    {
+    public:
+        /**
+         * @brief Construct a new Time Series Store object.
+         *
+         * @param dir Directory of the segment files, created if missing.
+         */
+        TimeSeriesStore(const string &dir) : _dir(dir), _next(0), _next_job(1)
+        {
+        }
+
+        /**
+         * @brief Open the store, appending to its last segment if it still has room.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Open()
+        {
+            vector<uint32_t> segments;
+
+            if (mkdir(_dir.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                cerr << "mkdir " << _dir << ": " << strerror(errno) << endl;
+                return -1;
+            }
+
+            if (ListSegments(_dir, segments) != 0 || OpenJobs() != 0)
+            {
+                return -1;
+            }
+
+            if (!segments.empty())
+            {
+                _next = segments.back() + 1;
+                if (_segment.Open(SegmentPath(_dir, segments.back()), true) == 0 && _segment.GetRows() < _segment.GetHeader()->capacity)
+                {
+                    return 0;
+                }
+                _segment.Close();
+            }
+
+            return NextSegment();
+        }
+
+        /**
+         * @brief Get the id a job is stored under, the same across restarts and configuration changes.
+         *
+         * @param key Key of the job, JobParser::GetKey.
+         *
+         * @return uint32_t Store job id, 0 when a new job cannot be added to the dictionary.
+         */
+        uint32_t GetJobId(const string &key)
+        {
+            auto found = _jobs.find(key);
+            if (found != _jobs.end())
+            {
+                return found->second;
+            }
+
+            // The dictionary is written before any row refers to the new id.
+            uint32_t id = _next_job;
+            if (!(_jobs_file << id << " " << key << endl))
+            {
+                cerr << _dir << "/" STORE_JOBS_FILE ": write failed." << endl;
+                return 0;
+            }
+            _next_job++;
+            _jobs[key] = id;
+
+            return id;
+        }
+
+        /**
+         * @brief Append one result.
+         *
+         * @param resp Result from an Agent.
+         * @param agent_id Agent the result comes from.
+         * @param job_id Store job id of the result, GetJobId.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Append(Response &resp, int32_t agent_id, uint32_t job_id)
+        {
+            SegmentHeader *header = _segment.GetHeader();
+            int64_t ms = resp.time_ms ? resp.time_ms : WallClockMs();
+            int64_t delta = ms - header->last_ms;
+
+            // Results of different agents are not ordered, a segment ends when a delta does not fit.
+            if (header->rows == header->capacity || (header->rows > 0 && (delta > INT32_MAX || delta < INT32_MIN)))
+            {
+                if (NextSegment() != 0)
+                {
+                    return -1;
+                }
+                header = _segment.GetHeader();
+            }
+
+            uint64_t row = header->rows;
+            if (row == 0)
+            {
+                header->first_ms = header->min_ms = header->max_ms = ms;
+                delta = 0;
+            }
+            else
+            {
+                delta = ms - header->last_ms;
+            }
+
+            _segment.GetColumn<int32_t>(COL_TIME)[row] = (int32_t)delta;
+            _segment.GetColumn<uint32_t>(COL_JOB)[row] = job_id;
+            _segment.GetColumn<uint32_t>(COL_AGENT)[row] = agent_id;
+            _segment.GetColumn<uint16_t>(COL_CODE)[row] = resp.http_code;
+            _segment.GetColumn<uint16_t>(COL_ERROR)[row] = resp.error;
+            _segment.GetColumn<uint32_t>(COL_DNS)[row] = resp.dns_us;
+            _segment.GetColumn<uint32_t>(COL_CONNECT)[row] = resp.connect_us;
+            _segment.GetColumn<uint32_t>(COL_TLS)[row] = resp.tls_us;
+            _segment.GetColumn<uint32_t>(COL_TTFB)[row] = resp.ttfb_us;
+            _segment.GetColumn<uint32_t>(COL_TOTAL)[row] = resp.total_us;
+            _segment.GetColumn<uint64_t>(COL_BYTES)[row] = resp.bytes;
+
+            header->last_ms = ms;
+            header->min_ms = min(header->min_ms, ms);
+            header->max_ms = max(header->max_ms, ms);
+
+            // Publish the row once all of its columns are written, for readers of a live store.
+            __atomic_store_n(&header->rows, row + 1, __ATOMIC_RELEASE);
+
+            return 0;
+        }
+
+        /**
+         * @brief Start writing the current segment back to disk.
+         */
+        void Sync()
+        {
+            _segment.Sync();
+        }
+
+    private:
+        int32_t NextSegment()
+        {
+            _segment.Sync();
+            _segment.Close();
+
+            return _segment.Create(SegmentPath(_dir, _next++));
+        }
+
+        int32_t OpenJobs()
+        {
+            map<uint32_t, string> jobs;
+            if (LoadStoreJobs(_dir, jobs) != 0)
+            {
+                return -1;
+            }
+
+            for (auto &entry : jobs)
+            {
+                _jobs[entry.second] = entry.first;
+                _next_job = max(_next_job, entry.first + 1);
+            }
+
+            string path = _dir + "/" STORE_JOBS_FILE;
+            _jobs_file.open(path, ios::app);
+            if (!_jobs_file)
+            {
+                cerr << "open " << path << ": " << strerror(errno) << endl;
+                return -1;
+            }
+
+            return 0;
+        }
+
+        string _dir;
+        uint32_t _next; // Number of the next segment file.
+        Segment _segment;
+        unordered_map<string, uint32_t> _jobs; // Store job id by job key.
+        uint32_t _next_job;
+        ofstream _jobs_file;
+    };
+
+    /**
+     * @class StoreReader
+     *
+     * @brief Range scan over a store. Only the time column is always read, callers read the others they need.
+     */
+    class StoreReader
+    {
+    public:
+        /**
+         * @brief Construct a new Store Reader object.
+         *
+         * @param dir Directory of the segment files.
+         */
+        StoreReader(const string &dir) : _dir(dir)
+        {
+        }
+
+        /**
+         * @brief Visit every row in a time range, segment after segment.
+         *
+         * @param from_ms Start of the range, included, milliseconds since the epoch.
+         * @param to_ms End of the range, excluded.
+         * @param on_row Called with the segment, the row number and the row time.
+         *
+         * @return int32_t Status code.
+         */
+        template <typename Callback>
+        int32_t Scan(int64_t from_ms, int64_t to_ms, Callback on_row)
+        {
+            vector<uint32_t> segments;
+
+            if (ListSegments(_dir, segments) != 0)
+            {
+                return -1;
+            }
+
+            for (uint32_t number : segments)
+            {
+                Segment segment;
+                if (segment.Open(SegmentPath(_dir, number), false) != 0)
+                {
+                    continue;
+                }
+
+                uint64_t rows = segment.GetRows();
+                SegmentHeader *header = segment.GetHeader();
+                if (rows == 0 || header->max_ms < from_ms || header->min_ms >= to_ms)
+                {
+                    continue;
+                }
+
+                int32_t *deltas = segment.GetColumn<int32_t>(COL_TIME);
+                int64_t ms = header->first_ms;
+                for (uint64_t row = 0; row < rows; row++)
+                {
+                    ms += deltas[row];
+                    if (ms >= from_ms && ms < to_ms)
+                    {
+                        on_row(segment, row, ms);
+                    }
+                }
+            }
+
+            return 0;
+        }
+
+    private:
+        string _dir;
+    };
+
+    /**
+     * @brief Select the store jobs a query prints.
+     *
+     * @param jobs Job dictionary of the store.
+     * @param job Store job id, job key ("<agent> <url>" or "@<pool> <url>") or URL, empty for every job.
+     * @param selected Receives the selected store job ids, all of them when empty.
+     *
+     * @return int32_t Status code, -1 when no job matches.
+     */
+    static int32_t SelectStoreJobs(const map<uint32_t, string> &jobs, const string &job, unordered_set<uint32_t> &selected)
+    {
+        if (job.empty())
+        {
+            return 0;
+        }
+
+        for (auto &entry : jobs)
+        {
+            const string &key = entry.second;
+            if (to_string(entry.first) == job || key == job || key.compare(key.find(' ') + 1, string::npos, job) == 0)
+            {
+                selected.insert(entry.first);
+            }
+        }
+
+        if (selected.empty())
+        {
+            cerr << "No job " << job << " in the store." << endl;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief Print every stored result of a time range.
+     *
+     * @param dir Store directory.
+     * @param from_ms Start of the range, milliseconds since the epoch.
+     * @param to_ms End of the range, excluded.
+     * @param job Only print this job, see SelectStoreJobs.
+     *
+     * @return int32_t Status code.
+     */
+    static int32_t QueryRows(const string &dir, int64_t from_ms, int64_t to_ms, const string &job)
+    {
+        map<uint32_t, string> jobs;
+        unordered_set<uint32_t> selected;
+        if (LoadStoreJobs(dir, jobs) != 0 || SelectStoreJobs(jobs, job, selected) != 0)
+        {
+            return -1;
+        }
+
+        StoreReader reader(dir);
+
+        return reader.Scan(from_ms, to_ms, [&](Segment &segment, uint64_t row, int64_t ms) {
+            uint32_t row_job = segment.GetColumn<uint32_t>(COL_JOB)[row];
+            if (!selected.empty() && selected.count(row_job) == 0)
+            {
+                return;
+            }
+
+            const string &key = jobs[row_job];
+            cout << FormatTime(ms) << " job=" << row_job << " agent=" << segment.GetColumn<uint32_t>(COL_AGENT)[row] << " "
+                 << key.substr(key.find(' ') + 1) << " code=" << segment.GetColumn<uint16_t>(COL_CODE)[row]
+                 << " dns=" << FormatMs(segment.GetColumn<uint32_t>(COL_DNS)[row])
+                 << " tcp=" << FormatMs(segment.GetColumn<uint32_t>(COL_CONNECT)[row]) << " tls=" << FormatMs(segment.GetColumn<uint32_t>(COL_TLS)[row])
+                 << " ttfb=" << FormatMs(segment.GetColumn<uint32_t>(COL_TTFB)[row]) << " total=" << FormatMs(segment.GetColumn<uint32_t>(COL_TOTAL)[row])
+                 << " bytes=" << segment.GetColumn<uint64_t>(COL_BYTES)[row];
+            if (segment.GetColumn<uint16_t>(COL_ERROR)[row] != 0)
+            {
+                cout << " error=" << segment.GetColumn<uint16_t>(COL_ERROR)[row];
+            }
+            cout << "\n";
+        });
+    }
+
+    /**
+     * @brief Print one line per job and time step of a range: probe count, failures and total time percentiles.
+     *
+     * Only the time, job, status, error and total columns are read.
+     *
+     * @param dir Store directory.
+     * @param from_ms Start of the range, milliseconds since the epoch.
+     * @param to_ms End of the range, excluded.
+     * @param job Only print this job, see SelectStoreJobs.
+     * @param step_sec Length of a step.
+     *
+     * @return int32_t Status code.
+     */
+    static int32_t QueryDownsampled(const string &dir, int64_t from_ms, int64_t to_ms, const string &job, int64_t step_sec)
+    {
+        struct Step
+        {
+            LatencyHistogram hist;
+            uint64_t errors = 0;
+        };
+        map<pair<int64_t, uint32_t>, unique_ptr<Step>> steps; // By (step start, job).
+        map<uint32_t, string> jobs;
+        unordered_set<uint32_t> selected;
+        StoreReader reader(dir);
+        int64_t step_ms = step_sec * 1000;
+
+        if (LoadStoreJobs(dir, jobs) != 0 || SelectStoreJobs(jobs, job, selected) != 0)
+        {
+            return -1;
+        }
+
+        int32_t ret = reader.Scan(from_ms, to_ms, [&](Segment &segment, uint64_t row, int64_t ms) {
+            uint32_t row_job = segment.GetColumn<uint32_t>(COL_JOB)[row];
+            if (!selected.empty() && selected.count(row_job) == 0)
+            {
+                return;
+            }
+
+            unique_ptr<Step> &step = steps[make_pair(ms - ms % step_ms, row_job)];
+            if (!step)
+            {
+                step.reset(new Step());
+            }
+
+            if (IsFailedProbe(segment.GetColumn<uint16_t>(COL_CODE)[row], segment.GetColumn<uint16_t>(COL_ERROR)[row]))
+            {
+                step->errors++;
+            }
+            else
+            {
+                step->hist.Record(segment.GetColumn<uint32_t>(COL_TOTAL)[row]);
+            }
+        });
+
+        for (auto &entry : steps)
+        {
+            LatencyHistogram &hist = entry.second->hist;
+            cout << FormatTime(entry.first.first) << " job=" << entry.first.second << " " << jobs[entry.first.second]
+                 << " n=" << hist.GetCount() << " err=" << entry.second->errors << " p50=" << FormatMs(hist.Percentile(0.50))
+                 << " p95=" << FormatMs(hist.Percentile(0.95)) << " p99=" << FormatMs(hist.Percentile(0.99)) << " max=" << FormatMs(hist.GetMax())
+                 << "\n";
+        }
+
+        return ret;
+    }
+
+    /**
+     * @class ResultOutput
+     *
+     * @brief Destination of every single result in one format, a file or stdout. Results are formatted into a buffer
+     *        written out in one go, once full or when flushed, and a file is rotated once it grows too big.
+     */
+    class ResultOutput
+    {
+    public:
+        /**
+         * @brief Construct a new Result Output object.
+         *
+         * @param path File the results are appended to, "-" for stdout.
+         * @param rotate_bytes Size a file is rotated at, 0 to never rotate it.
+         */
+        ResultOutput(const string &path, uint64_t rotate_bytes) : _path(path), _rotate_bytes(rotate_bytes)
+        {
+            _buf.reserve(OUTPUT_BUFFER_LEN + MAX_URL_LEN * 2);
+        }
+
+        virtual ~ResultOutput()
+        {
+            if (_fd > STDERR_FILENO)
+            {
+                close(_fd);
+            }
+        }
+
+        /**
+         * @brief Open the file, appending to it. A new file starts with the header of the format.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Open()
+        {
+            if (_path == "-")
+            {
+                _fd = STDOUT_FILENO;
+                return 0;
+            }
+
+            _fd = open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            struct stat st;
+            if (_fd < 0 || fstat(_fd, &st) != 0)
+            {
+                cerr << "open: " << _path << ": " << strerror(errno) << endl;
+                return -1;
+            }
+
+            _size = st.st_size;
+            if (_size == 0)
+            {
+                PutHeader(_buf);
+            }
+
+            return 0;
+        }
+
+        /**
+         * @brief Add a result, the buffer is written out once full.
+         *
+         * @param resp Result from an Agent.
+         * @param agent_id Agent the result is from.
+         * @param job The job the result belongs to.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Write(const Response &resp, int32_t agent_id, JobParser &job)
+        {
+            PutResult(_buf, resp, agent_id, job);
+
+            return (_buf.size() >= OUTPUT_BUFFER_LEN) ? Flush() : 0;
+        }
+
+        /**
+         * @brief Write the buffered results out, then rotate the file if it is big enough.
+         *
+         * @return int32_t Status code.
+         */
+        int32_t Flush()
+        {
+            size_t done = 0;
+            while (done < _buf.size())
+            {
+                ssize_t ret = write(_fd, _buf.data() + done, _buf.size() - done);
+                if (ret < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    cerr << "write: " << _path << ": " << strerror(errno) << endl;
+                    return -1;
+                }
+                done += ret;
+            }
+            _size += _buf.size();
+            _buf.clear();
+
+            if (_rotate_bytes != 0 && _fd != STDOUT_FILENO && _size >= _rotate_bytes)
+            {
+                return Rotate();
+            }
+
+            return 0;
+        }
+
+        const string &GetPath()
+        {
+            return _path;
+        }
+
+    protected:
+        /**
+         * @brief Append what a new file starts with, nothing by default.
+         */
+        virtual void PutHeader(string &out)
+        {
+        }
+
+        /**
+         * @brief Append a result in the format of the output.
+         */
+        virtual void PutResult(string &out, const Response &resp, int32_t agent_id, JobParser &job) = 0;
+
+    private:
+        /**
+         * @brief Shift <file>.1 to <file>.2 and so on, dropping the oldest one, move the file to <file>.1 and start a new one.
+         */
+        int32_t Rotate()
+        {
+            for (int32_t index = OUTPUT_KEEP_FILES - 1; index > 0; index--)
+            {
+                rename((_path + "." + to_string(index)).c_str(), (_path + "." + to_string(index + 1)).c_str());
+            }
+
+            if (rename(_path.c_str(), (_path + ".1").c_str()) != 0)
+            {
+                cerr << "rename: " << _path << ": " << strerror(errno) << endl;
+                return -1;
+            }
+            close(_fd);
+            _fd = -1;
+
+            return Open();
+        }
+
+        string _path;
+        uint64_t _rotate_bytes;
+        uint64_t _size = 0; // Bytes in the file.
+        int32_t _fd = -1;
+        string _buf;
+    };
+
+    /**
+     * @class TextOutput
+     *
+     * @brief One line of text per result, like the store queries print them.
+     */
+    class TextOutput : public ResultOutput
+    {
+    public:
+        using ResultOutput::ResultOutput;
+
+    protected:
+        void PutResult(string &out, const Response &resp, int32_t agent_id, JobParser &job) override
+        {
+            char buf[256];
+
+            out += FormatTime(resp.time_ms ? resp.time_ms : WallClockMs());
+            snprintf(buf, sizeof(buf), " job=%d agent=%d ", resp.job, agent_id);
+            out += buf;
+            out += job.GetUrl();
+            snprintf(buf, sizeof(buf), " code=%u dns=%.3fms tcp=%.3fms tls=%.3fms ttfb=%.3fms total=%.3fms bytes=%llu", resp.http_code,
+                     resp.dns_us / 1000.0, resp.connect_us / 1000.0, resp.tls_us / 1000.0, resp.ttfb_us / 1000.0, resp.total_us / 1000.0,
+                     (unsigned long long)resp.bytes);
+            out += buf;
+            if (resp.error != 0)
+            {
+                out += " error=" + to_string(resp.error);
+            }
+            for (size_t index = 0; index < resp.steps.size(); index++)
+            {
+                const StepTiming &step = resp.steps[index];
+                snprintf(buf, sizeof(buf), "%s%u:%.3fms", index == 0 ? " steps=" : ",", step.http_code, step.total_us / 1000.0);
+                out += buf;
+                if (step.error != 0)
+                {
+                    out += ":e" + to_string(step.error);
+                }
+            }
+            out += (resp.mode == PROBE_WARM) ? " mode=warm" : " mode=cold";
+            out += " (" + to_string(resp.runs) + " runs)\n";
+        }
+    };
+
+    /**
+     * @class JsonOutput
+     *
+     * @brief One JSON object per line and result, times in microseconds.
+     */
+    class JsonOutput : public ResultOutput
+    {
+    public:
+        using ResultOutput::ResultOutput;
+
+    protected:
+        void PutResult(string &out, const Response &resp, int32_t agent_id, JobParser &job) override
+        {
+            char buf[320];
+
+            out += "{\"time\":\"" + FormatTime(resp.time_ms ? resp.time_ms : WallClockMs());
+            snprintf(buf, sizeof(buf), "\",\"job\":%d,\"agent\":%d,", resp.job, agent_id);
+            out += buf;
+            if (!job.GetPool().empty())
+            {
+                out += "\"pool\":";
+                PutJsonString(out, job.GetPool());
+                out += ',';
+            }
+            out += "\"url\":";
+            PutJsonString(out, job.GetUrl());
+            snprintf(buf, sizeof(buf),
+                     ",\"code\":%u,\"error\":%u,\"dns_us\":%u,\"connect_us\":%u,\"tls_us\":%u,\"ttfb_us\":%u,\"total_us\":%u,\"bytes\":%llu,"
+                     "\"mode\":\"%s\",\"runs\":%d",
+                     resp.http_code, resp.error, resp.dns_us, resp.connect_us, resp.tls_us, resp.ttfb_us, resp.total_us,
+                     (unsigned long long)resp.bytes, (resp.mode == PROBE_WARM) ? "warm" : "cold", resp.runs);
+            out += buf;
+            for (size_t index = 0; index < resp.steps.size(); index++)
+            {
+                const StepTiming &step = resp.steps[index];
+                snprintf(buf, sizeof(buf),
+                         "%s{\"code\":%u,\"error\":%u,\"dns_us\":%u,\"connect_us\":%u,\"tls_us\":%u,\"ttfb_us\":%u,\"total_us\":%u,\"bytes\":%llu}",
+                         index == 0 ? ",\"steps\":[" : ",", step.http_code, step.error, step.dns_us, step.connect_us, step.tls_us, step.ttfb_us,
+                         step.total_us, (unsigned long long)step.bytes);
+                out += buf;
+            }
+            out += resp.steps.empty() ? "}\n" : "]}\n";
+        }
+    };
+
+    /**
+     * @brief Record of a binary output file, in the byte order of the host. The URL is left out, the job ID tells it.
+     */
+    struct OutputRecord
+    {
+        uint64_t time_ms; ///< Wall clock time the probe completed at, milliseconds since the epoch.
+        uint64_t bytes;
+        uint32_t job;
+        uint32_t agent;
+        uint32_t dns_us;
+        uint32_t connect_us;
+        uint32_t tls_us;
+        uint32_t ttfb_us;
+        uint32_t total_us;
+        uint32_t runs;
+        uint16_t http_code;
+        uint16_t error;
+        uint8_t mode;
+        uint8_t reserved[3];
+    };
+    static_assert(sizeof(OutputRecord) == 56, "OutputRecord layout is part of the file format");
+
+    /**
+     * @class BinaryOutput
+     *
+     * @brief Fixed size records, after a header of the magic and the record size.
+     */
+    class BinaryOutput : public ResultOutput
+    {
+    public:
+        using ResultOutput::ResultOutput;
+
+    protected:
+        void PutHeader(string &out) override
+        {
+            uint32_t header[2] = {OUTPUT_MAGIC, sizeof(OutputRecord)};
+            out.append((const char *)header, sizeof(header));
+        }
+
+        void PutResult(string &out, const Response &resp, int32_t agent_id, JobParser &job) override
+        {
+            OutputRecord record = {};
+
+            record.time_ms = resp.time_ms ? resp.time_ms : WallClockMs();
+            record.bytes = resp.bytes;
+            record.job = resp.job;
+            record.agent = agent_id;
+            record.dns_us = resp.dns_us;
+            record.connect_us = resp.connect_us;
+            record.tls_us = resp.tls_us;
+            record.ttfb_us = resp.ttfb_us;
+            record.total_us = resp.total_us;
+            record.runs = resp.runs;
+            record.http_code = resp.http_code;
+            record.error = resp.error;
+            record.mode = resp.mode;
+            out.append((const char *)&record, sizeof(record));
+        }
+    };
+
+    /**
+     * @brief Create and open an output from its description.
+     *
+     * @param spec <format>[:<path>], format text, jsonl or binary, path "-" or missing for stdout.
+     * @param rotate_bytes Size a file is rotated at, 0 to never rotate it.
+     * @param outputs List the output is added to.
+     *
+     * @return int32_t Status code.
+     */
+    static int32_t OpenOutput(const string &spec, uint64_t rotate_bytes, vector<unique_ptr<ResultOutput>> &outputs)
+    {
+        size_t colon = spec.find(':');
+        string format = spec.substr(0, colon);
+        string path = (colon == string::npos || colon + 1 == spec.size()) ? "-" : spec.substr(colon + 1);
+        unique_ptr<ResultOutput> output;
+
+        if (format == "text")
+        {
+            output.reset(new TextOutput(path, rotate_bytes));
+        }
+        else if (format == "jsonl")
+        {
+            output.reset(new JsonOutput(path, rotate_bytes));
+        }
+        else if (format == "binary")
+        {
+            output.reset(new BinaryOutput(path, rotate_bytes));
+        }
+        else
+        {
+            cerr << "Unknown output format: " << format << ", expected text, jsonl or binary." << endl;
+            return -1;
+        }
+
+        if (output->Open() != 0)
+        {
+            return -1;
+        }
+        outputs.push_back(std::move(output));
+
+        return 0;
+    }
+
+    /**
+     * @brief Hand every job to its Agent based on the agent IDs, it is sent once the Agent has opened a session.
+     *
+     * @param agent List of Agent a Core is connected with.
+     * @param agent_index Position of each Agent ID in the Agent list.
+     * @param table Job table of the configuration read at start.
+     *
+     * @return int32_t Status code.
+     */
+    static int32_t AssignJobsToAgents(vector<Agent> &agent, unordered_map<int32_t, size_t> &agent_index, JobTable &table)
+    {
+        for (JobParser &job : table.GetJobs())
+        {
+            if (job.GetPool().empty() && agent_index.find(job.GetAgentId()) == agent_index.end())
+            {
+                cerr << "Core dont know agent with Id: " << job.GetAgentId() << endl;
+            }
+        }
+
+        for (Agent &each : agent)
+        {
+            each.SetJobs(table.GetAgentJobs(each.GetAgentId()));
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief A result on its way from one Core thread to the next.
+     */
+    struct AgentResult
+    {
+        Response resp;
+        int32_t agent_id; ///< Agent the result comes from.
+    };
+
+    /**
+     * @brief Queue a result for the next thread, waiting for room while that thread catches up.
+     *
+     * @param ring Queue to the next thread.
+     * @param notifier Wakes the next thread up.
+     * @param result Result to queue.
+     */
+    static void PushResult(SpscRing<AgentResult> &ring, Notifier &notifier, const AgentResult &result)
+    {
+        while (!ring.TryPush(result))
+        {
+            notifier.Notify();
+            this_thread::yield();
+        }
+    }
+
+    /**
+     * @class IngestThread
+     *
+     * @brief Network thread serving a subset of the Agents: reads their frames, decodes the results and queues them
+     *        for the aggregation thread. Every ready Agent is served on each wake up.
+     */
+    class IngestThread
+    {
+    public:
+        /**
+         * @brief Construct a new Ingest Thread object.
+         *
+         * @param registry Current job table, to send the jobs to the Agents and validate the job of each result.
+         * @param notifier Wakes the aggregation thread up.
+         * @param metrics Block of the thread.
+         */
+        IngestThread(JobRegistry &registry, Notifier &notifier, MetricBlock *metrics)
+            : _registry(registry), _table(registry.Get()), _notifier(notifier), _ring(RESULT_RING_LEN), _metrics(metrics)
+        {
+        }
+
+        /**
+         * @brief Make the thread serve an Agent, before the Agent is connected.
+         *
+         * @param agent Agent to serve, it must outlive the thread.
+         */
+        void Attach(Agent &agent)
+        {
+            agent.SetPollSlot(&_poll_fd, _poll_fd.size());
+            agent.SetMetrics(_metrics);
+            _poll_fd.push_back(pollfd{-1, 0, 0});
+            _agents.push_back(&agent);
+        }
+
+        /**
+         * @brief Start serving the Agents, the thread owns them from now on.
+         */
+        void Start()
+        {
+            _thread = thread(&IngestThread::Run, this);
+        }
+
+        /**
+         * @brief Get the queue of the decoded results, its consumer is the aggregation thread.
+         */
+        SpscRing<AgentResult> &GetRing()
+        {
+            return _ring;
+        }
+
+        /**
+         * @brief Get the metrics of the thread, to read them from any thread.
+         */
+        const MetricBlock *GetMetrics()
+        {
+            return _metrics;
+        }
+
+    private:
+        void Run()
+        {
+            while (1)
+            {
+                int32_t ready = poll(_poll_fd.data(), _poll_fd.size(), Reconnect());
+                if (ready < 0 && errno != EINTR)
+                {
+                    cerr << "poll: " << strerror(errno) << std::endl;
+                }
+
+                if (_registry.GetVersion() != _table->GetVersion())
+                {
+                    UpdateJobs();
+                }
+
+                uint64_t start_us = MonotonicUs();
+                size_t pending = 0;
+                for (size_t index = 0; index < _poll_fd.size(); index++)
+                {
+                    short revents = _poll_fd[index].revents;
+                    _poll_fd[index].revents = 0;
+
+                    if ((revents & POLLOUT) && _agents[index]->OnWritable() != 0)
+                    {
+                        continue;
+                    }
+
+                    if (revents & POLLIN)
+                    {
+                        Receive(*_agents[index]);
+                    }
+                    else if (revents & (POLLHUP | POLLERR))
+                    {
+                        cerr << "Agent " << _agents[index]->GetAgentId() << " closed the connection." << endl;
+                        _agents[index]->Disconnect();
+                    }
+                    pending += _agents[index]->GetPendingBytes();
+                }
+
+                // One wake up for everything read in this round.
+                _notifier.Notify();
+
+                _metrics->Set(METRIC_QUEUE_BYTES, pending);
+                if (ready > 0)
+                {
+                    _metrics->Add(METRIC_LOOP_US, MonotonicUs() - start_us);
+                    _metrics->Add(METRIC_LOOP_COUNT, 1);
+                }
+            }
+        }
+
+        /**
+         * @brief Take the current job table, each Agent is sent the difference with the jobs it runs.
+         */
+        void UpdateJobs()
+        {
+            shared_ptr<JobTable> table = _registry.Get();
+            if (table == _table)
+            {
+                return;
+            }
+
+            for (Agent *agent : _agents)
+            {
+                agent->SetJobs(table->GetAgentJobs(agent->GetAgentId()));
+            }
+            _table = table;
+        }
+
+        /**
+         * @brief Start the connection attempts that are due.
+         *
+         * @return int32_t Time to wait for events before the next attempt is due, in milliseconds.
+         */
+        int32_t Reconnect()
+        {
+            uint64_t now = NowMs();
+            uint64_t timeout = POLL_TIMEOUT_MS;
+
+            for (Agent *agent : _agents)
+            {
+                uint64_t retry_ms = agent->GetRetryTime();
+                if (retry_ms != 0 && retry_ms <= now)
+                {
+                    agent->ConnectAgent();
+                    retry_ms = agent->GetRetryTime();
+                }
+
+                if (retry_ms != 0)
+                {
+                    timeout = min(timeout, retry_ms > now ? retry_ms - now : 0);
+                }
+            }
+
+            return (int32_t)timeout;
+        }
+
+        void Receive(Agent &agent)
+        {
+            AgentResult result;
+            Welcome welcome;
+            Load load;
+            int32_t id = agent.GetAgentId();
+
+            result.agent_id = id;
+            auto on_response = [&](Response &resp) {
+                JobParser *job = _table->Find(resp.job);
+                if (job == nullptr && resp.job > 0 && resp.job < _table->GetNextId())
+                {
+                    return; // Late result of a job removed by a reload.
+                }
+                if (job == nullptr || (job->GetPool().empty() && job->GetAgentId() != id)) // A job of a pool may have moved.
+                {
+                    cerr << "Agent " << id << " sent a result for unknown job " << resp.job << endl;
+                    return;
+                }
+
+                result.resp = resp;
+                PushResult(_ring, _notifier, result);
+                _metrics->Add(METRIC_RESULTS, 1);
+            };
+
+            int32_t ret = agent.Receive([&](Frame &frame) {
+                if (frame.type == MSG_RESULT_BATCH)
+                {
+                    if (DecodeResultBatch(frame.payload, frame.len, on_response) < 0)
+                    {
+                        cerr << "Dropping malformed result batch from agent " << id << endl;
+                    }
+                }
+                else if (frame.type == MSG_RESPONSE && DecodeResponse(frame.payload, frame.len, result.resp))
+                {
+                    on_response(result.resp);
+                }
+                else if (frame.type == MSG_WELCOME && DecodeWelcome(frame.payload, frame.len, welcome))
+                {
+                    agent.OnWelcome(welcome);
+                }
+                else if (frame.type == MSG_LOAD && DecodeLoad(frame.payload, frame.len, load))
+                {
+                    agent.OnLoad(load);
+                }
+                else
+                {
+                    cerr << "Dropping malformed frame of type " << (int32_t)frame.type << " from agent " << id << endl;
                 }
-            }
-            else
+            });
+
+            if (ret <= 0)
             {
-                cerr << "Couldn't open config file for reading." << endl;
-                return -1;
+                cerr << "Agent " << id << " closed the connection." << endl;
+                agent.Disconnect();
             }
-
-            cout << "Number jobs to execute:" << jobs.size() << endl;
-
-            conf_file.close();
-
-            return 0;
         }
 
+        JobRegistry &_registry;
+        shared_ptr<JobTable> _table; // Keeps the jobs of the Agents valid.
+        Notifier &_notifier;
+        SpscRing<AgentResult> _ring;
+        vector<struct pollfd> _poll_fd; // One per Agent, in the same order as _agents.
+        vector<Agent *> _agents;
+        MetricBlock *_metrics;
+        thread _thread;
+    };
+
+    /**
+     * @class ResultSink
+     *
+     * @brief Thread writing every result out, to the result store and to the outputs, so that slow output never
+     *        holds the aggregation back. Outputs are written in batches, at most every flush interval.
+     */
+    class ResultSink
+    {
+    public:
         /**
-         * @brief Get the total number of jobs an Agent has to perform.
+         * @brief Construct a new Result Sink object.
          *
-         * @return int32_t Job count.
+         * @param registry Current job table, to write the URL of each result.
+         * @param store Store every result is appended to, null when results are not stored.
+         * @param outputs Outputs every result is written to.
+         * @param flush_ms Time results are buffered for at most, 0 to write them as soon as the queue is empty.
          */
-        int32_t getJobCount()
+        ResultSink(JobRegistry &registry, TimeSeriesStore *store, vector<unique_ptr<ResultOutput>> &outputs, uint64_t flush_ms)
+            : _registry(registry), _table(registry.Get()), _store(store), _outputs(std::move(outputs)), _flush_ms(flush_ms),
+              _ring(RESULT_RING_LEN)
         {
-            return jobs.size();
         }
 
         /**
-         * @brief Get the list of the jobs that an Agent will perform.
-         *
-         * @return vector<JobParser>& List of job instances.
+         * @brief Start writing the queued results.
          */
-        vector<JobParser> &GetJobList()
+        void Start()
         {
-            return jobs;
+            _thread = thread(&ResultSink::Run, this);
         }
 
-    private:
-        vector<JobParser> jobs;
-        string file;
-    };
-
-    /**
-     * @class Agent
-     *
-     * @brief Implements all the functionalities that deals with Agents.
-     */
-    class Agent
-    {
-    public:
         /**
-         * @brief Construct a new Agent object.
-         *
-         * @param id A unique Agent id to connect with it.
+         * @brief Queue a result, from the aggregation thread only.
          */
-        Agent(int32_t id) : agent_id(id)
+        void Push(const AgentResult &result)
         {
-            running_job = 0;
-            is_alive = false;
-            if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-            {
-                cerr << "socket: " << strerror(errno) << std::endl;
-
-                // exit(EXIT_FAILURE);
-            }
-
-            int32_t on = 1;
-            if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on)) < 0)
-            {
-                cerr << "setsockopt: " << strerror(errno) << std::endl;
-            }
-
-            if (setsockopt(sock_fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&on, sizeof(on)) < 0)
-            {
-                cerr << "setsockopt: " << strerror(errno) << std::endl;
-            }
+            PushResult(_ring, _notifier, result);
         }
 
         /**
-         * @brief Destroy the Agent object.
+         * @brief Get the number of results waiting to be written, from any thread.
          */
-        ~Agent() = default;
+        size_t GetQueueSize()
+        {
+            return _ring.GetSize();
+        }
 
         /**
-         * @brief Make a connection with a specified Agent.
-         *
-         * @return int32_t Status code.
+         * @brief Wake the thread up once a batch of results is queued.
          */
-        int32_t ConnectAgent()
+        void Notify()
         {
-            struct sockaddr_in serv_addr;
+            _notifier.Notify();
+        }
 
-            serv_addr.sin_family = AF_INET;
-            serv_addr.sin_port = htons(port[agent_id - 1]);
-            if (inet_pton(AF_INET, ip[agent_id - 1], &serv_addr.sin_addr) <= 0)
-            {
-                cerr << "inet_pton: Invalid address/ Address not supported" << strerror(errno) << std::endl;
-                return -1;
-            }
+    private:
+        void Run()
+        {
+            AgentResult batch[RESULT_BATCH_LEN];
+            uint64_t sync_ms = NowMs() + g_summary_sec * 1000;
+            uint64_t flush_ms = NowMs() + _flush_ms;
 
-            if (connect(sock_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+            while (1)
             {
-                cerr << "connect: " << strerror(errno) << std::endl;
-                return -1;
-            }
-
-            /* Register fd for polling */
-            poll_fd[agent_id - 1].fd = sock_fd;
-            poll_fd[agent_id - 1].events = POLLIN;
-            fcntl(sock_fd, F_SETFL, O_NONBLOCK); // Making socket fd a non-blocking
+                size_t count = _ring.TryPop(batch, RESULT_BATCH_LEN);
+                if (count > 0 && _registry.GetVersion() != _table->GetVersion())
+                {
+                    _table = _registry.Get();
+                    _store_jobs.clear();
+                }
 
-            is_alive = true;
+                for (size_t index = 0; index < count; index++)
+                {
+                    // Results are stored and written out with the URL of their job, unless it was removed since.
+                    Response &resp = batch[index].resp;
+                    JobParser *job = _table->Find(resp.job);
+                    uint32_t store_job;
+                    if (_store != nullptr && job != nullptr &&
+                        ((store_job = GetStoreJobId(*job)) == 0 || _store->Append(resp, batch[index].agent_id, store_job) != 0))
+                    {
+                        cerr << "Result store is not writable, results are not stored anymore." << endl;
+                        _store = nullptr;
+                    }
 
-            return 0;
-        }
+                    for (size_t output = 0; job != nullptr && output < _outputs.size(); output++)
+                    {
+                        if (_outputs[output]->Write(resp, batch[index].agent_id, *job) != 0)
+                        {
+                            DropOutput(output--);
+                        }
+                    }
+                }
 
-        /**
-         * @brief To send job details to Agent for execution.
-         *
-         * @param job A job instance which hold all the details.
-         *
-         * @return int32_t Status code.
-         */
-        int32_t SendReqToAgent(JobParser &job)
-        {
-            if (is_alive)
-            {
-                if (++running_job > MAX_AGENT_WORKER)
+                uint64_t now = NowMs();
+                if (now >= flush_ms || (_flush_ms == 0 && count < RESULT_BATCH_LEN))
                 {
-                    cerr << "At a time an agent " << agent_id << " can run maximum " << MAX_AGENT_WORKER << " job." << endl;
-                    return -1;
+                    for (size_t output = 0; output < _outputs.size(); output++)
+                    {
+                        if (_outputs[output]->Flush() != 0)
+                        {
+                            DropOutput(output--);
+                        }
+                    }
+                    flush_ms = now + _flush_ms;
                 }
 
-                Request request;
-                bzero((Request *)&request, sizeof(request));
-
-                cout << "Sending Job request to agent: " << agent_id << endl;
-                strcpy(request.url, job.GetUrl().c_str());
-                request.worker = running_job;
-                request.op = 1;
-                request.freq = job.GetFrequency();
+                if (_store != nullptr && now >= sync_ms)
+                {
+                    _store->Sync();
+                    sync_ms = now + g_summary_sec * 1000;
+                }
 
-                write(sock_fd, &request, sizeof(request));
-            }
-            else
-            {
-                cerr << "Agent " << agent_id << " is not alive." << endl;
+                if (count == 0)
+                {
+                    uint64_t timeout = (_flush_ms == 0) ? POLL_TIMEOUT_MS : min<uint64_t>(POLL_TIMEOUT_MS, flush_ms - now);
+                    _notifier.Wait(timeout, [&]() { return !_ring.IsEmpty(); });
+                }
             }
-            return 0;
         }
 
-        /**
-         * @brief Get the socket fd that is being used to connect with Agent.
-         *
-         * @return int32_t A socket file descriptor.
-         */
-        int32_t GetSocketFd()
+        uint32_t GetStoreJobId(JobParser &job)
         {
-            return sock_fd;
-        }
+            if (_store_jobs.size() <= (size_t)job.GetJobId())
+            {
+                _store_jobs.resize(job.GetJobId() + 1, 0);
+            }
 
-    private:
-        int32_t agent_id;
-        int32_t sock_fd;
-        int32_t running_job; // Keep the total count of tests running on Agent.
-        bool is_alive;
-    };
+            uint32_t &id = _store_jobs[job.GetJobId()];
+            if (id == 0)
+            {
+                id = _store->GetJobId(job.GetKey());
+            }
 
-    /**
-     * @brief Method to connect with Front End.
-     *
-     * @param resp Response from Agent.
-     * @param id Agent ID from where the response is received.
-     *
-     * @return int32_t Status code.
-     */
-    static int32_t PushDataToFrontEnd(Response &resp, int32_t &id)
-    {
-        if (strcmp(resp.message, "worker_not_present") == 0)
-        {
-            cerr << "This worker number  is not present at agent" << endl;
-            return -1;
+            return id;
         }
-        else
+
+        void DropOutput(size_t index)
         {
-            cout << resp.url << " " << resp.status << " (" << resp.runs << " runs)" << endl;
+            cerr << "Output " << _outputs[index]->GetPath() << " is not writable, results are not written there anymore." << endl;
+            _outputs.erase(_outputs.begin() + index);
         }
 
-        return 0;
-    }
+        JobRegistry &_registry;
+        shared_ptr<JobTable> _table;
+        TimeSeriesStore *_store;
+        vector<uint32_t> _store_jobs; // Store job id by job id of _table, 0 until looked up.
+        vector<unique_ptr<ResultOutput>> _outputs;
+        uint64_t _flush_ms;
+        SpscRing<AgentResult> _ring;
+        Notifier _notifier;
+        thread _thread;
+    };
 
     /**
-     * @brief Send job requests to Agents based on the agent IDs.
-     *
-     * @param agent List of Agent a Core is connected with.
-     * @param jobs Number of jobs to be performed by core.
+     * @brief Serve the metrics endpoint, forever. Rendering only reads the metric blocks and other atomics.
      *
-     * @return int32_t Status code.
+     * @param endpoint Listening endpoint.
+     * @param render Fills the exposition in.
      */
-    static int32_t PushJobRequestsToAgent(vector<Agent> &agent, vector<JobParser> jobs)
+    static void ServeMetrics(MetricsEndpoint &endpoint, MetricsEndpoint::Render render)
     {
-        int32_t job_count = jobs.size();
-        int32_t id = 0;
+        vector<struct pollfd> fds = {{endpoint.GetFd(), POLLIN, 0}};
 
-        for (int32_t itr = 0; itr < job_count; itr++)
+        while (1)
         {
-            id = jobs[itr].GetAgentId();
+            if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+            {
+                cerr << "poll: " << strerror(errno) << std::endl;
+            }
 
-            if (id <= 0 || id > MAX_AGENT)
+            for (size_t index = fds.size() - 1; index > 0; index--)
             {
-                cerr << "Core dont know agent with Id: " << id << endl;
-                continue;
+                if (fds[index].revents == 0)
+                {
+                    continue;
+                }
+
+                if (endpoint.Serve(fds[index].fd, render))
+                {
+                    endpoint.Close(fds[index].fd);
+                    fds.erase(fds.begin() + index);
+                }
+                else
+                {
+                    fds[index].events = endpoint.IsSending(fds[index].fd) ? POLLOUT : POLLIN;
+                }
             }
 
-            if (agent[id - 1].SendReqToAgent(jobs[itr]) != 0)
+            if (fds[0].revents & POLLIN)
             {
-                cout << "Failed to send request to Agent: " << id << endl;
-                continue;
+                int32_t fd;
+                while ((fd = endpoint.Accept()) >= 0)
+                {
+                    fds.push_back(pollfd{fd, POLLIN, 0});
+                }
             }
         }
-
-        return 0;
     }
 
     /**
-     * @brief Check for any events to read from Agents and identify the agent that has sent an response.
+     * @brief Keeps core alive: starts the threads and aggregates their results, it will spend rest of its life here.
      *
-     * @return int32_t Status code.
+     * @param ingest Network threads, each one serving its own Agents.
+     * @param notifier Wakes this thread up when a network thread has queued results.
+     * @param registry Current job table, to find the job of each response.
+     * @param store Store every result is appended to, null when results are not stored.
+     * @param outputs Outputs every result is written to.
+     * @param flush_ms Time results are buffered for at most before being written to the outputs.
+     * @param alerts Stream the alerts of the anomaly detectors are written to.
+     * @param metrics Block of this thread, the ingest threads have their own.
+     * @param endpoint Listening metrics endpoint, or null.
      */
-    static int32_t AgentPoll()
+    static void CoreHandler(vector<unique_ptr<IngestThread>> &ingest, Notifier &notifier, JobRegistry &registry, TimeSeriesStore *store,
+                            vector<unique_ptr<ResultOutput>> &outputs, uint64_t flush_ms, ostream &alerts, MetricBlock *metrics,
+                            MetricsEndpoint *endpoint)
     {
-        for (int32_t index = 0; index < MAX_AGENT; index++)
+        AgentResult batch[RESULT_BATCH_LEN];
+        Aggregator aggregator(registry.Get(), alerts);
+        unique_ptr<ResultSink> sink;
+
+        if (store != nullptr || !outputs.empty())
         {
-            if (poll_fd[index].revents != 0)
-            {
-                if (poll_fd[index].revents & POLLHUP)
+            sink.reset(new ResultSink(registry, store, outputs, flush_ms));
+            sink->Start();
+        }
+
+        if (endpoint != nullptr)
+        {
+            MetricsEndpoint::Render render = [&ingest, &registry, &sink, metrics](string &out) {
+                vector<MetricSeries> network;
+                for (unique_ptr<IngestThread> &thread : ingest)
                 {
-                    if (close(poll_fd[index].fd) == -1)
-                    {
-                        cerr << "close: " << strerror(errno) << std::endl;
-                    }
+                    network.push_back({thread->GetMetrics(), "thread=\"ingest-" + to_string(network.size() + 1) + "\""});
+                }
+                vector<MetricSeries> all = network;
+                all.push_back({metrics, "thread=\"aggregator\""});
+
+                PutMetric(out, "swm_results_total", "counter", "Results received from the agents.", METRIC_RESULTS, network);
+                PutMetric(out, "swm_results_failed_total", "counter", "Results of failed probes: transfer error or HTTP error status.",
+                          METRIC_PROBES_FAILED, {all.back()});
+                PutMetric(out, "swm_alerts_raised_total", "counter", "Alerts raised by the anomaly detectors.", METRIC_ALERTS, {all.back()});
+                PutSummary(out, "swm_loop_iteration_seconds", "Time spent handling the events of one event loop wake up.", METRIC_LOOP_US,
+                           METRIC_LOOP_COUNT, all);
+                PutMetric(out, "swm_socket_received_bytes_total", "counter", "Bytes read from the agents.", METRIC_BYTES_IN, network);
+                PutMetric(out, "swm_socket_sent_bytes_total", "counter", "Bytes written to the agents.", METRIC_BYTES_OUT, network);
+                PutMetric(out, "swm_outbound_queue_bytes", "gauge", "Bytes waiting for the agent sockets to be writable.", METRIC_QUEUE_BYTES,
+                          network);
+
+                PutMetricFamily(out, "swm_result_queue_depth", "gauge", "Results queued from one thread to the next.");
+                for (size_t index = 0; index < ingest.size(); index++)
+                {
+                    PutMetricSample(out, "swm_result_queue_depth", network[index].labels, ingest[index]->GetRing().GetSize());
                 }
-                else if ((poll_fd[index].revents & POLLIN))
+                if (sink)
                 {
-                    return (index + 1);
+                    PutMetricSample(out, "swm_result_queue_depth", "thread=\"sink\"", sink->GetQueueSize());
                 }
-                else if (!(poll_fd[index].revents & POLLNVAL))
+
+                shared_ptr<JobTable> table = registry.Get();
+                PutMetricFamily(out, "swm_config_version", "gauge", "Version of the job table in use, 1 at start and one more per reload or move of pool jobs.");
+                PutMetricSample(out, "swm_config_version", "", table->GetVersion());
+
+                PutMetricFamily(out, "swm_job_last_latency_seconds", "gauge", "Total time of the last probe of each job.");
+                for (JobParser &job : table->GetJobs())
                 {
-                    if (close(poll_fd[index].fd) == -1)
+                    uint32_t last_us = table->GetLastUs(job.GetJobId());
+                    if (last_us != UINT32_MAX)
                     {
-                        cerr << "close: " << strerror(errno) << std::endl;
+                        PutMetricSample(out, "swm_job_last_latency_seconds",
+                                        "job=\"" + to_string(job.GetJobId()) + "\",agent=\"" + to_string(job.GetAgentId()) + "\",pool=\"" +
+                                            job.GetPool() + "\",url=\"" + EscapeLabel(job.GetUrl()) + "\"",
+                                        last_us / 1e6);
                     }
                 }
-            }
+            };
+            thread(ServeMetrics, std::ref(*endpoint), render).detach();
         }
 
-        return 0;
-    }
-
-    /**
-     * @brief Keeps core alive and polling for response from agents and it will spend rest of its life here.
-     *
-     * @param agents A list of agent core it connected with.
-     */
-    static void CoreHandler(vector<Agent> &agents)
-    {
-        int32_t ret = 0;
-        int32_t agent_index = 0;
-        Response response;
-        bzero((Response *)&response, sizeof(response));
+        for (unique_ptr<IngestThread> &thread : ingest)
+        {
+            thread->Start();
+        }
 
+        uint64_t summary_ms = NowMs() + g_summary_sec * 1000;
         while (1)
         {
-            ret = poll(poll_fd, MAX_AGENT, POLL_TIMEOUT_MS);
-            if (ret < 0)
+            size_t total = 0;
+
+            uint64_t start_us = MonotonicUs();
+            uint64_t failed = 0;
+
+            // One batch per network thread and round, so that a busy one does not starve the others.
+            for (unique_ptr<IngestThread> &thread : ingest)
             {
-                cerr << "poll: " << strerror(errno) << std::endl;
+                size_t count = thread->GetRing().TryPop(batch, RESULT_BATCH_LEN);
+                if (count > 0 && registry.GetVersion() != aggregator.GetTable()->GetVersion())
+                {
+                    aggregator.Update(registry.Get());
+                }
+
+                for (size_t index = 0; index < count; index++)
+                {
+                    if (!aggregator.Record(batch[index].resp, batch[index].agent_id))
+                    {
+                        continue; // Late result of a removed job.
+                    }
+                    failed += IsFailedProbe(batch[index].resp.http_code, batch[index].resp.error) ? 1 : 0;
+                    if (sink)
+                    {
+                        sink->Push(batch[index]);
+                    }
+                }
+                total += count;
             }
 
-            // Check for any response from Agents.
-            if ((agent_index = AgentPoll()))
+            if (total > 0)
             {
-                ret = read(agents[agent_index - 1].GetSocketFd(), &response, sizeof(response));
-                if (ret < 0)
+                if (sink)
                 {
-                    cerr << "read: " << strerror(errno) << std::endl;
+                    sink->Notify();
                 }
 
-                // Send data to front end for printing.
-                PushDataToFrontEnd(response, agent_index);
+                metrics->Add(METRIC_RESULTS, total);
+                metrics->Add(METRIC_PROBES_FAILED, failed);
+                metrics->Add(METRIC_ALERTS, aggregator.FlushAlerts());
+                metrics->Add(METRIC_LOOP_US, MonotonicUs() - start_us);
+                metrics->Add(METRIC_LOOP_COUNT, 1);
             }
-            else
+
+            uint64_t now = NowMs();
+            if (now >= summary_ms)
+            {
+                if (registry.GetVersion() != aggregator.GetTable()->GetVersion())
+                {
+                    aggregator.Update(registry.Get()); // The summary drops the removed jobs, even without results.
+                }
+                aggregator.PrintSummary();
+                summary_ms = now + g_summary_sec * 1000;
+            }
+
+            if (total == 0)
             {
-                // cout<<"Poll timeout..."<<endl;
+                notifier.Wait(min<uint64_t>(POLL_TIMEOUT_MS, summary_ms - now), [&]() {
+                    for (unique_ptr<IngestThread> &thread : ingest)
+                    {
+                        if (!thread->GetRing().IsEmpty())
+                        {
+                            return true;
+                        }
+                    }
+                    return false;
+                });
             }
         }
     }
@@ -484,8 +4708,114 @@ using namespace CoreImplementation;
  */
 int32_t main(int32_t argc, char *argv[])
 {
+    string inventory;
+    string store_dir;
+    string query_dir;
+    string metrics_endpoint;
+    string alert_path;
+    vector<string> output_specs;
+    int64_t flush_ms = OUTPUT_FLUSH_MS;
+    int64_t rotate_mb = 0;
+    int64_t from_sec = 0;
+    int64_t to_sec = 0;
+    int64_t step_sec = 0;
+    string query_job;
+    int32_t threads = 0;
+    int32_t opt;
+
+    // A peer going away makes writes fail with EPIPE, handled like any other failed write, rather than kill the process.
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "a:n:i:rs:o:F:R:A:q:f:t:j:d:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            inventory = optarg;
+            break;
+        case 'n':
+            threads = atoi(optarg);
+            if (threads < 1)
+            {
+                cerr << "At least 1 ingest thread is needed." << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            g_summary_sec = atoi(optarg);
+            if (g_summary_sec < 1)
+            {
+                cerr << "Summary interval must be at least 1 second." << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            output_specs.push_back("text");
+            break;
+        case 's':
+            store_dir = optarg;
+            break;
+        case 'o':
+            output_specs.push_back(optarg);
+            break;
+        case 'F':
+            flush_ms = atoll(optarg);
+            if (flush_ms < 0)
+            {
+                cerr << "Flush interval cannot be negative." << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            rotate_mb = atoll(optarg);
+            if (rotate_mb < 0)
+            {
+                cerr << "Rotation size cannot be negative." << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'A':
+            alert_path = optarg;
+            break;
+        case 'q':
+            query_dir = optarg;
+            break;
+        case 'f':
+            from_sec = atoll(optarg);
+            break;
+        case 't':
+            to_sec = atoll(optarg);
+            break;
+        case 'j':
+            query_job = optarg;
+            break;
+        case 'd':
+            step_sec = atoll(optarg);
+            break;
+        case 'm':
+            metrics_endpoint = optarg;
+            break;
+        default:
+            printUsage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Query mode reads a result store and exits.
+    if (!query_dir.empty())
+    {
+        int64_t now_sec = WallClockMs() / 1000;
+        int64_t from_ms = (from_sec < 0 ? now_sec + from_sec : from_sec) * 1000;
+        int64_t to_ms = to_sec == 0 ? INT64_MAX : (to_sec < 0 ? now_sec + to_sec : to_sec) * 1000;
+        int32_t ret = (step_sec > 0) ? QueryDownsampled(query_dir, from_ms, to_ms, query_job, step_sec)
+                                     : QueryRows(query_dir, from_ms, to_ms, query_job);
+
+        cout << flush;
+        exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     // Checks for Command line arguments.
-    if (argc != 2)
+    if (argc - optind != 1)
     {
         cerr << "Core must take only 1 argument, Its Configuration file path." << endl;
         printUsage();
@@ -493,7 +4823,7 @@ int32_t main(int32_t argc, char *argv[])
     }
 
     // Create object for configuration to access conf data.
-    ConfigParser conf_data(argv[1]);
+    ConfigParser conf_data(argv[optind]);
 
     // Parse config file for jobs to run on agents.
     if (conf_data.parseConfig() != 0)
@@ -502,24 +4832,116 @@ int32_t main(int32_t argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    // Agents come from the inventory, or from the Agent IDs of the jobs at their default endpoints.
+    vector<AgentEndpoint> endpoints;
+    if (!inventory.empty())
+    {
+        InventoryParser inventory_data(inventory);
+        if (inventory_data.parseInventory() != 0)
+        {
+            cerr << "Agent inventory parsing failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+        endpoints = inventory_data.GetAgentList();
+    }
+    else
+    {
+        DefaultInventory(conf_data.GetJobList(), endpoints);
+    }
+
+    // Open the result store before connecting, so a bad path fails early.
+    unique_ptr<TimeSeriesStore> store;
+    if (!store_dir.empty())
+    {
+        store.reset(new TimeSeriesStore(store_dir));
+        if (store->Open() != 0)
+        {
+            cerr << "Result store opening failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // And the outputs.
+    vector<unique_ptr<ResultOutput>> outputs;
+    for (string &spec : output_specs)
+    {
+        if (OpenOutput(spec, rotate_mb << 20, outputs) != 0)
+        {
+            cerr << "Result output opening failed." << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Alerts go to stdout without a file.
+    ofstream alert_file;
+    if (!alert_path.empty() && alert_path != "-")
+    {
+        alert_file.open(alert_path, ios::app);
+        if (!alert_file)
+        {
+            cerr << "Alert file " << alert_path << " opening failed: " << strerror(errno) << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Create instances for Agents.
     vector<Agent> agents;
-    for (int32_t agent_num = 1; agent_num <= MAX_AGENT; agent_num++)
+    unordered_map<int32_t, size_t> agent_index;
+    unique_ptr<AgentStatus[]> agent_status(new AgentStatus[endpoints.size()]);
+    for (size_t index = 0; index < endpoints.size(); index++)
+    {
+        agent_index[endpoints[index].id] = index;
+        agents.push_back(Agent(endpoints[index], &agent_status[index]));
+    }
+
+    // Spread the Agents over the network threads, by default one thread per CPU.
+    if (threads == 0)
+    {
+        threads = max<int32_t>(1, thread::hardware_concurrency());
+    }
+    threads = max<int32_t>(1, min<int32_t>(threads, agents.size()));
+
+    // Every thread counts into its own metrics block, the last one is the aggregation thread's.
+    MetricsArea metrics(threads + 1);
+    MetricsEndpoint metrics_server;
+    if (!metrics_endpoint.empty() && metrics_server.Listen(metrics_endpoint) != 0)
     {
-        agents.push_back(Agent(agent_num));
+        exit(EXIT_FAILURE);
+    }
+
+    // Every thread reads the jobs from the job table, a new one is published on each config reload.
+    JobRegistry registry(make_shared<JobTable>(std::move(conf_data.GetJobList()), 1, 1));
+
+    Notifier ingest_notifier;
+    vector<unique_ptr<IngestThread>> ingest;
+    for (int32_t index = 0; index < threads; index++)
+    {
+        ingest.push_back(unique_ptr<IngestThread>(new IngestThread(registry, ingest_notifier, metrics.Get(index))));
+    }
+    for (size_t index = 0; index < agents.size(); index++)
+    {
+        ingest[index % threads]->Attach(agents[index]);
     }
 
-    // Create connection with all agents.
-    for (Agent &agent : agents)
+    // Jobs are sent by the network threads, whenever an Agent starts a session.
+    AssignJobsToAgents(agents, agent_index, *registry.Get());
+
+    // Jobs added, removed or changed in the config file from now on are sent to their Agents.
+    // Jobs of the pools are placed once the Agents have connected, and moved as Agents join, leave or get loaded.
+    Balancer balancer(endpoints, agent_status.get());
+    ConfigWatcher watcher(argv[optind], registry, agent_index, balancer);
+    if (watcher.Start(conf_data.GetScriptPaths()) != 0)
     {
-        agent.ConnectAgent();
+        cerr << "Config file changes are not watched, restart core to apply them. Jobs of the pools are still placed." << endl;
     }
 
-    // Send jobs to respective agents.
-    PushJobRequestsToAgent(agents, conf_data.GetJobList());
+    // One session for every Agent, it lets an Agent that only lost the connection keep its jobs.
+    random_device random;
+    g_session = ((uint64_t)random() << 32 | random()) | 1;
 
     // Core process handler.
-    CoreHandler(agents);
+    CoreHandler(ingest, ingest_notifier, registry, store.get(), outputs, flush_ms, alert_file.is_open() ? (ostream &)alert_file : cout,
+                metrics.Get(threads), metrics_endpoint.empty() ? nullptr : &metrics_server);
 
     cerr << "If you are seeing this, there is something is fishy!!!" << endl;
 